@@ -0,0 +1,734 @@
+/*
+ * Benchmarks for the tracking hot paths
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Runs each benchmark on synthetic input in batches of iterations and
+ * prints one JSON object per benchmark to stdout, containing the median
+ * time per iteration and the number of heap allocations per iteration.
+ * An iteration processes one frame, pulse, or report, as given by the
+ * unit field.
+ */
+#include <asm/byteorder.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+#include "device.h"
+#include "flicker.h"
+#include "hololens-hid-reports.h"
+#include "hololens-imu.h"
+#include "leds.h"
+#include "lenovo-explorer.h"
+#include "lighthouse.h"
+#include "maths.h"
+#include "motion-controller.h"
+#include "opencv.h"
+#include "rift.h"
+#include "rift-hid-reports.h"
+#include "synthetic-frame.h"
+#include "vive-headset.h"
+#include "vive-hid-reports.h"
+#include "vive-imu.h"
+
+#define BENCH_BATCHES		5
+#define BENCH_BATCH_NS		50000000ULL
+#define BENCH_NUM_LEDS		40
+/* Exit code that marks a benchmark as skipped in meson test */
+#define BENCH_SKIP		77
+
+GList *device_list;
+
+static uint64_t bench_allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/*
+ * Count heap allocations by wrapping the glibc allocator. GLib uses the
+ * system allocator, so this includes g_malloc and friends.
+ */
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+struct bench {
+	const char *name;
+	const char *unit;
+	/* Returns the benchmark state, or NULL to skip the benchmark */
+	void *(*setup)(const struct bench *bench);
+	void (*run)(void *data, uint64_t iteration);
+	void (*teardown)(void *data);
+	/* Prints additional JSON members after the timed runs, optional */
+	void (*report)(void *data);
+	int width;
+	int height;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Deterministic pseudo random numbers, so every run sees the same input */
+static uint32_t bench_random(uint32_t *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+/*
+ * A DK2-like object with LEDs on rings around a half sphere of 10 cm radius,
+ * all facing outwards, with blink patterns that differ in at least three
+ * bits so that single bit errors can be corrected.
+ */
+static void bench_leds_init(struct leds *leds)
+{
+	unsigned int pattern = 0;
+	int i, j;
+
+	leds_init(leds, BENCH_NUM_LEDS);
+	for (i = 0; i < BENCH_NUM_LEDS; i++) {
+		double phi = 2 * M_PI * i / 8;
+		double theta = M_PI / 2 * (i / 8 + 1) / 6;
+		vec3 *point = &leds->model.points[i];
+		vec3 *normal = &leds->model.normals[i];
+
+		normal->x = sin(theta) * cos(phi);
+		normal->y = sin(theta) * sin(phi);
+		normal->z = -cos(theta);
+		point->x = 0.1 * normal->x;
+		point->y = 0.1 * normal->y;
+		point->z = 0.1 * normal->z;
+
+		for (;; pattern++) {
+			int bits = __builtin_popcount(pattern);
+
+			if (bits < 4 || bits > 6)
+				continue;
+			for (j = 0; j < i; j++) {
+				if (__builtin_popcount(pattern ^
+						       leds->patterns[j]) < 3)
+					break;
+			}
+			if (j == i)
+				break;
+		}
+		leds->patterns[i] = pattern++;
+	}
+}
+
+/*
+ * Blob detection on synthetic frames of the benchmark object one meter in
+ * front of the camera, turned by 20° around the vertical axis, with
+ * background noise and reflections. The object does not move, so the ten
+ * frames of a full blink pattern cycle are rendered once and repeated.
+ */
+#define BENCH_CYCLE		10
+#define BENCH_MAX_TRUTH		(2 * BENCH_NUM_LEDS)
+
+struct blobwatch_bench {
+	struct blobwatch *bw;
+	struct leds leds;
+	struct synthetic_camera camera;
+	struct dpose pose;
+	uint8_t *frame[BENCH_CYCLE];
+	uint8_t phase[BENCH_CYCLE];
+	struct synthetic_blob truth[BENCH_CYCLE][BENCH_MAX_TRUTH];
+	int num_truth[BENCH_CYCLE];
+	bool track;
+	uint64_t next;
+};
+
+static void *blobwatch_bench_setup(const struct bench *bench)
+{
+	struct blobwatch_bench *b = g_new0(struct blobwatch_bench, 1);
+	struct synthetic_camera *camera = &b->camera;
+	struct synthetic_frame_generator *gen;
+	struct synthetic_trajectory trajectory = {
+		.pose = {
+			.rotation = { 0, sin(M_PI / 18), 0, cos(M_PI / 18) },
+			.translation = { 0, 0, 1 },
+		},
+	};
+	struct synthetic_options options = {
+		.frame_rate = 60,
+		.noise = 16,
+		.reflections = true,
+		.seed = 1,
+	};
+	double f = 0.93 * bench->width;
+	int i;
+
+	camera->width = bench->width;
+	camera->height = bench->height;
+	camera->camera_matrix = (dmat3){{ f, 0, bench->width / 2.0,
+					  0, f, bench->height / 2.0,
+					  0, 0, 1 }};
+	camera->dist_coeffs[0] = -0.05;
+	camera->dist_coeffs[1] = 0.01;
+
+	bench_leds_init(&b->leds);
+	gen = synthetic_frame_generator_new(&b->leds, camera, &trajectory,
+					    &options);
+	synthetic_frame_generator_pose(gen, 0, &b->pose);
+	for (i = 0; i < BENCH_CYCLE; i++) {
+		b->frame[i] = g_malloc(bench->width * bench->height);
+		b->num_truth[i] = synthetic_frame_generator_render(gen, i,
+						b->frame[i], b->truth[i],
+						BENCH_MAX_TRUTH, &b->phase[i]);
+	}
+	synthetic_frame_generator_free(gen);
+
+	b->bw = blobwatch_new(bench->width, bench->height);
+
+	/* Also identify LEDs and estimate the pose from identified blobs */
+	b->track = strncmp(bench->name, "tracking-", 9) == 0;
+	blobwatch_set_flicker(b->track);
+
+	return b;
+}
+
+static void blobwatch_bench_process(struct blobwatch_bench *b,
+				    struct blobservation **ob, dquat *rot,
+				    dvec3 *trans)
+{
+	int i = b->next++ % BENCH_CYCLE;
+
+	blobwatch_process(b->bw, b->frame[i], 0, 0, b->camera.width,
+			  b->camera.height, b->phase[i],
+			  b->track ? &b->leds : NULL, ob);
+	if (!b->track || !*ob)
+		return;
+
+	estimate_initial_pose((*ob)->blobs, (*ob)->num_blobs,
+			      b->leds.model.points, b->leds.model.num_points,
+			      &b->camera.camera_matrix, b->camera.dist_coeffs,
+			      rot, trans, false);
+}
+
+static void blobwatch_bench_run(void *data,
+				G_GNUC_UNUSED uint64_t iteration)
+{
+	struct blobwatch_bench *b = data;
+	struct blobservation *ob;
+	dquat rot = { 0, 0, 0, 1 };
+	dvec3 trans = { 0, 0, 0 };
+
+	blobwatch_bench_process(b, &ob, &rot, &trans);
+}
+
+/*
+ * Processes another ten pattern cycles outside of the timed loop and
+ * compares the results against the ground truth.
+ */
+static void blobwatch_bench_report(void *data)
+{
+	struct blobwatch_bench *b = data;
+	uint64_t visible = 0, detected = 0, spurious = 0;
+	uint64_t identified = 0, misidentified = 0, poses = 0;
+	double blob_error = 0, translation_error = 0, rotation_error = 0;
+	int frame, i, j;
+
+	for (frame = 0; frame < 10 * BENCH_CYCLE; frame++) {
+		const struct synthetic_blob *truth;
+		struct blobservation *ob;
+		dquat rot = { 0, 0, 0, 1 };
+		dvec3 trans = { 0, 0, 0 };
+		int num_truth;
+
+		truth = b->truth[b->next % BENCH_CYCLE];
+		num_truth = b->num_truth[b->next % BENCH_CYCLE];
+		blobwatch_bench_process(b, &ob, &rot, &trans);
+		if (!ob)
+			continue;
+
+		for (j = 0; j < num_truth; j++)
+			if (truth[j].led_id >= 0)
+				visible++;
+
+		for (i = 0; i < ob->num_blobs; i++) {
+			const struct blob *blob = &ob->blobs[i];
+			const struct synthetic_blob *t = NULL;
+			double min_dist = INFINITY;
+
+			for (j = 0; j < num_truth; j++) {
+				double dx = blob->x - truth[j].x;
+				double dy = blob->y - truth[j].y;
+				double dist = sqrt(dx * dx + dy * dy);
+
+				if (dist < min_dist) {
+					min_dist = dist;
+					t = &truth[j];
+				}
+			}
+			if (!t || t->led_id < 0 || min_dist > t->radius + 1) {
+				spurious++;
+				continue;
+			}
+
+			detected++;
+			blob_error += min_dist;
+			if (blob->led_id == t->led_id)
+				identified++;
+			else if (blob->led_id >= 0)
+				misidentified++;
+		}
+
+		if (b->track && HAVE_OPENCV && trans.z > 0) {
+			double dx = trans.x - b->pose.translation.x;
+			double dy = trans.y - b->pose.translation.y;
+			double dz = trans.z - b->pose.translation.z;
+			double dot = fabs(dquat_dot(&rot, &b->pose.rotation));
+
+			translation_error += sqrt(dx * dx + dy * dy + dz * dz);
+			rotation_error += 2 * acos(dot < 1 ? dot : 1);
+			poses++;
+		}
+	}
+
+	printf(", \"blob_error_px\": %.3f, \"detection_rate\": %.3f, "
+	       "\"spurious_per_frame\": %.2f",
+	       detected ? blob_error / detected : 0.0,
+	       visible ? (double)detected / visible : 0.0,
+	       (double)spurious / (10 * BENCH_CYCLE));
+	if (!b->track)
+		return;
+	printf(", \"identification_rate\": %.3f, "
+	       "\"misidentification_rate\": %.3f",
+	       visible ? (double)identified / visible : 0.0,
+	       detected ? (double)misidentified / detected : 0.0);
+	if (poses) {
+		printf(", \"translation_error_mm\": %.3f, "
+		       "\"rotation_error_deg\": %.3f",
+		       1000 * translation_error / poses,
+		       180 / M_PI * rotation_error / poses);
+	}
+}
+
+static void blobwatch_bench_teardown(void *data)
+{
+	struct blobwatch_bench *b = data;
+	int i;
+
+	blobwatch_set_flicker(false);
+	blobwatch_free(b->bw);
+	leds_fini(&b->leds);
+	for (i = 0; i < BENCH_CYCLE; i++)
+		g_free(b->frame[i]);
+	g_free(b);
+}
+
+/*
+ * LED identification from blinking patterns, with blobs whose brightness
+ * toggles every frame.
+ */
+struct flicker_bench {
+	struct blob blobs[BENCH_NUM_LEDS];
+	struct leds leds;
+};
+
+static void *flicker_bench_setup(G_GNUC_UNUSED const struct bench *bench)
+{
+	struct flicker_bench *b = g_new0(struct flicker_bench, 1);
+	uint32_t seed = 1;
+	int i;
+
+	leds_init(&b->leds, BENCH_NUM_LEDS);
+	for (i = 0; i < BENCH_NUM_LEDS; i++)
+		b->leds.patterns[i] = bench_random(&seed) & 0x3ff;
+
+	for (i = 0; i < BENCH_NUM_LEDS; i++) {
+		b->blobs[i].age = 10;
+		b->blobs[i].area = 20;
+		b->blobs[i].last_area = 10;
+		b->blobs[i].led_id = -1;
+		b->blobs[i].pattern = b->leds.patterns[i];
+	}
+
+	return b;
+}
+
+static void flicker_bench_run(void *data, uint64_t iteration)
+{
+	struct flicker_bench *b = data;
+	int i;
+
+	for (i = 0; i < BENCH_NUM_LEDS; i++) {
+		uint32_t area = b->blobs[i].area;
+
+		b->blobs[i].area = b->blobs[i].last_area;
+		b->blobs[i].last_area = area;
+	}
+
+	flicker_process(b->blobs, BENCH_NUM_LEDS, iteration % 10, &b->leds);
+}
+
+static void flicker_bench_teardown(void *data)
+{
+	struct flicker_bench *b = data;
+
+	leds_fini(&b->leds);
+	g_free(b);
+}
+
+/*
+ * Initial pose estimation from identified blobs, projected from LEDs on a
+ * half sphere one meter in front of the DK2 camera.
+ */
+struct pose_bench {
+	struct blob blobs[BENCH_NUM_LEDS];
+	vec3 leds[BENCH_NUM_LEDS];
+	dmat3 camera_matrix;
+	double dist_coeffs[5];
+};
+
+static void *pose_bench_setup(G_GNUC_UNUSED const struct bench *bench)
+{
+#if HAVE_OPENCV
+	struct pose_bench *b = g_new0(struct pose_bench, 1);
+	const double f = 700.0, cx = 376.0, cy = 240.0;
+	int i;
+
+	b->camera_matrix = (dmat3){{ f, 0, cx, 0, f, cy, 0, 0, 1 }};
+
+	for (i = 0; i < BENCH_NUM_LEDS; i++) {
+		double phi = 2 * M_PI * i / 8;
+		double theta = M_PI / 2 * (i / 8 + 1) / 6;
+		vec3 *led = &b->leds[i];
+
+		led->x = 0.1 * sin(theta) * cos(phi);
+		led->y = 0.1 * sin(theta) * sin(phi);
+		led->z = -0.1 * cos(theta);
+
+		b->blobs[i].x = f * led->x / (1.0 + led->z) + cx;
+		b->blobs[i].y = f * led->y / (1.0 + led->z) + cy;
+		b->blobs[i].led_id = i;
+	}
+
+	return b;
+#else
+	return NULL;
+#endif
+}
+
+static void pose_bench_run(void *data, G_GNUC_UNUSED uint64_t iteration)
+{
+	struct pose_bench *b = data;
+	dquat rot = { 0, 0, 0, 1 };
+	dvec3 trans = { 0, 0, 1 };
+
+	estimate_initial_pose(b->blobs, BENCH_NUM_LEDS, b->leds,
+			      BENCH_NUM_LEDS, &b->camera_matrix,
+			      b->dist_coeffs, &rot, &trans, false);
+}
+
+/*
+ * A single Lighthouse base station at 120 Hz, alternating between rotors.
+ * Each period starts with a sync flash seen by all 32 sensors, followed by
+ * a sweep pulse per sensor.
+ */
+#define LIGHTHOUSE_SENSORS	32
+#define LIGHTHOUSE_PERIOD	400000
+#define LIGHTHOUSE_PULSES	(2 * LIGHTHOUSE_SENSORS)
+
+struct lighthouse_bench {
+	struct lighthouse_watchman watchman;
+};
+
+static void *lighthouse_bench_setup(G_GNUC_UNUSED const struct bench *bench)
+{
+	struct lighthouse_bench *b = g_new0(struct lighthouse_bench, 1);
+
+	lighthouse_watchman_init(&b->watchman);
+	b->watchman.name = "Benchmark";
+
+	return b;
+}
+
+static void lighthouse_bench_run(void *data, uint64_t iteration)
+{
+	struct lighthouse_bench *b = data;
+	uint64_t period = iteration / LIGHTHOUSE_PULSES;
+	unsigned int pulse = iteration % LIGHTHOUSE_PULSES;
+	uint32_t start = period * LIGHTHOUSE_PERIOD;
+	uint8_t id = pulse % LIGHTHOUSE_SENSORS;
+
+	if (pulse < LIGHTHOUSE_SENSORS) {
+		/* Sync pulse, rotor bit toggles every period */
+		lighthouse_watchman_handle_pulse(&b->watchman, id,
+						 3000 + 500 * (period & 1),
+						 start + 4 * id);
+	} else {
+		lighthouse_watchman_handle_pulse(&b->watchman, id, 200,
+						 start + 100000 + 6000 * id);
+	}
+}
+
+/*
+ * HID report decoders, fed through the dispatch operation of a device that
+ * is never started. The Vive headset has no dispatch operation, so its IMU
+ * reports are passed to the decoder directly.
+ */
+struct hid_bench {
+	OuvrtDevice *dev;
+	uint8_t report[512];
+	size_t size;
+	struct vive_imu imu;
+};
+
+static void *hid_bench_setup(const struct bench *bench)
+{
+	struct hid_bench *b = g_new0(struct hid_bench, 1);
+
+	if (strcmp(bench->name, "hid-rift") == 0) {
+		b->dev = rift_dk2_new(NULL);
+		b->size = 64;
+		b->report[0] = RIFT_SENSOR_MESSAGE_ID;
+	} else if (strcmp(bench->name, "hid-motion-controller") == 0) {
+		b->dev = motion_controller_new(NULL);
+		b->size = 45;
+		b->report[0] = 0x01;
+	} else if (strcmp(bench->name, "hid-hololens-imu") == 0) {
+		b->dev = hololens_imu_new(NULL);
+		b->size = HOLOLENS_IMU_REPORT_SIZE;
+		b->report[0] = HOLOLENS_IMU_REPORT_ID;
+	} else if (strcmp(bench->name, "hid-lenovo-explorer") == 0) {
+		b->dev = lenovo_explorer_new(NULL);
+		b->size = 2;
+		b->report[0] = 0x01;
+	} else {
+		b->dev = vive_headset_new(NULL);
+		b->size = sizeof(struct vive_imu_report);
+		b->report[0] = VIVE_IMU_REPORT_ID;
+		b->imu.gyro_range = M_PI / 180.0 * 250;
+		b->imu.accel_range = STANDARD_GRAVITY * 2;
+		b->imu.acc_scale = (vec3){ 1.0f, 1.0f, 1.0f };
+		b->imu.gyro_scale = (vec3){ 1.0f, 1.0f, 1.0f };
+		b->imu.state.pose.rotation.w = 1.0;
+	}
+
+	b->dev->name = strdup(bench->name);
+
+	return b;
+}
+
+static void hid_bench_run(void *data, uint64_t iteration)
+{
+	struct hid_bench *b = data;
+	struct timespec ts = {
+		.tv_sec = iteration / 1000,
+		.tv_nsec = iteration % 1000 * 1000000,
+	};
+
+	if (b->report[0] == VIVE_IMU_REPORT_ID) {
+		struct vive_imu_report *report = (void *)b->report;
+		int i;
+
+		/* Three new samples every 4 ms */
+		for (i = 0; i < 3; i++) {
+			uint32_t seq = iteration * 3 + i;
+
+			report->sample[i].seq = seq;
+			report->sample[i].time = __cpu_to_le32(seq * 48000);
+		}
+		vive_imu_decode_message(b->dev, &b->imu, b->report, b->size);
+		return;
+	}
+
+	if (b->report[0] == RIFT_SENSOR_MESSAGE_ID) {
+		struct rift_sensor_message *message = (void *)b->report;
+
+		/* One sample per millisecond */
+		message->num_samples = 1;
+		message->timestamp = __cpu_to_le32(iteration * 1000);
+	}
+
+	ouvrt_device_replay_report(b->dev, 0, b->report, b->size, &ts);
+}
+
+static void hid_bench_teardown(void *data)
+{
+	struct hid_bench *b = data;
+
+	g_object_unref(b->dev);
+	g_free(b);
+}
+
+static const struct bench benchmarks[] = {
+	{ "blobwatch-752x480", "frame", blobwatch_bench_setup,
+	  blobwatch_bench_run, blobwatch_bench_teardown,
+	  blobwatch_bench_report, 752, 480 },
+	{ "blobwatch-1280x960", "frame", blobwatch_bench_setup,
+	  blobwatch_bench_run, blobwatch_bench_teardown,
+	  blobwatch_bench_report, 1280, 960 },
+	{ "blobwatch-1280x481", "frame", blobwatch_bench_setup,
+	  blobwatch_bench_run, blobwatch_bench_teardown,
+	  blobwatch_bench_report, 1280, 481 },
+	{ "tracking-752x480", "frame", blobwatch_bench_setup,
+	  blobwatch_bench_run, blobwatch_bench_teardown,
+	  blobwatch_bench_report, 752, 480 },
+	{ "tracking-1280x960", "frame", blobwatch_bench_setup,
+	  blobwatch_bench_run, blobwatch_bench_teardown,
+	  blobwatch_bench_report, 1280, 960 },
+	{ "tracking-1280x481", "frame", blobwatch_bench_setup,
+	  blobwatch_bench_run, blobwatch_bench_teardown,
+	  blobwatch_bench_report, 1280, 481 },
+	{ "flicker", "frame", flicker_bench_setup, flicker_bench_run,
+	  flicker_bench_teardown, NULL, 0, 0 },
+	{ "estimate-initial-pose", "frame", pose_bench_setup, pose_bench_run,
+	  g_free, NULL, 0, 0 },
+	{ "lighthouse-pulses", "pulse", lighthouse_bench_setup,
+	  lighthouse_bench_run, g_free, NULL, 0, 0 },
+	{ "hid-rift", "report", hid_bench_setup, hid_bench_run,
+	  hid_bench_teardown, NULL, 0, 0 },
+	{ "hid-motion-controller", "report", hid_bench_setup, hid_bench_run,
+	  hid_bench_teardown, NULL, 0, 0 },
+	{ "hid-hololens-imu", "report", hid_bench_setup, hid_bench_run,
+	  hid_bench_teardown, NULL, 0, 0 },
+	{ "hid-lenovo-explorer", "report", hid_bench_setup, hid_bench_run,
+	  hid_bench_teardown, NULL, 0, 0 },
+	{ "hid-vive-imu", "report", hid_bench_setup, hid_bench_run,
+	  hid_bench_teardown, NULL, 0, 0 },
+};
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Runs a single benchmark. The batch size is doubled until a batch takes
+ * at least BENCH_BATCH_NS, then BENCH_BATCHES batches are measured.
+ * Returns 0 on success, or BENCH_SKIP if the benchmark is not available.
+ */
+static int bench_run(const struct bench *bench)
+{
+	double ns_per_iteration[BENCH_BATCHES];
+	uint64_t iteration = 0;
+	uint64_t batch = 1;
+	uint64_t allocations;
+	uint64_t start, end;
+	void *data;
+	int i;
+
+	data = bench->setup(bench);
+	if (!data) {
+		printf("{\"name\": \"%s\", \"unit\": \"%s\", "
+		       "\"skipped\": true}\n", bench->name, bench->unit);
+		return BENCH_SKIP;
+	}
+
+	for (;;) {
+		uint64_t n;
+
+		start = bench_now();
+		for (n = 0; n < batch; n++)
+			bench->run(data, iteration++);
+		end = bench_now();
+		if (end - start >= BENCH_BATCH_NS)
+			break;
+		batch *= 2;
+	}
+
+	allocations = __atomic_load_n(&bench_allocations, __ATOMIC_RELAXED);
+	for (i = 0; i < BENCH_BATCHES; i++) {
+		uint64_t n;
+
+		start = bench_now();
+		for (n = 0; n < batch; n++)
+			bench->run(data, iteration++);
+		end = bench_now();
+
+		ns_per_iteration[i] = (double)(end - start) / batch;
+	}
+	allocations = __atomic_load_n(&bench_allocations, __ATOMIC_RELAXED) -
+		      allocations;
+
+	qsort(ns_per_iteration, BENCH_BATCHES, sizeof(double), compare_double);
+
+	printf("{\"name\": \"%s\", \"unit\": \"%s\", "
+	       "\"iterations\": %" PRIu64 ", \"ns_per_iteration\": %.1f, "
+	       "\"min_ns_per_iteration\": %.1f, "
+	       "\"allocations_per_iteration\": %.3f",
+	       bench->name, bench->unit, batch * BENCH_BATCHES,
+	       ns_per_iteration[BENCH_BATCHES / 2], ns_per_iteration[0],
+	       (double)allocations / (batch * BENCH_BATCHES));
+	if (bench->report)
+		bench->report(data);
+	printf("}\n");
+	fflush(stdout);
+
+	bench->teardown(data);
+
+	return 0;
+}
+
+/* Keep diagnostic messages from the decoders out of the results */
+static void bench_print_ignore(G_GNUC_UNUSED const gchar *string)
+{
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int ret = 0;
+	int j;
+
+	g_set_print_handler(bench_print_ignore);
+
+	if (argc == 2 && strcmp(argv[1], "--list") == 0) {
+		for (i = 0; i < G_N_ELEMENTS(benchmarks); i++)
+			printf("%s\n", benchmarks[i].name);
+		return 0;
+	}
+
+	if (argc == 1) {
+		for (i = 0; i < G_N_ELEMENTS(benchmarks); i++)
+			bench_run(&benchmarks[i]);
+		return 0;
+	}
+
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < G_N_ELEMENTS(benchmarks); i++) {
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				break;
+		}
+		if (i == G_N_ELEMENTS(benchmarks)) {
+			fprintf(stderr, "Unknown benchmark: %s\n", argv[j]);
+			return 1;
+		}
+		ret = bench_run(&benchmarks[i]);
+	}
+
+	return ret;
+}
@@ -3,11 +3,128 @@
 # Copyright 2019 Philipp Zabel
 # SPDX-License-Identifier: GPL-2.0-or-later
 
-import gi, signal, os, sys
+import ctypes, gi, signal, os, sys
 gi.require_version('Gst', '1.0')
 gi.require_version('GLib', '2.0')
 from gi.repository import GLib, Gst
 
+# Debug attachment layout, see struct ouvrt_debug_attachment in src/debug.h
+MAX_BLOBS_PER_FRAME = 42
+MAX_IMU_SAMPLES = 32
+ATTACHMENT_MAGIC = 0x4144564f
+ATTACHMENT_VERSION = 1
+
+class Blob(ctypes.Structure):
+    _fields_ = [('x', ctypes.c_uint16), ('y', ctypes.c_uint16),
+                ('vx', ctypes.c_int16), ('vy', ctypes.c_int16),
+                ('width', ctypes.c_uint16), ('height', ctypes.c_uint16),
+                ('area', ctypes.c_uint32), ('last_area', ctypes.c_uint32),
+                ('age', ctypes.c_uint32), ('track_index', ctypes.c_int16),
+                ('pattern', ctypes.c_uint16), ('led_id', ctypes.c_int8),
+                ('peak', ctypes.c_uint8)]
+
+class Blobservation(ctypes.Structure):
+    _fields_ = [('num_blobs', ctypes.c_int),
+                ('blobs', Blob * MAX_BLOBS_PER_FRAME),
+                ('tracked_blobs', ctypes.c_int),
+                ('tracked', ctypes.c_uint8 * MAX_BLOBS_PER_FRAME)]
+
+class Vec3(ctypes.Structure):
+    _fields_ = [('x', ctypes.c_float), ('y', ctypes.c_float),
+                ('z', ctypes.c_float)]
+
+class DVec3(ctypes.Structure):
+    _fields_ = [('x', ctypes.c_double), ('y', ctypes.c_double),
+                ('z', ctypes.c_double)]
+
+class DQuat(ctypes.Structure):
+    _fields_ = [('x', ctypes.c_double), ('y', ctypes.c_double),
+                ('z', ctypes.c_double), ('w', ctypes.c_double)]
+
+class ImuSample(ctypes.Structure):
+    _fields_ = [('acceleration', Vec3), ('angular_velocity', Vec3),
+                ('magnetic_field', Vec3), ('temperature', ctypes.c_float),
+                ('time', ctypes.c_double)]
+
+class DPose(ctypes.Structure):
+    _fields_ = [('rotation', DQuat), ('translation', DVec3)]
+
+class ImuState(ctypes.Structure):
+    _fields_ = [('sample', ImuSample), ('pose', DPose),
+                ('angular_velocity', Vec3), ('linear_velocity', Vec3),
+                ('angular_acceleration', Vec3),
+                ('linear_acceleration', Vec3)]
+
+class Attachment(ctypes.Structure):
+    _fields_ = [('magic', ctypes.c_uint32), ('version', ctypes.c_uint32),
+                ('size', ctypes.c_uint32), ('reserved', ctypes.c_uint32),
+                ('blobservation', Blobservation),
+                ('rot', DQuat), ('trans', DVec3),
+                ('num_imu_samples', ctypes.c_int),
+                ('imu_samples', ImuState * MAX_IMU_SAMPLES),
+                ('timestamps', ctypes.c_double * 4)]
+
+class Overlay():
+    '''Draws the blobs and pose from the debug attachment over the frame.'''
+    def __init__(self):
+        self.attachment = None
+
+    def probe(self, pad, info):
+        # The attachment is appended to the frame data
+        buf = info.get_buffer()
+        size = buf.get_size()
+        attach_size = ctypes.sizeof(Attachment)
+        self.attachment = None
+        if size > attach_size:
+            data = buf.extract_dup(size - attach_size, attach_size)
+            attach = Attachment.from_buffer_copy(data)
+            if attach.magic == ATTACHMENT_MAGIC and \
+               attach.version == ATTACHMENT_VERSION and \
+               attach.size == attach_size:
+                self.attachment = attach
+        return Gst.PadProbeReturn.OK
+
+    def draw(self, overlay, cr, timestamp, duration):
+        attach = self.attachment
+        if attach is None:
+            return
+
+        ob = attach.blobservation
+        cr.set_line_width(1)
+        cr.set_font_size(10)
+        for i in range(min(ob.num_blobs, MAX_BLOBS_PER_FRAME)):
+            blob = ob.blobs[i]
+            if blob.led_id >= 0:
+                cr.set_source_rgb(0, 1, 0)
+            else:
+                cr.set_source_rgb(1, 0, 0)
+            cr.rectangle(blob.x - blob.width / 2 - 1,
+                         blob.y - blob.height / 2 - 1,
+                         blob.width + 2, blob.height + 2)
+            cr.stroke()
+            if blob.led_id >= 0:
+                cr.move_to(blob.x + blob.width / 2 + 2, blob.y + 3)
+                cr.show_text('%d' % blob.led_id)
+
+        t = attach.timestamps
+        trans = attach.trans
+        rot = attach.rot
+        lines = [
+            'blobs: %d' % ob.num_blobs,
+            'translation: %.3f %.3f %.3f' % (trans.x, trans.y, trans.z),
+            'rotation: %.3f %.3f %.3f %.3f' % (rot.x, rot.y, rot.z, rot.w),
+            'imu samples: %d' % attach.num_imu_samples,
+            'blob: %.1f ms, pose: %.1f ms' % ((t[2] - t[1]) * 1e3,
+                                            (t[3] - t[2]) * 1e3),
+        ]
+        if t[0] != 0:
+            lines.append('latency: %.1f ms' % ((t[3] - t[0]) * 1e3))
+
+        cr.set_source_rgb(1, 1, 0)
+        for i, line in enumerate(lines):
+            cr.move_to(4, 12 + 12 * i)
+            cr.show_text(line)
+
 def bus_call(bus, message, loop):
     if message.type == Gst.MessageType.ERROR:
         err, debug = message.parse_error()
@@ -73,18 +190,34 @@ def main(args):
     SigHandler(loop)
 
     pipes = []
+    overlays = []
 
     for src in sources:
         pipe = Gst.Pipeline.new('pipe0')
         convert = Gst.ElementFactory.make('videoconvert')
         sink = Gst.ElementFactory.make('autovideosink')
+        cairo = Gst.ElementFactory.make('cairooverlay')
 
         pipe.add(src)
         pipe.add(convert)
         pipe.add(sink)
 
         src.link(convert)
-        convert.link(sink)
+
+        if cairo:
+            overlay = Overlay()
+            overlays.append(overlay)
+            src.get_static_pad('src').add_probe(Gst.PadProbeType.BUFFER,
+                                                overlay.probe)
+            cairo.connect('draw', overlay.draw)
+            convert2 = Gst.ElementFactory.make('videoconvert')
+            pipe.add(cairo)
+            pipe.add(convert2)
+            convert.link(cairo)
+            cairo.link(convert2)
+            convert2.link(sink)
+        else:
+            convert.link(sink)
 
         pipe.set_state(Gst.State.PLAYING)
 
@@ -25,6 +25,7 @@
 #define		AR0134_FORCED_PLL_ON			(1 << 11)
 #define		AR0134_GPI_EN				(1 << 8)
 #define		AR0134_STREAM				(1 << 2)
+#define AR0134_GROUPED_PARAMETER_HOLD		0x3022
 #define AR0134_GLOBAL_GAIN			0x305e
 #define AR0134_EMBEDDED_DATA_CTRL		0x3064
 #define		AR0134_EMBEDDED_DATA			(1 << 8)
@@ -106,8 +107,35 @@ int ar0134_set_gain(libusb_device_handle *devh, uint16_t gain)
 	return ar0134_write_reg(devh, AR0134_GLOBAL_GAIN, gain);
 }
 
-static int ar0134_set_window(libusb_device_handle *devh, uint16_t x_start,
-			     uint16_t y_start, uint16_t x_end, uint16_t y_end)
+/*
+ * Sets coarse integration time, in multiples of line_length_pck, and global
+ * gain together. The grouped parameter hold makes both changes take effect
+ * with the same frame.
+ */
+int ar0134_set_exposure(libusb_device_handle *devh, uint16_t coarse,
+			uint16_t gain)
+{
+	int ret;
+
+	ret = ar0134_write_reg(devh, AR0134_GROUPED_PARAMETER_HOLD, 1);
+	if (ret < 0)
+		return ret;
+	ret = ar0134_write_reg(devh, AR0134_COARSE_INTEGRATION_TIME, coarse);
+	if (ret >= 0)
+		ret = ar0134_write_reg(devh, AR0134_GLOBAL_GAIN, gain);
+	if (ret < 0) {
+		ar0134_write_reg(devh, AR0134_GROUPED_PARAMETER_HOLD, 0);
+		return ret;
+	}
+	return ar0134_write_reg(devh, AR0134_GROUPED_PARAMETER_HOLD, 0);
+}
+
+/*
+ * Sets the readout window. Start and end coordinates are inclusive. The new
+ * window takes effect with the next frame.
+ */
+int ar0134_set_window(libusb_device_handle *devh, uint16_t x_start,
+		      uint16_t y_start, uint16_t x_end, uint16_t y_end)
 {
 	const uint16_t regs[] = {
 		AR0134_Y_ADDR_START, y_start,
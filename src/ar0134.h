@@ -12,7 +12,11 @@
 
 int ar0134_init(libusb_device_handle *devh);
 int ar0134_set_gain(libusb_device_handle *devh, uint16_t gain);
+int ar0134_set_exposure(libusb_device_handle *devh, uint16_t coarse,
+			uint16_t gain);
 int ar0134_set_ae(libusb_device_handle *devh, bool enabled);
+int ar0134_set_window(libusb_device_handle *devh, uint16_t x_start,
+		      uint16_t y_start, uint16_t x_end, uint16_t y_end);
 int ar0134_set_timings(libusb_device_handle *devh, bool tight);
 int ar0134_set_sync(libusb_device_handle *devh, bool enabled);
 
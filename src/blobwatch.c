@@ -12,6 +12,8 @@
 #include "blobwatch.h"
 #include "debug.h"
 #include "flicker.h"
+#include "log.h"
+#include "trace.h"
 
 struct leds;
 
@@ -34,6 +36,7 @@ struct extent {
 	uint16_t left;
 	uint16_t right;
 	uint8_t index;
+	uint8_t peak;
 	uint32_t area;
 };
 
@@ -86,6 +89,18 @@ struct blobwatch *blobwatch_new(int width, int height)
 	return bw;
 }
 
+/*
+ * Frees the blobwatch structure and its extent lines.
+ */
+void blobwatch_free(struct blobwatch *bw)
+{
+	if (!bw)
+		return;
+
+	free(bw->el);
+	free(bw);
+}
+
 /*
  * Stores blob information collected in the last extent e into the blob
  * array b at index e->index.
@@ -104,6 +119,7 @@ static inline void store_blob(struct extent *e, int y, struct blob *b)
 	b->track_index = -1;
 	b->pattern = 0;
 	b->led_id = -1;
+	b->peak = e->peak;
 }
 
 /*
@@ -133,16 +149,20 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 
 	for (x = 0; x < width; x++) {
 		int start, end;
+		uint8_t peak;
 
 		/* Loop until pixel value exceeds threshold */
 		if (line[x] <= THRESHOLD)
 			continue;
 
+		peak = line[x];
 		start = x++;
 
 		/* Loop until pixel value falls below threshold */
-		while (x < width && line[x] > THRESHOLD)
+		while (x < width && line[x] > THRESHOLD) {
+			peak = max(peak, line[x]);
 			x++;
+		}
 
 		end = x - 1;
 		/* Filter out single pixel and two-pixel extents */
@@ -154,6 +174,7 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 		extent->start = start;
 		extent->end = end;
 		extent->index = index;
+		extent->peak = peak;
 		extent->area = x - start;
 
 		if (prev_el && index < num_blobs) {
@@ -175,6 +196,7 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 				extent->left = min(extent->start, le->left);
 				extent->right = max(extent->end, le->right);
 				extent->area += le->area;
+				extent->peak = max(extent->peak, le->peak);
 				extent->index = le->index;
 				le++;
 			}
@@ -261,9 +283,13 @@ static int find_free_track(uint8_t *tracked)
 
 /*
  * Detects blobs in the current frame and compares them with the observation
- * history.
+ * history. If the sensor only read out a window, x and y give the position
+ * of the frame's top left corner in the sensor image. Blob coordinates are
+ * given in full sensor coordinates, so that blobs can be tracked across
+ * changes of the window. Frames must not be larger than the frame size
+ * given to blobwatch_new.
  */
-void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
+void blobwatch_process(struct blobwatch *bw, uint8_t *frame, int x, int y,
 		       int width, int height, uint8_t led_pattern_phase,
 		       struct leds *leds, struct blobservation **output)
 {
@@ -274,10 +300,20 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 	struct extent_line *el = bw->el;
 	int i, j;
 
+	trace_begin(TRACE_BLOB_DETECT);
+
 	process_frame(frame, width, height, el, ob);
 
+	if (x || y) {
+		for (i = 0; i < ob->num_blobs; i++) {
+			ob->blobs[i].x += x;
+			ob->blobs[i].y += y;
+		}
+	}
+
 	/* If there is no previous observation, our work is done here */
 	if (bw->last_observation == -1) {
+		trace_end(TRACE_BLOB_DETECT);
 		bw->last_observation = current;
 		if (output)
 			*output = NULL;
@@ -354,15 +390,20 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 
 		if (b->track_index >= 0 &&
 		    ob->tracked[b->track_index] != i + 1) {
-			printf("Inconsistency! %d != %d\n",
-			       ob->tracked[b->track_index], i + 1);
+			log_ratelimited(LOG_WARNING, 1000,
+					"Inconsistency! %d != %d\n",
+					ob->tracked[b->track_index], i + 1);
 		}
 	}
 
+	trace_end(TRACE_BLOB_DETECT);
+
 	if (rift_flicker) {
 		/* Identify blobs by their blinking pattern */
+		trace_begin(TRACE_IDENTIFY);
 		flicker_process(ob->blobs, ob->num_blobs, led_pattern_phase,
 				leds);
+		trace_end(TRACE_IDENTIFY);
 	}
 
 	/* Return observed blobs */
@@ -28,6 +28,8 @@ struct blob {
 	int16_t track_index;
 	uint16_t pattern;
 	int8_t led_id;
+	/* brightest pixel value */
+	uint8_t peak;
 };
 
 /*
@@ -43,7 +45,8 @@ struct blobservation {
 struct blobwatch;
 
 struct blobwatch *blobwatch_new(int width, int height);
-void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
+void blobwatch_free(struct blobwatch *bw);
+void blobwatch_process(struct blobwatch *bw, uint8_t *frame, int x, int y,
 		       int width, int height, uint8_t led_pattern_phase,
 		       struct leds *leds, struct blobservation **output);
 void blobwatch_set_flicker(bool enable);
@@ -0,0 +1,69 @@
+/*
+ * On-disk cache for device calibration data
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "cache.h"
+
+/*
+ * Cache entries are stored as plain files in $XDG_CACHE_HOME/ouvrt. The name
+ * must be unique per device and should contain a serial number and some
+ * kind of content hash or version, so that changed calibration data on the
+ * device invalidates the entry.
+ */
+static char *ouvrt_cache_filename(const char *name)
+{
+	return g_build_filename(g_get_user_cache_dir(), "ouvrt", name, NULL);
+}
+
+/*
+ * Reads the cache entry called name into a newly allocated buffer. Returns
+ * TRUE on success, the caller has to g_free the contents.
+ */
+gboolean ouvrt_cache_get_contents(const char *name, char **contents,
+				  gsize *length)
+{
+	char *filename = ouvrt_cache_filename(name);
+	gboolean success;
+
+	success = g_file_get_contents(filename, contents, length, NULL);
+
+	g_free(filename);
+
+	return success;
+}
+
+/*
+ * Atomically replaces the cache entry called name with the given contents,
+ * creating the cache directory if necessary.
+ */
+gboolean ouvrt_cache_set_contents(const char *name, const char *contents,
+				  gssize length)
+{
+	char *filename = ouvrt_cache_filename(name);
+	char *path = g_path_get_dirname(filename);
+	gboolean success;
+
+	g_mkdir_with_parents(path, 0755);
+	success = g_file_set_contents(filename, contents, length, NULL);
+
+	g_free(path);
+	g_free(filename);
+
+	return success;
+}
+
+/*
+ * Removes a stale or corrupt cache entry.
+ */
+void ouvrt_cache_remove(const char *name)
+{
+	char *filename = ouvrt_cache_filename(name);
+
+	g_unlink(filename);
+
+	g_free(filename);
+}
@@ -0,0 +1,17 @@
+/*
+ * On-disk cache for device calibration data
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <glib.h>
+
+gboolean ouvrt_cache_get_contents(const char *name, char **contents,
+				  gsize *length);
+gboolean ouvrt_cache_set_contents(const char *name, const char *contents,
+				  gssize length);
+void ouvrt_cache_remove(const char *name);
+
+#endif /* __CACHE_H__ */
@@ -10,16 +10,28 @@
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "blobwatch.h"
 #include "camera-v4l2.h"
 #include "debug.h"
+#include "imu-ring.h"
+#include "recorder.h"
+#include "sparse-frame.h"
+#include "trace.h"
 #include "tracker.h"
 
 struct _OuvrtCameraV4L2Private {
 	uint32_t offset[3];
 	void *buf[3];
+	size_t frame_size;
+	struct debug_buffer debug_buf[3];
+	struct imu_ring_reader imu_reader;
+	struct blobwatch *bw;
+	void *record_buf;
+	size_t record_buf_size;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtCameraV4L2, ouvrt_camera_v4l2,
@@ -108,6 +120,7 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 		format.fmt.pix.bytesperline = width * 2;
 	format.fmt.pix.sizeimage = format.fmt.pix.bytesperline * height;
 	camera->sizeimage = format.fmt.pix.sizeimage;
+	priv->frame_size = format.fmt.pix.sizeimage;
 
 	ret = ioctl(fd, VIDIOC_S_FMT, &format);
 	if (ret < 0) {
@@ -119,6 +132,10 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	if (ret < 0)
 		g_print("v4l2: S_PARM error: %d\n", errno);
 
+	priv->bw = blobwatch_new(width, height);
+	if (!priv->bw)
+		return -ENOMEM;
+
 	if (1 /* DEBUG */) {
 		reqbufs.memory = V4L2_MEMORY_USERPTR;
 		camera->sizeimage += sizeof(struct ouvrt_debug_attachment);
@@ -209,6 +226,71 @@ static void convert_yuyv_to_grayscale(uint8_t *frame, int width, int height)
 static dquat rot;
 static dvec3 trans;
 
+/*
+ * Sets the user pointer of a capture buffer before queueing it. If the debug
+ * stream has a free buffer, capture directly into it to avoid copying the
+ * frame later. Otherwise fall back to the allocated capture buffer.
+ */
+static void ouvrt_camera_v4l2_set_userptr(OuvrtCamera *camera,
+					  unsigned int index,
+					  struct v4l2_buffer *buf)
+{
+	OuvrtCameraV4L2Private *priv = OUVRT_CAMERA_V4L2(camera)->priv;
+	struct debug_buffer *debug_buf = &priv->debug_buf[index];
+
+	if (!debug_buf->data)
+		debug_stream_buffer_get(camera->debug, debug_buf,
+					priv->frame_size);
+
+	if (debug_buf->data) {
+		buf->m.userptr = (unsigned long)debug_buf->data;
+		buf->length = debug_buf->size;
+	} else {
+		buf->m.userptr = (unsigned long)priv->buf[index];
+		buf->length = camera->sizeimage;
+	}
+}
+
+/*
+ * Writes a grayscale frame to the session recording. Frames are stored sparse
+ * encoded, unless too many pixels are above the noise floor.
+ */
+static void ouvrt_camera_v4l2_record_frame(OuvrtDevice *dev, const void *raw,
+					   int width, int height,
+					   const struct v4l2_buffer *buf)
+{
+	OuvrtCameraV4L2Private *priv = OUVRT_CAMERA_V4L2(dev)->priv;
+	struct recorder_v4l2_frame info = {
+		.width = width,
+		.height = height,
+		.pixelformat = V4L2_PIX_FMT_GREY,
+		.sequence = buf->sequence,
+		.timestamp = buf->timestamp.tv_sec * 1000000000ULL +
+			     buf->timestamp.tv_usec * 1000,
+	};
+	struct iovec iov[2] = {
+		{ &info, sizeof(info) },
+		{ (void *)raw, width * height },
+	};
+	uint16_t type = RECORD_V4L2_FRAME;
+	ssize_t size;
+
+	if (!priv->record_buf) {
+		priv->record_buf_size = width * height / 4;
+		priv->record_buf = g_malloc(priv->record_buf_size);
+	}
+
+	size = sparse_frame_encode(raw, width, height, 0x20, 1,
+				   priv->record_buf, priv->record_buf_size);
+	if (size > 0) {
+		iov[1].iov_base = priv->record_buf;
+		iov[1].iov_len = size;
+		type = RECORD_V4L2_SPARSE_FRAME;
+	}
+
+	recorder_writev(type, 0, dev->id, 0, iov, 2);
+}
+
 /*
  * Receives frames from the camera and processes them.
  */
@@ -220,6 +302,8 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 	struct v4l2_buffer buf;
 	int width = camera->width;
 	int height = camera->height;
+	struct imu_state imu_states[OUVRT_DEBUG_MAX_IMU_SAMPLES];
+	unsigned int num_imu_states;
 	double timestamps[4];
 	struct timespec tp;
 	struct pollfd pfd;
@@ -253,6 +337,9 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 			break;
 		}
 
+		trace_sequence(buf.sequence);
+		trace_instant(TRACE_FRAME_COMPLETE);
+
 		clock_gettime(CLOCK_MONOTONIC, &tp);
 		timestamps[0] = buf.timestamp.tv_sec + 1e-6 * buf.timestamp.tv_usec;
 		timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
@@ -263,7 +350,8 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 				raw = NULL;
 		} else if (buf.memory == V4L2_MEMORY_USERPTR) {
 			raw = (void *)buf.m.userptr;
-			if (raw != priv->buf[buf.index])
+			if (raw != priv->buf[buf.index] &&
+			    raw != priv->debug_buf[buf.index].data)
 				raw = NULL;
 		} else {
 			raw = NULL;
@@ -278,6 +366,19 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 		if (v4l2->pixelformat == V4L2_PIX_FMT_YUYV)
 			convert_yuyv_to_grayscale(raw, width, height);
 
+		if (recorder_enabled)
+			ouvrt_camera_v4l2_record_frame(dev, raw, width, height,
+						       &buf);
+
+		/* Sequence numbers of frames dropped by the driver are skipped */
+		if (stats_get_counter(&dev->stats, STATS_FRAMES) &&
+		    buf.sequence > (uint32_t)camera->sequence + 1) {
+			stats_count(&dev->stats, STATS_DROPPED_FRAMES,
+				    buf.sequence - camera->sequence - 1);
+		}
+		stats_count(&dev->stats, STATS_FRAMES, 1);
+		if (buf.flags & V4L2_BUF_FLAG_ERROR)
+			stats_count(&dev->stats, STATS_SHORT_FRAMES, 1);
 		camera->sequence = buf.sequence;
 
 		/*
@@ -286,13 +387,19 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 		 * available, using the LED blinking pattern.
 		 */
 		struct blobservation *ob = NULL;
+		num_imu_states = 0;
 		if (camera->tracker) {
 			uint64_t sof_time = buf.timestamp.tv_sec * 1000000000 +
 					    buf.timestamp.tv_usec * 1000;
 
-			ouvrt_tracker_process_frame(camera->tracker,
-						    raw, width, height,
+			ouvrt_tracker_process_frame(camera->tracker, priv->bw,
+						    raw, 0, 0, width, height,
 						    sof_time, &ob);
+			num_imu_states = ouvrt_tracker_get_imu_states(
+						camera->tracker,
+						&priv->imu_reader, sof_time,
+						imu_states,
+						OUVRT_DEBUG_MAX_IMU_SAMPLES);
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &tp);
@@ -313,14 +420,25 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 
 		clock_gettime(CLOCK_MONOTONIC, &tp);
 		timestamps[3] = tp.tv_sec + 1e-9 * tp.tv_nsec;
+		stats_add_frame_timestamps(&dev->stats, timestamps);
 
 		ret = OUVRT_CAMERA_GET_CLASS(dev)->process_frame(camera, raw);
-		if (ret == 0) {
+		if (ret == 0 && raw == priv->debug_buf[buf.index].data) {
+			/* Captured directly into a PipeWire buffer */
+			debug_stream_buffer_push(camera->debug,
+						 &priv->debug_buf[buf.index],
+						 ob, &rot, &trans, imu_states,
+						 num_imu_states, timestamps);
+		} else if (ret == 0) {
 			debug_stream_frame_push(camera->debug, raw,
 						camera->sizeimage, width * height,
-						ob, &rot, &trans, timestamps);
+						ob, &rot, &trans, imu_states,
+						num_imu_states, timestamps);
 		}
 
+		if (buf.memory == V4L2_MEMORY_USERPTR)
+			ouvrt_camera_v4l2_set_userptr(camera, buf.index, &buf);
+
 		ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
 		if (ret < 0) {
 			g_print("v4l2: QBUF error: %d, disabling camera\n",
@@ -375,6 +493,23 @@ static void ouvrt_camera_v4l2_stop(OuvrtDevice *dev)
 
 	g_print("v4l2: Stopped streaming\n");
 
+	if (priv->imu_reader.overflows) {
+		g_print("v4l2: Lost %" G_GUINT64_FORMAT " IMU samples\n",
+			priv->imu_reader.overflows);
+	}
+
+	g_free(priv->record_buf);
+	priv->record_buf = NULL;
+
+	blobwatch_free(priv->bw);
+	priv->bw = NULL;
+
+	for (i = 0; i < 3; i++) {
+		if (priv->debug_buf[i].data)
+			debug_stream_buffer_put(camera->debug,
+						&priv->debug_buf[i]);
+	}
+
 	/* TODO: move up to camera */
 	camera->debug = debug_stream_unref(camera->debug);
 }
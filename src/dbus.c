@@ -6,6 +6,7 @@
 #include <glib.h>
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
+#include <unistd.h>
 
 #include "camera.h"
 #include "camera-dk2.h"
@@ -13,6 +14,7 @@
 #include "gdbus-generated.h"
 #include "ouvrtd.h"
 #include "rift.h"
+#include "stats.h"
 
 static GDBusObjectManagerServer *manager = NULL;
 
@@ -72,14 +74,26 @@ static gboolean ouvrt_tracker1_on_handle_acquire(OuvrtTracker1 *object,
 
 	(void)watcher_id;
 
-	/* FIXME */
-	fd = 1; /* stdout */
+	fd = ouvrt_device_acquire_pose_fd(dev);
+	if (fd < 0) {
+		g_dbus_method_invocation_return_error(invocation, G_IO_ERROR,
+				g_io_error_from_errno(-fd),
+				"Failed to create pose ring buffer");
+		return TRUE;
+	}
 
-	fd_list = NULL;
 	fd_list = g_unix_fd_list_new();
-	g_unix_fd_list_append(fd_list, fd, &error);
+	if (g_unix_fd_list_append(fd_list, fd, &error) < 0) {
+		g_dbus_method_invocation_return_gerror(invocation, error);
+		g_error_free(error);
+		g_object_unref(fd_list);
+		close(fd);
+		return TRUE;
+	}
+	close(fd);
 
 	ouvrt_tracker1_complete_acquire(object, invocation, fd_list);
+	g_object_unref(fd_list);
 
 	return TRUE;
 }
@@ -313,6 +327,86 @@ static void ouvrt_dbus_export_radio1_interface(OuvrtObjectSkeleton *object,
 	g_object_unref(radio);
 }
 
+static gboolean
+ouvrt_stats1_on_handle_get_counters(OuvrtStats1 *object,
+				    GDBusMethodInvocation *invocation,
+				    gpointer user_data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(user_data);
+	GVariantBuilder builder;
+	int i;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+	for (i = 0; i < STATS_NUM_COUNTERS; i++) {
+		g_variant_builder_add(&builder, "{st}", stats_counter_name(i),
+				      stats_get_counter(&dev->stats, i));
+	}
+
+	ouvrt_stats1_complete_get_counters(object, invocation,
+					   g_variant_builder_end(&builder));
+
+	return TRUE;
+}
+
+static gboolean
+ouvrt_stats1_on_handle_get_histograms(OuvrtStats1 *object,
+				      GDBusMethodInvocation *invocation,
+				      gpointer user_data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(user_data);
+	struct stats_histogram histogram;
+	GVariantBuilder builder;
+	GVariant *buckets;
+	int i;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(ttat)}"));
+	for (i = 0; i < STATS_NUM_STAGES; i++) {
+		stats_get_histogram(&dev->stats, i, &histogram);
+		buckets = g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64,
+						    histogram.buckets,
+						    STATS_NUM_BUCKETS,
+						    sizeof(uint64_t));
+		g_variant_builder_add(&builder, "{s(tt@at)}",
+				      stats_stage_name(i), histogram.count,
+				      histogram.sum, buckets);
+	}
+
+	ouvrt_stats1_complete_get_histograms(object, invocation,
+					     g_variant_builder_end(&builder));
+
+	return TRUE;
+}
+
+/*
+ * Exports a Stats1 interface via D-Bus.
+ */
+static void ouvrt_dbus_export_stats1_interface(OuvrtObjectSkeleton *object,
+					       OuvrtDevice *dev)
+{
+	OuvrtStats1 *stats = ouvrt_stats1_skeleton_new();
+	uint64_t limits[STATS_NUM_BUCKETS];
+	GVariant *variant;
+	int i;
+
+	g_print("Exporting Stats1 interface for device %s\n", dev->devnode);
+
+	for (i = 0; i < STATS_NUM_BUCKETS; i++)
+		limits[i] = stats_bucket_limit(i);
+	variant = g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, limits,
+					    STATS_NUM_BUCKETS,
+					    sizeof(uint64_t));
+	ouvrt_stats1_set_bucket_limits(stats, variant);
+
+	g_signal_connect(stats, "handle-get-counters",
+			 G_CALLBACK(ouvrt_stats1_on_handle_get_counters), dev);
+	g_signal_connect(stats, "handle-get-histograms",
+			 G_CALLBACK(ouvrt_stats1_on_handle_get_histograms),
+			 dev);
+
+	ouvrt_object_skeleton_set_stats1(object, stats);
+	g_object_unref(stats);
+}
+
 void ouvrt_dbus_export_device(OuvrtDevice *dev)
 {
 	gchar *object_path;
@@ -326,7 +420,7 @@ void ouvrt_dbus_export_device(OuvrtDevice *dev)
 
 	g_debug("TODO: register %s with DBus\n", dev->devnode);
 
-	if (dev->type == DEVICE_TYPE_HMD) {
+	if (dev->has_pose) {
 		/* Export a Tracker1 interface */
 		ouvrt_dbus_export_tracker1_interface(object, dev);
 	}
@@ -341,6 +435,9 @@ void ouvrt_dbus_export_device(OuvrtDevice *dev)
 		ouvrt_dbus_export_camera1_interface(object, dev);
 	}
 
+	/* Export a Stats1 interface */
+	ouvrt_dbus_export_stats1_interface(object, dev);
+
 	g_dbus_object_manager_server_export(manager,
 					    G_DBUS_OBJECT_SKELETON(object));
 	g_object_unref(object);
@@ -363,7 +460,11 @@ void ouvrt_dbus_unexport_device(OuvrtDevice *dev)
 static void __ouvrt_dbus_export_device(gpointer data,
 				       gpointer user_data G_GNUC_UNUSED)
 {
-	ouvrt_dbus_export_device(OUVRT_DEVICE(data));
+	OuvrtDevice *dev = OUVRT_DEVICE(data);
+
+	/* Devices that are still starting up are exported when done */
+	if (dev->active)
+		ouvrt_dbus_export_device(dev);
 }
 
 /*
@@ -11,10 +11,15 @@
 #include <unistd.h>
 
 #include "debug.h"
+#include "debug-queue.h"
+
+/* Frames waiting to be pushed before new frames are dropped */
+#define DEBUG_STREAM_MAX_PENDING	2
 
 struct debug_stream {
 	GstElement *pipeline;
 	GstElement *appsrc;
+	struct debug_queue *queue;
 	gboolean connected;
 };
 
@@ -46,6 +51,19 @@ static void debug_gst_client_disconnected(G_GNUC_UNUSED GstElement *sink,
 	printf("debug: disconnected\n");
 }
 
+/*
+ * Pushes buffers handed over from the tracking threads into the pipeline.
+ */
+static void debug_gst_push_func(void *item, void *user_data)
+{
+	struct debug_stream *gst = user_data;
+	GstBuffer *buf = *(GstBuffer **)item;
+	int ret;
+
+	g_signal_emit_by_name(gst->appsrc, "push-buffer", buf, &ret);
+	gst_buffer_unref(buf);
+}
+
 /*
  * Enables GStreamer debug output of GRAY8 frames into a shmsink.
  */
@@ -103,6 +121,9 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 		return NULL;
 	gst->pipeline = pipeline;
 	gst->appsrc = src;
+	gst->queue = debug_queue_new("ouvrt-debug", DEBUG_STREAM_MAX_PENDING,
+				     sizeof(GstBuffer *), debug_gst_push_func,
+				     gst);
 	gst->connected = FALSE;
 
 	g_signal_connect(G_OBJECT(sink), "client-connected",
@@ -117,6 +138,15 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 
 struct debug_stream *debug_stream_unref(struct debug_stream *gst)
 {
+	uint64_t dropped;
+
+	dropped = debug_queue_dropped(gst->queue);
+	debug_queue_free(gst->queue);
+	if (dropped) {
+		printf("debug: dropped %" G_GUINT64_FORMAT " frames\n",
+		       dropped);
+	}
+
 	gst_element_set_state(gst->pipeline, GST_STATE_NULL);
 	gst_object_unref(gst->pipeline);
 	free(gst);
@@ -125,51 +155,76 @@ struct debug_stream *debug_stream_unref(struct debug_stream *gst)
 }
 
 /*
- * Allocates a GstBuffer that wraps the frame and pushes it into the
- * GStreamer pipeline.
+ * Copies the frame into a GstBuffer and hands it over to the queue thread,
+ * which pushes it into the GStreamer pipeline. The caller reuses the frame
+ * memory, so it can not be wrapped. If the queue is full, the frame is
+ * dropped.
  */
 void debug_stream_frame_push(struct debug_stream *gst, void *src, size_t size,
 			     size_t attach_offset, struct blobservation *ob,
-			     dquat *rot, dvec3 *trans, double timestamps[3])
+			     dquat *rot, dvec3 *trans,
+			     const struct imu_state *imu_samples,
+			     unsigned int num_imu_samples, double timestamps[3])
 {
 	struct ouvrt_debug_attachment *attach;
-	unsigned int num;
 	GstBuffer *buf;
-	int ret;
 
 	if (!gst->connected)
 		return;
 
+	if (debug_queue_pending(gst->queue) >= DEBUG_STREAM_MAX_PENDING) {
+		debug_queue_drop(gst->queue);
+		return;
+	}
+
 	if (ob) {
 		attach = (struct ouvrt_debug_attachment *)
 			 ((char *)src + attach_offset);
-
-		/* Copy blobs and flicker history */
-		memcpy(&attach->blobservation, ob, sizeof(*ob));
-
-		/* Copy rotation and translation */
-		memcpy(&attach->rot, rot, sizeof(dquat));
-		memcpy(&attach->trans, trans, sizeof(dvec3));
-
-		/* Copy raw IMU sensor readings */
-		num = debug_imu_fifo_out(attach->imu_samples, 32);
-		attach->num_imu_samples = num;
-
-		if (timestamps) {
-			memcpy(attach->timestamps, timestamps,
-			       4 * sizeof(double));
-		}
+		debug_attachment_fill(attach, ob, rot, trans, imu_samples,
+				      num_imu_samples, timestamps);
 	}
 
-	buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, src,
-					  size, 0, size, NULL, NULL);
+	buf = gst_buffer_new_allocate(NULL, size, NULL);
 	if (!buf)
 		return;
+	gst_buffer_fill(buf, 0, src, size);
 
 //	GST_BUFFER_TIMESTAMP(buffer) = ...
 //	GST_BUFFER_DURATION(buffer) = ...
-	g_signal_emit_by_name(gst->appsrc, "push-buffer", buf, &ret);
-	gst_buffer_unref(buf);
+	if (!debug_queue_push(gst->queue, &buf))
+		gst_buffer_unref(buf);
+}
+
+uint64_t debug_stream_dropped_frames(struct debug_stream *gst)
+{
+	return gst ? debug_queue_dropped(gst->queue) : 0;
+}
+
+/*
+ * The shmsink copies frames anyway, so no buffers are handed out to be filled
+ * directly. Callers fall back to debug_stream_frame_push.
+ */
+bool debug_stream_buffer_get(G_GNUC_UNUSED struct debug_stream *gst,
+			     G_GNUC_UNUSED struct debug_buffer *buffer,
+			     G_GNUC_UNUSED size_t size)
+{
+	return false;
+}
+
+void debug_stream_buffer_push(G_GNUC_UNUSED struct debug_stream *gst,
+			      G_GNUC_UNUSED struct debug_buffer *buffer,
+			      G_GNUC_UNUSED struct blobservation *ob,
+			      G_GNUC_UNUSED dquat *rot,
+			      G_GNUC_UNUSED dvec3 *trans,
+			      G_GNUC_UNUSED const struct imu_state *imu_samples,
+			      G_GNUC_UNUSED unsigned int num_imu_samples,
+			      G_GNUC_UNUSED double timestamps[4])
+{
+}
+
+void debug_stream_buffer_put(G_GNUC_UNUSED struct debug_stream *gst,
+			     G_GNUC_UNUSED struct debug_buffer *buffer)
+{
 }
 
 void debug_stream_init(int *argc, char **argv[])
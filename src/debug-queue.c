@@ -0,0 +1,173 @@
+/*
+ * Bounded debug stream handoff queue
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Hands items from a tracking thread over to a worker thread that passes
+ * them on to the debug stream consumer. The producer only holds the queue
+ * lock to copy the item into a free slot. If the queue is full, the item is
+ * dropped and counted instead of waiting for the consumer.
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "debug-queue.h"
+#include "thread-policy.h"
+
+struct debug_queue {
+	GMutex lock;
+	GCond cond;
+	GThread *thread;
+	bool stopping;
+
+	debug_queue_func func;
+	void *user_data;
+
+	uint8_t *items;
+	size_t item_size;
+	unsigned int length;
+	unsigned int head;
+	unsigned int tail;
+
+	uint64_t dropped;
+};
+
+/*
+ * Passes queued items to the callback, outside of the queue lock. Items
+ * still queued when the queue is freed are passed on before exiting.
+ */
+static gpointer debug_queue_thread(gpointer data)
+{
+	struct debug_queue *queue = data;
+	uint8_t *item = g_malloc(queue->item_size);
+
+	g_mutex_lock(&queue->lock);
+	for (;;) {
+		while (queue->head == queue->tail && !queue->stopping)
+			g_cond_wait(&queue->cond, &queue->lock);
+		if (queue->head == queue->tail)
+			break;
+
+		memcpy(item, queue->items + (queue->head % queue->length) *
+		       queue->item_size, queue->item_size);
+		queue->head++;
+		g_mutex_unlock(&queue->lock);
+
+		queue->func(item, queue->user_data);
+
+		g_mutex_lock(&queue->lock);
+	}
+	g_mutex_unlock(&queue->lock);
+
+	g_free(item);
+
+	return NULL;
+}
+
+/*
+ * Creates a new queue with room for length items of item_size bytes each,
+ * and starts its worker thread. The length must be a power of two. The
+ * worker thread runs with the "debug" thread policy.
+ */
+struct debug_queue *debug_queue_new(const char *name, unsigned int length,
+				    size_t item_size, debug_queue_func func,
+				    void *user_data)
+{
+	struct debug_queue *queue;
+
+	queue = g_new0(struct debug_queue, 1);
+	g_mutex_init(&queue->lock);
+	g_cond_init(&queue->cond);
+	queue->func = func;
+	queue->user_data = user_data;
+	queue->items = g_malloc0(length * item_size);
+	queue->item_size = item_size;
+	queue->length = length;
+
+	queue->thread = ouvrt_thread_new("debug", name, debug_queue_thread,
+					 queue);
+
+	return queue;
+}
+
+/*
+ * Stops the worker thread after all queued items are passed on, and frees
+ * the queue.
+ */
+void debug_queue_free(struct debug_queue *queue)
+{
+	if (!queue)
+		return;
+
+	g_mutex_lock(&queue->lock);
+	queue->stopping = true;
+	g_cond_signal(&queue->cond);
+	g_mutex_unlock(&queue->lock);
+
+	g_thread_join(queue->thread);
+
+	g_mutex_clear(&queue->lock);
+	g_cond_clear(&queue->cond);
+	g_free(queue->items);
+	g_free(queue);
+}
+
+/*
+ * Returns the number of items not yet passed on by the worker thread.
+ */
+unsigned int debug_queue_pending(struct debug_queue *queue)
+{
+	unsigned int pending;
+
+	g_mutex_lock(&queue->lock);
+	pending = queue->tail - queue->head;
+	g_mutex_unlock(&queue->lock);
+
+	return pending;
+}
+
+/*
+ * Copies the item into the queue. Returns false and counts the item as
+ * dropped if the queue is full.
+ */
+bool debug_queue_push(struct debug_queue *queue, const void *item)
+{
+	g_mutex_lock(&queue->lock);
+	if (queue->tail - queue->head == queue->length) {
+		queue->dropped++;
+		g_mutex_unlock(&queue->lock);
+		return false;
+	}
+
+	memcpy(queue->items + (queue->tail % queue->length) * queue->item_size,
+	       item, queue->item_size);
+	queue->tail++;
+	g_cond_signal(&queue->cond);
+	g_mutex_unlock(&queue->lock);
+
+	return true;
+}
+
+/*
+ * Counts an item that was dropped before it could be queued.
+ */
+void debug_queue_drop(struct debug_queue *queue)
+{
+	g_mutex_lock(&queue->lock);
+	queue->dropped++;
+	g_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Returns the number of items dropped so far.
+ */
+uint64_t debug_queue_dropped(struct debug_queue *queue)
+{
+	uint64_t dropped;
+
+	g_mutex_lock(&queue->lock);
+	dropped = queue->dropped;
+	g_mutex_unlock(&queue->lock);
+
+	return dropped;
+}
@@ -0,0 +1,26 @@
+/*
+ * Bounded debug stream handoff queue
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __DEBUG_QUEUE_H__
+#define __DEBUG_QUEUE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct debug_queue;
+
+typedef void (*debug_queue_func)(void *item, void *user_data);
+
+struct debug_queue *debug_queue_new(const char *name, unsigned int length,
+				    size_t item_size, debug_queue_func func,
+				    void *user_data);
+void debug_queue_free(struct debug_queue *queue);
+unsigned int debug_queue_pending(struct debug_queue *queue);
+bool debug_queue_push(struct debug_queue *queue, const void *item);
+void debug_queue_drop(struct debug_queue *queue);
+uint64_t debug_queue_dropped(struct debug_queue *queue);
+
+#endif /* __DEBUG_QUEUE_H__ */
@@ -5,6 +5,7 @@
  */
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "blobwatch.h"
@@ -13,41 +14,36 @@
 
 int debug_mode = 0;
 
-#define IMU_FIFO_LEN 32
-static struct imu_state imu_fifo[IMU_FIFO_LEN];
-static unsigned int fifo_in = 0;
-static unsigned int fifo_out = 0;
-
-unsigned int debug_imu_fifo_in(struct imu_state *samples, unsigned int n)
-{
-	int i = 0;
-
-	while (n--) {
-		if (((fifo_out + 1) % IMU_FIFO_LEN) == (fifo_in % IMU_FIFO_LEN))
-			return i;
-		imu_fifo[fifo_out % IMU_FIFO_LEN] = *samples;
-		__sync_synchronize();
-		fifo_out++;
-		samples++;
-		i++;
-	}
-
-	return i;
-}
-
-unsigned int debug_imu_fifo_out(struct imu_state *samples, unsigned int n)
+/*
+ * Fills the debug attachment with the blob observation, the estimated pose,
+ * the IMU states taken since the previous exposure, and timestamps.
+ */
+void debug_attachment_fill(struct ouvrt_debug_attachment *attach,
+			   struct blobservation *ob, dquat *rot, dvec3 *trans,
+			   const struct imu_state *imu_samples,
+			   unsigned int num_imu_samples, double timestamps[4])
 {
-	int i = 0;
-
-	while (n--) {
-		if ((fifo_in % IMU_FIFO_LEN) == (fifo_out % IMU_FIFO_LEN))
-			return i;
-		*samples = imu_fifo[fifo_in % IMU_FIFO_LEN];
-		__sync_synchronize();
-		fifo_in++;
-		samples++;
-		i++;
+	attach->magic = OUVRT_DEBUG_ATTACHMENT_MAGIC;
+	attach->version = OUVRT_DEBUG_ATTACHMENT_VERSION;
+	attach->size = sizeof(*attach);
+	attach->reserved = 0;
+
+	/* Copy blobs and flicker history */
+	memcpy(&attach->blobservation, ob, sizeof(*ob));
+
+	/* Copy rotation and translation */
+	memcpy(&attach->rot, rot, sizeof(dquat));
+	memcpy(&attach->trans, trans, sizeof(dvec3));
+
+	/* Copy IMU states taken since the previous exposure */
+	if (num_imu_samples > OUVRT_DEBUG_MAX_IMU_SAMPLES)
+		num_imu_samples = OUVRT_DEBUG_MAX_IMU_SAMPLES;
+	if (num_imu_samples) {
+		memcpy(attach->imu_samples, imu_samples,
+		       num_imu_samples * sizeof(*imu_samples));
 	}
+	attach->num_imu_samples = num_imu_samples;
 
-	return i;
+	if (timestamps)
+		memcpy(attach->timestamps, timestamps, 4 * sizeof(double));
 }
@@ -6,6 +6,7 @@
 #ifndef __DEBUG_H__
 #define __DEBUG_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -37,19 +38,48 @@ struct debug_stream_desc {
 	struct fraction framerate;
 };
 
+#define OUVRT_DEBUG_ATTACHMENT_MAGIC	0x4144564f /* "OVDA" */
+#define OUVRT_DEBUG_ATTACHMENT_VERSION	1
+#define OUVRT_DEBUG_MAX_IMU_SAMPLES	32
+
+/*
+ * Per-frame debug metadata: the blob observation, the estimated pose, the
+ * IMU samples taken between the previous and this exposure, and the stage
+ * timestamps
+ * (exposure, reception, blob extraction done, pose estimation done) in
+ * seconds of CLOCK_MONOTONIC. All fields are in host byte order with native
+ * alignment. The magic is only set if the frame was processed, consumers
+ * should check magic, version and size before interpreting the rest.
+ */
 struct ouvrt_debug_attachment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
 	struct blobservation blobservation;
 	dquat rot;
 	dvec3 trans;
 	int num_imu_samples;
-	struct imu_state imu_samples[32];
+	struct imu_state imu_samples[OUVRT_DEBUG_MAX_IMU_SAMPLES];
 	double timestamps[4];
 };
 
+/*
+ * A frame buffer owned by the debug stream, which can be filled directly by
+ * the capture code and then pushed without copying.
+ */
+struct debug_buffer {
+	void *data;
+	size_t size;
+	void *priv;
+};
+
 int debug_parse_arg(const char *arg);
 
-unsigned int debug_imu_fifo_in(struct imu_state *samples, unsigned int n);
-unsigned int debug_imu_fifo_out(struct imu_state *samples, unsigned int n);
+void debug_attachment_fill(struct ouvrt_debug_attachment *attach,
+			   struct blobservation *ob, dquat *rot, dvec3 *trans,
+			   const struct imu_state *imu_samples,
+			   unsigned int num_imu_samples, double timestamps[4]);
 
 #ifdef HAVE_DEBUG_STREAM
 void debug_stream_init(int *argc, char **argv[]);
@@ -58,7 +88,20 @@ struct debug_stream *debug_stream_unref(struct debug_stream *stream);
 void debug_stream_frame_push(struct debug_stream *stream,
 			     void *frame, size_t size, size_t attach_offset,
 			     struct blobservation *ob, dquat *rot,
-			     dvec3 *trans, double timestamps[3]);
+			     dvec3 *trans, const struct imu_state *imu_samples,
+			     unsigned int num_imu_samples,
+			     double timestamps[3]);
+bool debug_stream_buffer_get(struct debug_stream *stream,
+			     struct debug_buffer *buffer, size_t size);
+void debug_stream_buffer_push(struct debug_stream *stream,
+			      struct debug_buffer *buffer,
+			      struct blobservation *ob, dquat *rot,
+			      dvec3 *trans, const struct imu_state *imu_samples,
+			      unsigned int num_imu_samples,
+			      double timestamps[4]);
+void debug_stream_buffer_put(struct debug_stream *stream,
+			     struct debug_buffer *buffer);
+uint64_t debug_stream_dropped_frames(struct debug_stream *stream);
 void debug_stream_deinit(void);
 #else
 static inline void debug_stream_init(int *argc, char **argv[])
@@ -79,8 +122,38 @@ static inline void debug_stream_frame_push(struct debug_stream *stream,
 					   void *frame, size_t size,
 					   size_t attach_offset,
 					   struct blobservation *ob, dquat *rot,
-					   dvec3 *trans, double timestamps[3])
+					   dvec3 *trans,
+					   const struct imu_state *imu_samples,
+					   unsigned int num_imu_samples,
+					   double timestamps[3])
+{
+}
+
+static inline bool debug_stream_buffer_get(struct debug_stream *stream,
+					   struct debug_buffer *buffer,
+					   size_t size)
+{
+	return false;
+}
+
+static inline void debug_stream_buffer_push(struct debug_stream *stream,
+					    struct debug_buffer *buffer,
+					    struct blobservation *ob,
+					    dquat *rot, dvec3 *trans,
+					    const struct imu_state *imu_samples,
+					    unsigned int num_imu_samples,
+					    double timestamps[4])
+{
+}
+
+static inline void debug_stream_buffer_put(struct debug_stream *stream,
+					   struct debug_buffer *buffer)
+{
+}
+
+static inline uint64_t debug_stream_dropped_frames(struct debug_stream *s)
 {
+	return 0;
 }
 
 static inline void debug_stream_deinit(void)
@@ -8,17 +8,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "device.h"
+#include "pose-ring.h"
+#include "reactor.h"
+#include "recorder.h"
+#include "thread-policy.h"
+#include "trace.h"
 
 struct _OuvrtDevicePrivate {
 	GThread *thread;
+	gboolean reactor;
+	struct pose_ring *pose_ring;
+	gboolean replay;
+	const void *replay_buf;
+	size_t replay_count;
 };
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE(OuvrtDevice, ouvrt_device, G_TYPE_OBJECT)
 
 static GHashTable *serial_to_id_table;
+static GMutex serial_to_id_mutex;
 
 /*
  * Stops the device before disposing of it
@@ -43,6 +55,7 @@ static void ouvrt_device_finalize(GObject *object)
 	free(dev->devnode);
 	free(dev->name);
 	free(dev->serial);
+	pose_ring_free(dev->priv->pose_ring);
 	G_OBJECT_CLASS(ouvrt_device_parent_class)->finalize(object);
 }
 
@@ -103,11 +116,16 @@ static void ouvrt_device_init(OuvrtDevice *self)
 	self->name = NULL;
 	self->serial = NULL;
 	self->active = FALSE;
+	self->has_pose = FALSE;
 	self->fds[0] = -1;
 	self->fds[1] = -1;
 	self->fds[2] = -1;
 	self->priv = ouvrt_device_get_instance_private(self);
 	self->priv->thread = NULL;
+	self->priv->reactor = FALSE;
+	self->priv->pose_ring = NULL;
+	self->priv->replay = FALSE;
+	self->priv->replay_buf = NULL;
 }
 
 /*
@@ -122,6 +140,23 @@ static gpointer device_start_routine(gpointer data)
 	return NULL;
 }
 
+/*
+ * Returns the name of the most derived device type that has a thread policy
+ * configured, or the device's own type name.
+ */
+static const char *device_thread_class(OuvrtDevice *dev)
+{
+	GType type;
+
+	for (type = G_OBJECT_TYPE(dev); type != G_TYPE_OBJECT;
+	     type = g_type_parent(type)) {
+		if (ouvrt_thread_policy_exists(g_type_name(type)))
+			return g_type_name(type);
+	}
+
+	return G_OBJECT_TYPE_NAME(dev);
+}
+
 /*
  * Creates or returns an existing stable id for a given serial number.
  */
@@ -129,6 +164,8 @@ unsigned long ouvrt_device_claim_id(OuvrtDevice *dev, const char *serial)
 {
 	unsigned long id;
 
+	g_mutex_lock(&serial_to_id_mutex);
+
 	if (!serial_to_id_table)
 		serial_to_id_table = g_hash_table_new(g_str_hash, g_str_equal);
 
@@ -144,9 +181,43 @@ unsigned long ouvrt_device_claim_id(OuvrtDevice *dev, const char *serial)
 			serial);
 	}
 
+	g_mutex_unlock(&serial_to_id_mutex);
+
 	return id;
 }
 
+/*
+ * Writes a description of the device to the session recording, so that
+ * records can be matched to devices by their id.
+ */
+static void device_record_description(OuvrtDevice *dev)
+{
+	struct recorder_device desc = {
+		.type = dev->type,
+		.num_devnodes = 3,
+	};
+	const char *type_name = G_OBJECT_TYPE_NAME(dev);
+	const char *serial = dev->serial ? dev->serial : "";
+	struct iovec iov[6];
+	int i;
+
+	iov[0].iov_base = &desc;
+	iov[0].iov_len = sizeof(desc);
+	iov[1].iov_base = (void *)type_name;
+	iov[1].iov_len = strlen(type_name) + 1;
+	for (i = 0; i < 3; i++) {
+		const char *devnode = dev->devnodes[i] ? dev->devnodes[i] : "";
+
+		iov[2 + i].iov_base = (void *)devnode;
+		iov[2 + i].iov_len = strlen(devnode) + 1;
+	}
+
+	iov[5].iov_base = (void *)serial;
+	iov[5].iov_len = strlen(serial) + 1;
+
+	recorder_writev(RECORD_DEVICE, 0, dev->id, 0, iov, 6);
+}
+
 /*
  * Opens the device.
  */
@@ -156,7 +227,12 @@ int ouvrt_device_open(OuvrtDevice *dev)
 }
 
 /*
- * Starts the device and its worker thread.
+ * Starts the device and its worker thread. If the reactor is enabled and the
+ * device implements the dispatch operation, its file descriptors are handled
+ * by the reactor thread instead. Devices with a radio read the calibration
+ * of wireless devices with blocking feature report round-trips from their
+ * dispatch operation, so they keep their own thread to avoid stalling the
+ * other devices.
  */
 int ouvrt_device_start(OuvrtDevice *dev)
 {
@@ -176,8 +252,22 @@ int ouvrt_device_start(OuvrtDevice *dev)
 	if (dev->serial)
 		dev->id = ouvrt_device_claim_id(dev, dev->serial);
 
+	if (recorder_enabled)
+		device_record_description(dev);
+
 	dev->active = TRUE;
-	dev->priv->thread = g_thread_new(NULL, device_start_routine, dev);
+
+	if (ouvrt_reactor_enabled() && OUVRT_DEVICE_GET_CLASS(dev)->dispatch &&
+	    !dev->has_radio) {
+		ret = ouvrt_reactor_add_device(dev);
+		if (ret == 0) {
+			dev->priv->reactor = TRUE;
+			return 0;
+		}
+	}
+
+	dev->priv->thread = ouvrt_thread_new(device_thread_class(dev), NULL,
+					     device_start_routine, dev);
 
 	return 0;
 }
@@ -192,13 +282,76 @@ void ouvrt_device_stop(OuvrtDevice *dev)
 
 	dev->active = FALSE;
 
-	g_thread_join(dev->priv->thread);
-	dev->priv->thread = NULL;
+	if (dev->priv->reactor) {
+		ouvrt_reactor_remove_device(dev);
+		dev->priv->reactor = FALSE;
+	} else {
+		g_thread_join(dev->priv->thread);
+		dev->priv->thread = NULL;
+	}
 
 	OUVRT_DEVICE_GET_CLASS(dev)->stop(dev);
 	OUVRT_DEVICE_GET_CLASS(dev)->close(dev);
 }
 
+/*
+ * Reads from one of the device's file descriptors. If a session is being
+ * recorded, the data is written to the recording as a hidraw report. If the
+ * device is replaying a recorded session, the report passed to
+ * ouvrt_device_replay_report is returned instead. Read errors other than
+ * EAGAIN and EINTR are counted in the device statistics.
+ */
+ssize_t ouvrt_device_read(OuvrtDevice *dev, int index, void *buf, size_t count)
+{
+	ssize_t ret;
+
+	if (dev->priv->replay) {
+		if (!dev->priv->replay_buf) {
+			errno = EAGAIN;
+			return -1;
+		}
+		ret = MIN(count, dev->priv->replay_count);
+		memcpy(buf, dev->priv->replay_buf, ret);
+		dev->priv->replay_buf = NULL;
+		return ret;
+	}
+
+	ret = read(dev->fds[index], buf, count);
+	if (ret > 0 && recorder_enabled)
+		recorder_write(RECORD_HIDRAW_REPORT, index, dev->id, 0, buf,
+			       ret);
+	else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+		stats_count(&dev->stats, STATS_HID_READ_ERRORS, 1);
+
+	return ret;
+}
+
+/*
+ * Feeds a recorded report to the device's dispatch operation, as if it was
+ * read from the file descriptor given by index at time ts. The device must
+ * not be started. Returns -ENOTSUP if the device does not implement the
+ * dispatch operation.
+ */
+int ouvrt_device_replay_report(OuvrtDevice *dev, int index, const void *buf,
+			       size_t count, const struct timespec *ts)
+{
+	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
+	int ret;
+
+	if (!klass->dispatch)
+		return -ENOTSUP;
+
+	dev->priv->replay = TRUE;
+	dev->priv->replay_buf = buf;
+	dev->priv->replay_count = count;
+
+	ret = klass->dispatch(dev, index, ts);
+
+	dev->priv->replay_buf = NULL;
+
+	return ret;
+}
+
 void ouvrt_device_radio_start_discovery(OuvrtDevice *dev)
 {
 	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
@@ -214,3 +367,40 @@ void ouvrt_device_radio_stop_discovery(OuvrtDevice *dev)
 	if (klass->radio_stop_discovery)
 		klass->radio_stop_discovery(dev);
 }
+
+/*
+ * Returns a read-only file descriptor for the device's shared memory pose
+ * ring buffer, creating the ring buffer on first use. Must be called from
+ * the main thread.
+ */
+int ouvrt_device_acquire_pose_fd(OuvrtDevice *dev)
+{
+	struct pose_ring *ring = dev->priv->pose_ring;
+
+	if (!ring) {
+		ring = pose_ring_new();
+		if (!ring)
+			return -ENOMEM;
+		g_atomic_pointer_set(&dev->priv->pose_ring, ring);
+	}
+
+	return pose_ring_get_fd(ring);
+}
+
+/*
+ * Publishes a new pose to the shared memory pose ring buffer, if it was
+ * acquired by a client. To be called from the device thread.
+ */
+void ouvrt_device_publish_pose(OuvrtDevice *dev, uint64_t time,
+			       const struct dpose *pose,
+			       const vec3 *angular_velocity,
+			       const vec3 *linear_velocity)
+{
+	struct pose_ring *ring = g_atomic_pointer_get(&dev->priv->pose_ring);
+
+	trace_instant(TRACE_PUBLISH);
+
+	if (ring)
+		pose_ring_push(ring, time, pose, angular_velocity,
+			       linear_velocity);
+}
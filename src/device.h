@@ -8,6 +8,11 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "maths.h"
+#include "stats.h"
 
 enum device_type {
 	DEVICE_TYPE_HMD,
@@ -44,11 +49,14 @@ struct _OuvrtDevice {
 	char *serial;
 	gboolean active;
 	gboolean has_radio;
+	/* Set if the device publishes poses with ouvrt_device_publish_pose */
+	gboolean has_pose;
 	union {
 		int fd;
 		int fds[3];
 	};
 	char *parent_devpath;
+	struct stats stats;
 
 	OuvrtDevicePrivate *priv;
 };
@@ -59,6 +67,8 @@ struct _OuvrtDeviceClass {
 	int (*open)(OuvrtDevice *dev);
 	int (*start)(OuvrtDevice *dev);
 	void (*thread)(OuvrtDevice *dev);
+	int (*dispatch)(OuvrtDevice *dev, int index, const struct timespec *ts);
+	void (*tick)(OuvrtDevice *dev);
 	void (*stop)(OuvrtDevice *dev);
 	void (*close)(OuvrtDevice *dev);
 
@@ -76,7 +86,20 @@ int ouvrt_device_start(OuvrtDevice *dev);
 void ouvrt_device_stop(OuvrtDevice *dev);
 void ouvrt_device_close(OuvrtDevice *dev);
 
+ssize_t ouvrt_device_read(OuvrtDevice *dev, int index, void *buf,
+			  size_t count);
+int ouvrt_device_replay_report(OuvrtDevice *dev, int index, const void *buf,
+			       size_t count, const struct timespec *ts);
+
 void ouvrt_device_radio_start_discovery(OuvrtDevice *dev);
 void ouvrt_device_radio_stop_discovery(OuvrtDevice *dev);
 
+struct dpose;
+
+int ouvrt_device_acquire_pose_fd(OuvrtDevice *dev);
+void ouvrt_device_publish_pose(OuvrtDevice *dev, uint64_t time,
+			       const struct dpose *pose,
+			       const vec3 *angular_velocity,
+			       const vec3 *linear_velocity);
+
 #endif /* __DEVICE_H__ */
@@ -0,0 +1,122 @@
+/*
+ * Closed-loop exposure and gain control from blob statistics
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * LEDs close to the camera saturate and merge into large blobs, distant
+ * LEDs fall below the blob detection threshold. The controller counts
+ * saturated and dim blobs over a number of frames and scales the product
+ * of exposure time and gain to keep blob peaks between the two. Exposure
+ * time is preferred over gain, as gain amplifies noise.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blobwatch.h"
+#include "exposure-control.h"
+
+/* Blobs with peaks at or above this value are considered saturated */
+#define EXPOSURE_SATURATED_PEAK	0xff
+/* Blobs with peaks below this value are close to the detection threshold */
+#define EXPOSURE_DIM_PEAK	0xc0
+/* Minimum number of frames per update */
+#define EXPOSURE_MIN_FRAMES	4
+
+#define EXPOSURE_STEP_DOWN	0.8
+#define EXPOSURE_STEP_UP	1.25
+
+/*
+ * Initializes the controller with the current exposure time at unity gain,
+ * the exposure time and gain limits, and the minimum time between updates
+ * in nanoseconds.
+ */
+void exposure_control_init(struct exposure_control *ec, uint16_t exposure,
+			   uint16_t min_exposure, uint16_t max_exposure,
+			   uint16_t unity_gain, uint16_t max_gain,
+			   uint64_t interval)
+{
+	ec->min_exposure = min_exposure;
+	ec->max_exposure = max_exposure;
+	ec->unity_gain = unity_gain;
+	ec->max_gain = max_gain;
+	ec->interval = interval;
+	ec->exposure = exposure;
+	ec->gain = unity_gain;
+	ec->last_update = 0;
+	ec->frames = 0;
+	ec->blobs = 0;
+	ec->saturated = 0;
+	ec->dim = 0;
+}
+
+/*
+ * Splits the product of exposure time and gain into an exposure time as
+ * long as possible and the remaining gain.
+ */
+static void exposure_control_set(struct exposure_control *ec, double product)
+{
+	double exposure = product / ec->unity_gain;
+	double gain;
+
+	if (exposure < ec->min_exposure)
+		exposure = ec->min_exposure;
+	if (exposure > ec->max_exposure)
+		exposure = ec->max_exposure;
+	ec->exposure = exposure + 0.5;
+
+	gain = product / ec->exposure;
+	if (gain < ec->unity_gain)
+		gain = ec->unity_gain;
+	if (gain > ec->max_gain)
+		gain = ec->max_gain;
+	ec->gain = gain + 0.5;
+}
+
+/*
+ * Adds the blob statistics of a frame taken at the given time in ns. At
+ * most once per interval, computes new exposure time and gain settings.
+ * Returns true if the settings changed and should be written to the sensor.
+ */
+bool exposure_control_update(struct exposure_control *ec,
+			     const struct blobservation *ob, uint64_t time)
+{
+	uint16_t exposure = ec->exposure;
+	uint16_t gain = ec->gain;
+	double product;
+	int i;
+
+	ec->frames++;
+	if (ob) {
+		for (i = 0; i < ob->num_blobs; i++) {
+			const struct blob *b = &ob->blobs[i];
+
+			ec->blobs++;
+			if (b->peak >= EXPOSURE_SATURATED_PEAK)
+				ec->saturated++;
+			else if (b->peak < EXPOSURE_DIM_PEAK)
+				ec->dim++;
+		}
+	}
+
+	if (time < ec->last_update + ec->interval ||
+	    ec->frames < EXPOSURE_MIN_FRAMES)
+		return false;
+
+	product = (double)ec->exposure * ec->gain;
+	if (4 * ec->saturated > ec->blobs) {
+		/* More than a quarter of the blobs saturated */
+		exposure_control_set(ec, product * EXPOSURE_STEP_DOWN);
+	} else if (ec->blobs < ec->frames || 2 * ec->dim > ec->blobs) {
+		/* Less than one blob per frame, or mostly dim blobs */
+		if (!ec->saturated)
+			exposure_control_set(ec, product * EXPOSURE_STEP_UP);
+	}
+
+	ec->last_update = time;
+	ec->frames = 0;
+	ec->blobs = 0;
+	ec->saturated = 0;
+	ec->dim = 0;
+
+	return ec->exposure != exposure || ec->gain != gain;
+}
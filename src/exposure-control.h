@@ -0,0 +1,46 @@
+/*
+ * Closed-loop exposure and gain control from blob statistics
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __EXPOSURE_CONTROL_H__
+#define __EXPOSURE_CONTROL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct blobservation;
+
+/*
+ * Exposure time and gain are given in sensor register units, with gain
+ * unity_gain corresponding to a gain of 1. Statistics are accumulated over
+ * all frames since the last update.
+ */
+struct exposure_control {
+	/* limits */
+	uint16_t min_exposure;
+	uint16_t max_exposure;
+	uint16_t unity_gain;
+	uint16_t max_gain;
+	uint64_t interval;
+
+	/* current settings */
+	uint16_t exposure;
+	uint16_t gain;
+
+	/* statistics */
+	uint64_t last_update;
+	unsigned int frames;
+	unsigned int blobs;
+	unsigned int saturated;
+	unsigned int dim;
+};
+
+void exposure_control_init(struct exposure_control *ec, uint16_t exposure,
+			   uint16_t min_exposure, uint16_t max_exposure,
+			   uint16_t unity_gain, uint16_t max_gain,
+			   uint64_t interval);
+bool exposure_control_update(struct exposure_control *ec,
+			     const struct blobservation *ob, uint64_t time);
+
+#endif /* __EXPOSURE_CONTROL_H__ */
@@ -0,0 +1,111 @@
+/*
+ * Exposure record ring buffer
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * The headset's IMU thread writes a record for each exposure it reports,
+ * never waiting for readers. Any number of camera threads look up the
+ * exposure that belongs to a frame by its time. Each entry carries a
+ * sequence number that is odd while the entry is written, so that readers
+ * can detect and skip entries that were overwritten while they were copied.
+ */
+#include <glib.h>
+
+#include "exposure-ring.h"
+
+struct exposure_ring_entry {
+	uint64_t sequence;
+	struct exposure exposure;
+};
+
+struct exposure_ring {
+	uint64_t head;
+	struct exposure_ring_entry entries[EXPOSURE_RING_SIZE];
+};
+
+struct exposure_ring *exposure_ring_new(void)
+{
+	return g_new0(struct exposure_ring, 1);
+}
+
+void exposure_ring_free(struct exposure_ring *ring)
+{
+	g_free(ring);
+}
+
+/*
+ * Writes a new exposure record, overwriting the oldest entry. Must only be
+ * called from a single thread.
+ */
+void exposure_ring_push(struct exposure_ring *ring,
+			const struct exposure *exposure)
+{
+	uint64_t head = ring->head;
+	struct exposure_ring_entry *entry;
+
+	entry = &ring->entries[head % EXPOSURE_RING_SIZE];
+
+	__atomic_store_n(&entry->sequence, 2 * head + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->exposure = *exposure;
+	__atomic_store_n(&entry->sequence, 2 * head + 2, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the record at ring position idx. Returns false if it has not been
+ * written yet, or if it was overwritten in the meantime.
+ */
+static bool exposure_ring_get(struct exposure_ring *ring, uint64_t idx,
+			      struct exposure *exposure)
+{
+	struct exposure_ring_entry *entry;
+	uint64_t sequence;
+
+	entry = &ring->entries[idx % EXPOSURE_RING_SIZE];
+
+	sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+	if (sequence != 2 * idx + 2)
+		return false;
+
+	*exposure = entry->exposure;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+/*
+ * Finds the exposure closest to the given CLOCK_MONOTONIC time in ns, at
+ * most max_distance ns away. Returns true if one was found.
+ */
+bool exposure_ring_find_time(struct exposure_ring *ring, uint64_t time,
+			     uint64_t max_distance, struct exposure *exposure)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = head > EXPOSURE_RING_SIZE ?
+			head - EXPOSURE_RING_SIZE : 0;
+	uint64_t best_distance = max_distance;
+	bool found = false;
+	struct exposure e;
+	uint64_t idx;
+
+	/* Walk backwards from the newest record, times are increasing */
+	for (idx = head; idx > tail; idx--) {
+		uint64_t distance;
+
+		if (!exposure_ring_get(ring, idx - 1, &e))
+			continue;
+
+		distance = e.time > time ? e.time - time : time - e.time;
+		if (distance <= best_distance) {
+			best_distance = distance;
+			*exposure = e;
+			found = true;
+		} else if (e.time < time) {
+			break;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,36 @@
+/*
+ * Exposure record ring buffer
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __EXPOSURE_RING_H__
+#define __EXPOSURE_RING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EXPOSURE_RING_SIZE	64
+
+/*
+ * A single synchronised camera exposure, as reported by the headset: the
+ * device timestamp in µs, the estimated CLOCK_MONOTONIC time in ns, the
+ * LED blinking pattern phase, and the exposure counter.
+ */
+struct exposure {
+	uint64_t device_timestamp;
+	uint64_t time;
+	uint32_t count;
+	uint8_t led_pattern_phase;
+};
+
+struct exposure_ring;
+
+struct exposure_ring *exposure_ring_new(void);
+void exposure_ring_free(struct exposure_ring *ring);
+void exposure_ring_push(struct exposure_ring *ring,
+			const struct exposure *exposure);
+bool exposure_ring_find_time(struct exposure_ring *ring, uint64_t time,
+			     uint64_t max_distance,
+			     struct exposure *exposure);
+
+#endif /* __EXPOSURE_RING_H__ */
@@ -105,12 +105,12 @@ static void hololens_camera2_handle_frame(OuvrtHoloLensCamera2 *self,
 		/* Bright frame, headset tracking */
 		debug_stream_frame_push(self->debug1, self->frame,
 					2 * 640 * 481 + 26,
-					0, NULL, NULL, NULL, NULL);
+					0, NULL, NULL, NULL, NULL, 0, NULL);
 	} else if (exposure == 0) {
 		/* Dark frame, controller tracking */
 		debug_stream_frame_push(self->debug2, self->frame,
 					2 * 640 * 481 + 26,
-					0, NULL, NULL, NULL, NULL);
+					0, NULL, NULL, NULL, NULL, 0, NULL);
 	} else {
 		g_print("%s: Unexpected exposure: %u\n", self->dev.name,
 			exposure);
@@ -122,6 +122,9 @@ static void hololens_camera2_transfer_callback(struct libusb_transfer *transfer)
 	OuvrtHoloLensCamera2 *self = transfer->user_data;
 	int ret;
 
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 			g_print("%s: Device vanished\n", self->dev.name);
@@ -143,7 +146,8 @@ static void hololens_camera2_transfer_callback(struct libusb_transfer *transfer)
 				      transfer->actual_length);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+					       transfer);
 	if (ret < 0) {
 		g_print("%s: Failed to resubmit bulk transfer: %d\n",
 			self->dev.name, ret);
@@ -247,7 +251,11 @@ static int hololens_camera2_start(OuvrtDevice *dev)
 		return -ENOMEM;
 
 	for (i = 0; i < self->num_transfers; i++) {
-		self->transfer[i] = libusb_alloc_transfer(0);
+		self->transfer[i] = ouvrt_usb_device_alloc_transfer(
+						OUVRT_USB_DEVICE(self), 0);
+		if (!self->transfer[i])
+			return -ENOMEM;
+
 		void *buf = calloc(1, BULK_TRANSFER_SIZE);
 		bEndpointAddress = self->endpoint | LIBUSB_ENDPOINT_IN;
 		libusb_fill_bulk_transfer(self->transfer[i], devh,
@@ -255,7 +263,8 @@ static int hololens_camera2_start(OuvrtDevice *dev)
 					  hololens_camera2_transfer_callback,
 					  self, 0);
 
-		ret = libusb_submit_transfer(self->transfer[i]);
+		ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+						       self->transfer[i]);
 		if (ret < 0) {
 			g_print("%s: Failed to submit bulk transfer %d\n",
 				dev->name, i);
@@ -120,6 +120,8 @@ static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 		pose_update(1e-7 * dt, &self->imu.pose, &imu);
 
 		telemetry_send_pose(self->dev.id, &self->imu.pose);
+		ouvrt_device_publish_pose(&self->dev, 0, &self->imu.pose,
+					  &imu.angular_velocity, NULL);
 
 		self->last_timestamp = raw.time;
 	}
@@ -200,7 +202,7 @@ again:
 		return -EINVAL;
 	}
 
-	ret = read(dev->fd, report, sizeof(*report));
+	ret = ouvrt_device_read(dev, 0, report, sizeof(*report));
 	if (ret == -1)
 		return -errno;
 	if ((ret == HOLOLENS_IMU_REPORT_SIZE ||
@@ -356,12 +358,55 @@ static int hololens_imu_start(OuvrtDevice *dev)
 }
 
 /*
- * Handles HoloLens IMU messages
+ * Reads and handles a single IMU, control, or debug report.
  */
-static void hololens_imu_thread(OuvrtDevice *dev)
+static int hololens_imu_dispatch(OuvrtDevice *dev, G_GNUC_UNUSED int index,
+				 G_GNUC_UNUSED const struct timespec *ts)
 {
 	OuvrtHoloLensIMU *self = OUVRT_HOLOLENS_IMU(dev);
 	unsigned char buf[HOLOLENS_IMU_REPORT_SIZE];
+	int ret;
+
+	ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
+	if (ret == -1) {
+		if (errno == EAGAIN)
+			return -EAGAIN;
+		g_print("%s: Read error: %d\n", dev->name, errno);
+		return -errno;
+	}
+
+	if (ret == HOLOLENS_IMU_REPORT_SIZE_V2 &&
+	    buf[0] == HOLOLENS_IMU_REPORT_ID) {
+		/*
+		 * Debug messages have been moved out of the main IMU report
+		 * in a firmware update.
+		 */
+		memset(buf + HOLOLENS_IMU_REPORT_SIZE_V2, 0,
+		       HOLOLENS_IMU_REPORT_SIZE - HOLOLENS_IMU_REPORT_SIZE_V2);
+		hololens_imu_handle_imu_report(self, (void *)buf);
+	} else if (ret == HOLOLENS_IMU_REPORT_SIZE &&
+		   buf[0] == HOLOLENS_IMU_REPORT_ID) {
+		hololens_imu_handle_imu_report(self, (void *)buf);
+	} else if (ret == HOLOLENS_CONTROL_REPORT_SIZE &&
+		   buf[0] == HOLOLENS_CONTROL_REPORT_ID) {
+		hololens_imu_handle_control_report(self, (void *)buf);
+	} else if (ret == HOLOLENS_DEBUG_REPORT_SIZE &&
+		   buf[0] == HOLOLENS_DEBUG_REPORT_ID) {
+		hololens_imu_handle_debug_report(&self->dev, (void *)buf);
+	} else {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			dev->name, ret, buf[0]);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Handles HoloLens IMU messages
+ */
+static void hololens_imu_thread(OuvrtDevice *dev)
+{
 	struct pollfd fds;
 	int ret;
 
@@ -390,37 +435,7 @@ static void hololens_imu_thread(OuvrtDevice *dev)
 			continue;
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-
-		if (ret == HOLOLENS_IMU_REPORT_SIZE_V2 &&
-		    buf[0] == HOLOLENS_IMU_REPORT_ID) {
-			/*
-			 * Debug messages have been moved out of the main IMU
-			 * report in a firmware update.
-			 */
-			memset(buf + HOLOLENS_IMU_REPORT_SIZE_V2, 0,
-			       HOLOLENS_IMU_REPORT_SIZE -
-			       HOLOLENS_IMU_REPORT_SIZE_V2);
-			hololens_imu_handle_imu_report(self, (void *)buf);
-		} else if (ret == HOLOLENS_IMU_REPORT_SIZE &&
-		    buf[0] == HOLOLENS_IMU_REPORT_ID) {
-			hololens_imu_handle_imu_report(self, (void *)buf);
-		} else if (ret == HOLOLENS_CONTROL_REPORT_SIZE &&
-			   buf[0] == HOLOLENS_CONTROL_REPORT_ID) {
-			hololens_imu_handle_control_report(self, (void *)buf);
-		} else if (ret == HOLOLENS_DEBUG_REPORT_SIZE &&
-			   buf[0] == HOLOLENS_DEBUG_REPORT_ID) {
-			hololens_imu_handle_debug_report(&self->dev,
-							 (void *)buf);
-		} else {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
+		hololens_imu_dispatch(dev, 0, NULL);
 	}
 }
 
@@ -445,12 +460,14 @@ ouvrt_hololens_imu_class_init(OuvrtHoloLensIMUClass *klass)
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_hololens_imu_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = hololens_imu_start;
 	OUVRT_DEVICE_CLASS(klass)->thread = hololens_imu_thread;
+	OUVRT_DEVICE_CLASS(klass)->dispatch = hololens_imu_dispatch;
 	OUVRT_DEVICE_CLASS(klass)->stop = hololens_imu_stop;
 }
 
 static void ouvrt_hololens_imu_init(OuvrtHoloLensIMU *self)
 {
 	self->dev.type = DEVICE_TYPE_HMD;
+	self->dev.has_pose = TRUE;
 	self->imu.pose.rotation.w = 1.0;
 }
 
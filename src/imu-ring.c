@@ -0,0 +1,107 @@
+/*
+ * IMU state ring buffer
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * A single IMU thread writes timestamped IMU states into the ring, never
+ * waiting for readers. Camera threads read the samples that were taken
+ * between two exposures, each keeping its own read position. Samples that
+ * are overwritten before a reader gets to them are counted as overflows.
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "imu-ring.h"
+
+struct imu_ring_entry {
+	uint64_t time;
+	struct imu_state state;
+};
+
+struct imu_ring {
+	uint64_t head;
+	struct imu_ring_entry entries[IMU_RING_SIZE];
+};
+
+struct imu_ring *imu_ring_new(void)
+{
+	return g_new0(struct imu_ring, 1);
+}
+
+void imu_ring_free(struct imu_ring *ring)
+{
+	g_free(ring);
+}
+
+/*
+ * Writes a new IMU state, taken at the given CLOCK_MONOTONIC time in
+ * nanoseconds, overwriting the oldest entry. Must only be called from a
+ * single thread.
+ */
+void imu_ring_push(struct imu_ring *ring, uint64_t time,
+		   const struct imu_state *state)
+{
+	uint64_t head = ring->head;
+	struct imu_ring_entry *entry = &ring->entries[head % IMU_RING_SIZE];
+
+	entry->time = time;
+	entry->state = *state;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the states taken since the previous call, up to but excluding the
+ * given time, into states. If there are more than n, only the latest n are
+ * returned. Returns the number of states copied.
+ */
+unsigned int imu_ring_read(struct imu_ring *ring,
+			   struct imu_ring_reader *reader, uint64_t time,
+			   struct imu_state *states, unsigned int n)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t start, end, torn_end, idx;
+	unsigned int num = 0;
+	unsigned int torn = 0;
+
+	/* Start with the next sample on first use, or after a ring change */
+	if (reader->cursor == 0 || reader->cursor > head)
+		reader->cursor = head;
+
+	if (head - reader->cursor > IMU_RING_SIZE) {
+		reader->overflows += head - reader->cursor - IMU_RING_SIZE;
+		reader->cursor = head - IMU_RING_SIZE;
+	}
+
+	/* Find the first sample taken at or after time */
+	for (end = reader->cursor; end < head; end++) {
+		if (ring->entries[end % IMU_RING_SIZE].time >= time)
+			break;
+	}
+
+	start = reader->cursor;
+	if (end - start > n) {
+		reader->overflows += end - start - n;
+		start = end - n;
+	}
+
+	for (idx = start; idx < end; idx++)
+		states[num++] = ring->entries[idx % IMU_RING_SIZE].state;
+
+	/*
+	 * The writer may have overwritten the oldest samples while they were
+	 * copied. Drop those, including the one that may be written right now.
+	 */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	torn_end = head + 1 > IMU_RING_SIZE ? head + 1 - IMU_RING_SIZE : 0;
+	if (torn_end > start) {
+		torn = MIN(end, torn_end) - start;
+		reader->overflows += torn;
+		memmove(states, states + torn, (num - torn) * sizeof(*states));
+	}
+
+	reader->cursor = end;
+
+	return num - torn;
+}
@@ -0,0 +1,35 @@
+/*
+ * IMU state ring buffer
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __IMU_RING_H__
+#define __IMU_RING_H__
+
+#include <stdint.h>
+
+#include "imu.h"
+
+#define IMU_RING_SIZE	256
+
+/*
+ * Read position of a single consumer. Samples that were overwritten before
+ * the consumer got to read them, or that did not fit into the output array,
+ * are counted in overflows.
+ */
+struct imu_ring_reader {
+	uint64_t cursor;
+	uint64_t overflows;
+};
+
+struct imu_ring;
+
+struct imu_ring *imu_ring_new(void);
+void imu_ring_free(struct imu_ring *ring);
+void imu_ring_push(struct imu_ring *ring, uint64_t time,
+		   const struct imu_state *state);
+unsigned int imu_ring_read(struct imu_ring *ring,
+			   struct imu_ring_reader *reader, uint64_t time,
+			   struct imu_state *states, unsigned int n);
+
+#endif /* __IMU_RING_H__ */
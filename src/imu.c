@@ -7,6 +7,7 @@
 
 #include "imu.h"
 #include "maths.h"
+#include "trace.h"
 
 enum pose_mode {
 	ACCEL_ONLY,
@@ -36,6 +37,8 @@ void pose_update(double dt, struct dpose *pose, struct imu_sample *sample)
 {
 	dquat q, dq;
 
+	trace_begin(TRACE_FUSION);
+
 	switch (mode) {
 	case ACCEL_ONLY:
 		dquat_from_accel(&q, &sample->acceleration);
@@ -48,4 +51,6 @@ void pose_update(double dt, struct dpose *pose, struct imu_sample *sample)
 	}
 
 	pose->rotation = q;
+
+	trace_end(TRACE_FUSION);
 }
@@ -32,12 +32,39 @@ static int lenovo_explorer_start(G_GNUC_UNUSED OuvrtDevice *dev)
 }
 
 /*
- * Handles Lenovo Explorer messages.
+ * Reads and handles a single proximity sensor report.
  */
-static void lenovo_explorer_thread(OuvrtDevice *dev)
+static int lenovo_explorer_dispatch(OuvrtDevice *dev, G_GNUC_UNUSED int index,
+				    G_GNUC_UNUSED const struct timespec *ts)
 {
 	OuvrtLenovoExplorer *self = OUVRT_LENOVO_EXPLORER(dev);
 	unsigned char buf[64];
+	int ret;
+
+	ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
+	if (ret == -1) {
+		if (errno == EAGAIN)
+			return -EAGAIN;
+		g_print("%s: Read error: %d\n", dev->name, errno);
+		return -errno;
+	}
+	if (ret != 2 || buf[0] != 0x01) {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			dev->name, ret, buf[0]);
+		return -EINVAL;
+	}
+
+	self->proximity = buf[1];
+	g_print("%s: Proximity: %d\n", dev->name, buf[1]);
+
+	return 0;
+}
+
+/*
+ * Handles Lenovo Explorer messages.
+ */
+static void lenovo_explorer_thread(OuvrtDevice *dev)
+{
 	struct pollfd fds;
 	int ret;
 
@@ -66,19 +93,7 @@ static void lenovo_explorer_thread(OuvrtDevice *dev)
 			continue;
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-		if (ret != 2 || buf[0] != 0x01) {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
-
-		self->proximity = buf[1];
-		g_print("%s: Proximity: %d\n", dev->name, buf[1]);
+		lenovo_explorer_dispatch(dev, 0, NULL);
 	}
 }
 
@@ -103,6 +118,7 @@ ouvrt_lenovo_explorer_class_init(OuvrtLenovoExplorerClass *klass)
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_lenovo_explorer_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = lenovo_explorer_start;
 	OUVRT_DEVICE_CLASS(klass)->thread = lenovo_explorer_thread;
+	OUVRT_DEVICE_CLASS(klass)->dispatch = lenovo_explorer_dispatch;
 	OUVRT_DEVICE_CLASS(klass)->stop = lenovo_explorer_stop;
 }
 
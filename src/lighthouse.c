@@ -9,6 +9,7 @@
 #include <string.h>
 #include <zlib.h>
 #include "lighthouse.h"
+#include "log.h"
 #include "maths.h"
 #include "telemetry.h"
 
@@ -367,8 +368,10 @@ static void lighthouse_handle_sweep_pulse(struct lighthouse_watchman *watchman,
 		return;
 
 	if (!pulse_in_sweep_window(offset, duration)) {
-		g_print("%s: sweep offset out of range: rotor %u offset %u duration %u\n",
-			watchman->name, base->active_rotor, offset, duration);
+		log_ratelimited(LOG_WARNING, 1000,
+				"%s: sweep offset out of range: rotor %u offset %u duration %u\n",
+				watchman->name, base->active_rotor, offset,
+				duration);
 		return;
 	}
 
@@ -437,9 +440,10 @@ void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
 				g_print("%s: late pulse, lost sync\n",
 					watchman->name);
 			} else {
-				g_print("%s: spurious pulse: %08x (%02x %d %u)\n",
-					watchman->name, timestamp, id, dt,
-					duration);
+				log_ratelimited(LOG_WARNING, 1000,
+						"%s: spurious pulse: %08x (%02x %d %u)\n",
+						watchman->name, timestamp, id,
+						dt, duration);
 			}
 			watchman->seen_by = 0;
 		}
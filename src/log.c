@@ -0,0 +1,533 @@
+/*
+ * Rate limited, deferred logging
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * Log sites in hot paths only check their rate limit and copy their
+ * arguments into a lock-free queue. A logging thread formats and prints
+ * the queued messages, and periodically reports the number of messages
+ * suppressed at call sites that have gone quiet. If the logging thread is
+ * not running, messages are formatted and printed immediately.
+ */
+#define _GNU_SOURCE
+#include <glib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "thread-policy.h"
+
+#define LOG_QUEUE_SIZE		256
+#define LOG_POLL_INTERVAL_US	10000
+#define LOG_LINE_SIZE		256
+
+enum log_arg_type {
+	LOG_ARG_NONE,
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_SIZE,
+	LOG_ARG_INTMAX,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STRING,
+	LOG_ARG_POINTER,
+};
+
+enum log_site_state {
+	LOG_SITE_NEW,
+	LOG_SITE_READY,
+	/* The format contains unsupported conversions, print immediately */
+	LOG_SITE_DIRECT,
+};
+
+union log_arg {
+	long long i;
+	double d;
+	const void *p;
+	size_t offset;
+};
+
+struct log_entry {
+	struct log_site *site;
+	uint64_t suppressed;
+	union log_arg args[LOG_MAX_ARGS];
+	char strings[LOG_MAX_STRING];
+};
+
+/*
+ * Bounded multi-producer queue. Each slot's sequence tells producers and
+ * the consumer whether the slot is free or filled for a given position.
+ */
+struct log_slot {
+	uint64_t sequence;
+	struct log_entry entry;
+};
+
+static struct log_slot queue[LOG_QUEUE_SIZE];
+static uint64_t queue_tail;
+static uint64_t queue_head;
+
+static struct log_site *sites;
+static GThread *log_thread;
+static bool log_running;
+
+static uint64_t log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Finds the next conversion specification in the format string, starting
+ * at s. Returns a pointer to its '%' and stores the end of the conversion
+ * and the argument type, which is LOG_ARG_NONE for "%%". Returns NULL if
+ * there is no further conversion, or if the conversion is not supported.
+ */
+static const char *log_next_conversion(const char *s, const char **end,
+				       int *type)
+{
+	const char *p;
+	int length = 0;
+
+	s = strchr(s, '%');
+	if (!s) {
+		*type = LOG_ARG_NONE;
+		return NULL;
+	}
+
+	p = s + 1;
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.') {
+		p++;
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if (*p == 'h') {
+		p += p[1] == 'h' ? 2 : 1;
+	} else if (*p == 'l') {
+		length = p[1] == 'l' ? LOG_ARG_LLONG : LOG_ARG_LONG;
+		p += p[1] == 'l' ? 2 : 1;
+	} else if (*p == 'z') {
+		length = LOG_ARG_SIZE;
+		p++;
+	} else if (*p == 'j') {
+		length = LOG_ARG_INTMAX;
+		p++;
+	}
+
+	switch (*p) {
+	case '%':
+		*type = LOG_ARG_NONE;
+		break;
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		*type = length ? length : LOG_ARG_INT;
+		break;
+	case 'c':
+		*type = LOG_ARG_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+	case 'a': case 'A':
+		/* %lf is the same as %f */
+		if (length == LOG_ARG_LONG)
+			length = 0;
+		*type = LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		*type = LOG_ARG_STRING;
+		break;
+	case 'p':
+		*type = LOG_ARG_POINTER;
+		break;
+	default:
+		/* '*' width or precision, wide strings, or invalid format */
+		return NULL;
+	}
+	/* Wide characters and strings, or nonsensical length modifiers */
+	if (length && *type != length)
+		return NULL;
+
+	*end = p + 1;
+
+	return s;
+}
+
+/*
+ * Parses the site's format string and registers the site, so that the
+ * logging thread can report suppressed messages.
+ */
+static int log_site_init(struct log_site *site)
+{
+	const char *s = site->format;
+	int state = LOG_SITE_READY;
+	int num_args = 0;
+	const char *end;
+	int type;
+
+	while (*s) {
+		if (!log_next_conversion(s, &end, &type)) {
+			if (strchr(s, '%'))
+				state = LOG_SITE_DIRECT;
+			break;
+		}
+		s = end;
+		if (type == LOG_ARG_NONE)
+			continue;
+		if (num_args == LOG_MAX_ARGS) {
+			state = LOG_SITE_DIRECT;
+			break;
+		}
+		site->arg_types[num_args++] = type;
+	}
+	site->num_args = num_args;
+
+	/* Concurrent initialization yields the same result */
+	if (__atomic_exchange_n(&site->state, state, __ATOMIC_ACQ_REL) ==
+	    LOG_SITE_NEW) {
+		site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&sites, &site->next, site,
+						    true, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+
+	return state;
+}
+
+/*
+ * Formats a queued message into buf.
+ */
+static void log_format(const struct log_entry *entry, char *buf, size_t size)
+{
+	const struct log_site *site = entry->site;
+	const char *s = site->format;
+	const char *conversion;
+	size_t len = 0;
+	int arg = 0;
+
+	buf[0] = '\0';
+	while (len < size - 1) {
+		const union log_arg *a = &entry->args[arg];
+		char spec[32];
+		const char *end;
+		int type;
+		int n;
+
+		conversion = log_next_conversion(s, &end, &type);
+		if (!conversion) {
+			g_strlcpy(buf + len, s, size - len);
+			break;
+		}
+
+		n = MIN((size_t)(conversion - s), size - 1 - len);
+		memcpy(buf + len, s, n);
+		len += n;
+		buf[len] = '\0';
+		s = end;
+
+		if ((size_t)(end - conversion) >= sizeof(spec))
+			break;
+		memcpy(spec, conversion, end - conversion);
+		spec[end - conversion] = '\0';
+
+		switch (type) {
+		case LOG_ARG_NONE:
+			n = snprintf(buf + len, size - len, "%%");
+			break;
+		case LOG_ARG_INT:
+			n = snprintf(buf + len, size - len, spec, (int)a->i);
+			break;
+		case LOG_ARG_LONG:
+			n = snprintf(buf + len, size - len, spec, (long)a->i);
+			break;
+		case LOG_ARG_LLONG:
+			n = snprintf(buf + len, size - len, spec, a->i);
+			break;
+		case LOG_ARG_SIZE:
+			n = snprintf(buf + len, size - len, spec, (size_t)a->i);
+			break;
+		case LOG_ARG_INTMAX:
+			n = snprintf(buf + len, size - len, spec,
+				     (intmax_t)a->i);
+			break;
+		case LOG_ARG_DOUBLE:
+			n = snprintf(buf + len, size - len, spec, a->d);
+			break;
+		case LOG_ARG_STRING:
+			n = snprintf(buf + len, size - len, spec,
+				     entry->strings + a->offset);
+			break;
+		case LOG_ARG_POINTER:
+			n = snprintf(buf + len, size - len, spec, a->p);
+			break;
+		default:
+			n = 0;
+			break;
+		}
+		if (type != LOG_ARG_NONE)
+			arg++;
+		if (n < 0)
+			break;
+		len = MIN(len + n, size - 1);
+	}
+}
+
+/*
+ * Prints a message, with the number of messages suppressed before it
+ * inserted before the trailing newline.
+ */
+static void log_print(const char *message, uint64_t suppressed)
+{
+	size_t len = strlen(message);
+
+	if (!suppressed) {
+		g_print("%s", message);
+		return;
+	}
+
+	if (len && message[len - 1] == '\n')
+		len--;
+	g_print("%.*s (%" G_GUINT64_FORMAT " suppressed)\n", (int)len,
+		message, suppressed);
+}
+
+static void log_entry_print(const struct log_entry *entry)
+{
+	char buf[LOG_LINE_SIZE];
+
+	log_format(entry, buf, sizeof(buf));
+	log_print(buf, entry->suppressed);
+}
+
+static bool log_enqueue(const struct log_entry *entry)
+{
+	uint64_t pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+	struct log_slot *slot;
+
+	for (;;) {
+		uint64_t sequence;
+
+		slot = &queue[pos % LOG_QUEUE_SIZE];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence == pos) {
+			if (__atomic_compare_exchange_n(&queue_tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(sequence - pos) < 0) {
+			/* Queue full */
+			return false;
+		} else {
+			pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->entry = *entry;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Prints all queued messages. Must only be called from the logging thread.
+ */
+static void log_drain(void)
+{
+	for (;;) {
+		struct log_slot *slot = &queue[queue_head % LOG_QUEUE_SIZE];
+		struct log_entry entry;
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) !=
+		    queue_head + 1)
+			break;
+
+		entry = slot->entry;
+		__atomic_store_n(&slot->sequence, queue_head + LOG_QUEUE_SIZE,
+				 __ATOMIC_RELEASE);
+		queue_head++;
+
+		log_entry_print(&entry);
+	}
+}
+
+/*
+ * Reports messages that were suppressed at call sites which have not
+ * printed a message since their rate limit interval expired.
+ */
+static void log_report_suppressed(void)
+{
+	struct log_site *site;
+	uint64_t now = log_now();
+
+	for (site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); site;
+	     site = site->next) {
+		uint64_t next = __atomic_load_n(&site->next_time,
+						__ATOMIC_RELAXED);
+		uint64_t suppressed;
+		size_t len;
+
+		if (now < next ||
+		    !__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED))
+			continue;
+		if (!__atomic_compare_exchange_n(&site->next_time, &next,
+						 now + site->interval, false,
+						 __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED))
+			continue;
+
+		suppressed = __atomic_exchange_n(&site->suppressed, 0,
+						 __ATOMIC_RELAXED);
+		len = strlen(site->format);
+		if (len && site->format[len - 1] == '\n')
+			len--;
+		g_print("%" G_GUINT64_FORMAT " messages suppressed: \"%.*s\"\n",
+			suppressed, (int)len, site->format);
+	}
+}
+
+static gpointer log_thread_func(G_GNUC_UNUSED gpointer data)
+{
+	while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		log_drain();
+		log_report_suppressed();
+		g_usleep(LOG_POLL_INTERVAL_US);
+	}
+	log_drain();
+
+	return NULL;
+}
+
+void log_site_write(struct log_site *site, ...)
+{
+	uint64_t now = log_now();
+	struct log_entry entry;
+	size_t strings = 0;
+	uint64_t next;
+	va_list ap;
+	int state;
+	int i;
+
+	next = __atomic_load_n(&site->next_time, __ATOMIC_RELAXED);
+	if (now < next ||
+	    !__atomic_compare_exchange_n(&site->next_time, &next,
+					 now + site->interval, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+	if (state == LOG_SITE_NEW)
+		state = log_site_init(site);
+
+	entry.site = site;
+	entry.suppressed = __atomic_exchange_n(&site->suppressed, 0,
+					       __ATOMIC_RELAXED);
+
+	va_start(ap, site);
+	if (state == LOG_SITE_DIRECT) {
+		char buf[LOG_LINE_SIZE];
+
+		vsnprintf(buf, sizeof(buf), site->format, ap);
+		va_end(ap);
+		log_print(buf, entry.suppressed);
+		return;
+	}
+
+	for (i = 0; i < site->num_args; i++) {
+		union log_arg *a = &entry.args[i];
+		const char *str;
+		size_t len;
+
+		switch (site->arg_types[i]) {
+		case LOG_ARG_INT:
+			a->i = va_arg(ap, int);
+			break;
+		case LOG_ARG_LONG:
+			a->i = va_arg(ap, long);
+			break;
+		case LOG_ARG_LLONG:
+			a->i = va_arg(ap, long long);
+			break;
+		case LOG_ARG_SIZE:
+			a->i = va_arg(ap, size_t);
+			break;
+		case LOG_ARG_INTMAX:
+			a->i = va_arg(ap, intmax_t);
+			break;
+		case LOG_ARG_DOUBLE:
+			a->d = va_arg(ap, double);
+			break;
+		case LOG_ARG_STRING:
+			str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+			len = MIN(strlen(str), LOG_MAX_STRING - 1 - strings);
+			memcpy(entry.strings + strings, str, len);
+			entry.strings[strings + len] = '\0';
+			a->offset = strings;
+			strings += len + (strings + len < LOG_MAX_STRING - 1);
+			break;
+		case LOG_ARG_POINTER:
+			a->p = va_arg(ap, const void *);
+			break;
+		}
+	}
+	va_end(ap);
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		log_entry_print(&entry);
+		return;
+	}
+
+	/* If the queue is full, report this message as suppressed */
+	if (!log_enqueue(&entry)) {
+		__atomic_fetch_add(&site->suppressed, entry.suppressed + 1,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Starts the logging thread.
+ */
+void log_init(void)
+{
+	int i;
+
+	if (log_thread)
+		return;
+
+	for (i = 0; i < LOG_QUEUE_SIZE; i++)
+		queue[i].sequence = i;
+	queue_head = queue_tail = 0;
+
+	__atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+	log_thread = ouvrt_thread_new("log", "ouvrt-log", log_thread_func,
+				      NULL);
+}
+
+/*
+ * Prints all queued messages and stops the logging thread. Messages logged
+ * afterwards are printed immediately.
+ */
+void log_deinit(void)
+{
+	if (!log_thread)
+		return;
+
+	__atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+	g_thread_join(log_thread);
+	log_thread = NULL;
+}
@@ -0,0 +1,71 @@
+/*
+ * Rate limited, deferred logging
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum log_level {
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARNING,
+};
+
+/*
+ * Log sites below this level are removed at compile time. Debug messages
+ * are enabled with the debug_log build option.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL		LOG_INFO
+#endif
+
+#define LOG_MAX_ARGS		6
+#define LOG_MAX_STRING		64
+
+/*
+ * A single call site. The format is parsed on first use, so that the hot
+ * path only has to copy the arguments. Arguments to %s conversions are
+ * copied as well, up to a combined length of LOG_MAX_STRING bytes.
+ */
+struct log_site {
+	const char *format;
+	enum log_level level;
+	uint64_t interval;
+
+	int state;
+	int num_args;
+	uint8_t arg_types[LOG_MAX_ARGS];
+	struct log_site *next;
+	uint64_t next_time;
+	uint64_t suppressed;
+};
+
+void log_site_write(struct log_site *site, ...);
+
+/*
+ * Logs a printf style message at most once per interval_ms milliseconds
+ * per call site. Messages in between are counted and the number of
+ * suppressed messages is appended to the next message that is printed.
+ * Formatting and output happen in the logging thread.
+ */
+#define log_ratelimited(lvl, interval_ms, fmt, ...)			\
+	do {								\
+		static struct log_site _log_site = {			\
+			.format = fmt,					\
+			.level = lvl,					\
+			.interval = (interval_ms) * 1000000ULL,		\
+		};							\
+		if ((lvl) >= LOG_MIN_LEVEL)				\
+			log_site_write(&_log_site, ##__VA_ARGS__);	\
+		if (0)							\
+			printf(fmt, ##__VA_ARGS__);			\
+	} while (0)
+
+void log_init(void);
+void log_deinit(void);
+
+#endif /* __LOG_H__ */
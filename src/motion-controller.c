@@ -21,6 +21,7 @@ struct _OuvrtMotionController {
 	OuvrtDevice dev;
 
 	bool missing;
+	unsigned int num_reports;
 	uint64_t last_timestamp;
 	uint8_t buttons;
 	uint8_t battery;
@@ -131,6 +132,8 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 	self->imu.pose.translation.y = 0.0;
 	self->imu.pose.translation.z = 0.0;
 	telemetry_send_pose(self->dev.id, &self->imu.pose);
+	ouvrt_device_publish_pose(&self->dev, 0, &self->imu.pose,
+				  &sample.angular_velocity, NULL);
 
 	if (buttons != self->buttons) {
 		ouvrt_handle_buttons(self->dev.id, buttons, self->buttons,
@@ -147,13 +150,57 @@ static int motion_controller_start(G_GNUC_UNUSED OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Reads and handles a single report.
+ */
+static int motion_controller_dispatch(OuvrtDevice *dev,
+				      G_GNUC_UNUSED int index,
+				      const struct timespec *ts)
+{
+	OuvrtMotionController *self = OUVRT_MOTION_CONTROLLER(dev);
+	unsigned char buf[64];
+	int ret;
+
+	ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
+	if (ret == -1) {
+		if (errno == EAGAIN)
+			return -EAGAIN;
+		g_print("%s: Read error: %d\n", dev->name, errno);
+		return -errno;
+	}
+	if (ret != 45 || buf[0] != 0x01) {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			dev->name, ret, buf[0]);
+		return -EINVAL;
+	}
+
+	motion_controller_decode_message(self, buf, ts);
+	self->num_reports++;
+
+	return 0;
+}
+
+/*
+ * Reports when the device stopped sending. Called about once per second by
+ * the reactor.
+ */
+static void motion_controller_tick(OuvrtDevice *dev)
+{
+	OuvrtMotionController *self = OUVRT_MOTION_CONTROLLER(dev);
+
+	if (self->num_reports == 0 && !self->missing) {
+		g_print("%s: Device stopped sending\n", dev->name);
+		self->missing = true;
+	}
+	self->num_reports = 0;
+}
+
 /*
  * Handles Motion Controller messages.
  */
 static void motion_controller_thread(OuvrtDevice *dev)
 {
 	OuvrtMotionController *self = OUVRT_MOTION_CONTROLLER(dev);
-	unsigned char buf[64];
 	struct timespec ts;
 	struct pollfd fds;
 	int ret;
@@ -190,18 +237,7 @@ static void motion_controller_thread(OuvrtDevice *dev)
 			continue;
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-		if (ret != 45 || buf[0] != 0x01) {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
-
-		motion_controller_decode_message(self, buf, &ts);
+		motion_controller_dispatch(dev, 0, &ts);
 	}
 }
 
@@ -226,12 +262,15 @@ ouvrt_motion_controller_class_init(OuvrtMotionControllerClass *klass)
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_motion_controller_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = motion_controller_start;
 	OUVRT_DEVICE_CLASS(klass)->thread = motion_controller_thread;
+	OUVRT_DEVICE_CLASS(klass)->dispatch = motion_controller_dispatch;
+	OUVRT_DEVICE_CLASS(klass)->tick = motion_controller_tick;
 	OUVRT_DEVICE_CLASS(klass)->stop = motion_controller_stop;
 }
 
 static void ouvrt_motion_controller_init(OuvrtMotionController *self)
 {
 	self->dev.type = DEVICE_TYPE_CONTROLLER;
+	self->dev.has_pose = TRUE;
 	self->imu.pose.rotation.w = 1.0;
 }
 
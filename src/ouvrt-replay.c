@@ -0,0 +1,565 @@
+/*
+ * Deterministic replay of recorded sessions
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Feeds a session recorded with ouvrtd --record through the device decoders
+ * and the blob detector as fast as possible. Devices are recreated as
+ * virtual devices that are never opened or started: hidraw reports are
+ * handed to the device dispatch operation, USB transfers to the device
+ * replay_transfer operation, and camera frames to a blobwatch instance per
+ * camera. All timestamps are taken from the recording, so every run yields
+ * the same results. The blobs found in V4L2 and Rift Sensor frames and the
+ * IMU poses are summarized in a digest.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <glib.h>
+#include <locale.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+#include "device.h"
+#include "hololens-imu.h"
+#include "imu-ring.h"
+#include "lenovo-explorer.h"
+#include "motion-controller.h"
+#include "ouvrtd.h"
+#include "replay.h"
+#include "rift.h"
+#include "rift-sensor.h"
+#include "sparse-frame.h"
+#include "trace.h"
+#include "tracker.h"
+#include "usb-device.h"
+#include "vive-headset.h"
+#include "vive-hid-reports.h"
+#include "vive-imu.h"
+
+#define FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+#define REPLAY_MAX_IMU_STATES	64
+
+GList *device_list;
+
+struct replay_device {
+	uint32_t id;
+	OuvrtDevice *dev;
+
+	/* Virtual camera */
+	struct blobwatch *bw;
+	uint8_t *frame;
+	int width;
+	int height;
+
+	/* Vive headset IMU */
+	bool has_vive_imu;
+	struct vive_imu imu;
+
+	/* IMU states produced by the Rift */
+	OuvrtTracker *tracker;
+	struct imu_ring_reader imu_reader;
+};
+
+struct replay_stats {
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t reports;
+	uint64_t transfers;
+	uint64_t frames;
+	uint64_t blobs;
+	uint64_t imu_states;
+	uint64_t skipped;
+	uint64_t first_time;
+	uint64_t last_time;
+	uint64_t digest;
+};
+
+struct replay_type {
+	const char *name;
+	OuvrtDevice *(*new)(const char *devnode);
+};
+
+static const struct replay_type replay_types[] = {
+	{ "OuvrtHoloLensIMU", hololens_imu_new },
+	{ "OuvrtLenovoExplorer", lenovo_explorer_new },
+	{ "OuvrtMotionController", motion_controller_new },
+	{ "OuvrtRift", rift_dk2_new },
+	{ "OuvrtRiftSensor", rift_sensor_new },
+	{ "OuvrtViveHeadset", vive_headset_new },
+};
+
+static GHashTable *replay_devices;
+static OuvrtTracker *replay_tracker;
+
+static void digest_update(struct replay_stats *stats, const void *data,
+			  size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t hash = stats->digest;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+
+	stats->digest = hash;
+}
+
+static void digest_update_pose(struct replay_stats *stats,
+			       const struct dpose *pose)
+{
+	digest_update(stats, &pose->rotation, sizeof(pose->rotation));
+	digest_update(stats, &pose->translation, sizeof(pose->translation));
+}
+
+static void digest_update_blobs(struct replay_stats *stats,
+				const struct blobservation *ob)
+{
+	int i;
+
+	stats->blobs += ob->num_blobs;
+	digest_update(stats, &ob->num_blobs, sizeof(ob->num_blobs));
+	for (i = 0; i < ob->num_blobs; i++) {
+		digest_update(stats, &ob->blobs[i].x, sizeof(ob->blobs[i].x));
+		digest_update(stats, &ob->blobs[i].y, sizeof(ob->blobs[i].y));
+		digest_update(stats, &ob->blobs[i].area,
+			      sizeof(ob->blobs[i].area));
+	}
+}
+
+/*
+ * Adds the blobs found by a Rift Sensor in a frame assembled from recorded
+ * transfers to the digest.
+ */
+static void replay_sensor_observer(G_GNUC_UNUSED OuvrtRiftSensor *sensor,
+				   const struct blobservation *ob,
+				   gpointer user_data)
+{
+	struct replay_stats *stats = user_data;
+
+	stats->frames++;
+	if (ob)
+		digest_update_blobs(stats, ob);
+}
+
+static void replay_device_free(gpointer data)
+{
+	struct replay_device *rdev = data;
+
+	if (rdev->dev) {
+		device_list = g_list_remove(device_list, rdev->dev);
+		g_object_unref(rdev->dev);
+	}
+	blobwatch_free(rdev->bw);
+	g_free(rdev->frame);
+	g_free(rdev);
+}
+
+static struct replay_device *replay_device_get(uint32_t id)
+{
+	struct replay_device *rdev;
+
+	rdev = g_hash_table_lookup(replay_devices, GUINT_TO_POINTER(id));
+	if (!rdev) {
+		rdev = g_new0(struct replay_device, 1);
+		rdev->id = id;
+		g_hash_table_insert(replay_devices, GUINT_TO_POINTER(id), rdev);
+	}
+
+	return rdev;
+}
+
+/*
+ * Connects Rift Sensors to the Rift tracker, like ouvrtd does for the live
+ * devices.
+ */
+static void replay_link_sensor(G_GNUC_UNUSED gpointer key, gpointer value,
+			       G_GNUC_UNUSED gpointer user_data)
+{
+	struct replay_device *rdev = value;
+
+	if (rdev->dev && OUVRT_IS_RIFT_SENSOR(rdev->dev))
+		ouvrt_rift_sensor_set_tracker(OUVRT_RIFT_SENSOR(rdev->dev),
+					      replay_tracker);
+}
+
+/*
+ * Creates a virtual device from a recorded device description.
+ */
+static void replay_add_device(struct replay_stats *stats,
+			      const struct recorder_record *record,
+			      const void *payload)
+{
+	const struct recorder_device *desc = payload;
+	const char *strings[5] = { NULL };
+	const char *p = (const char *)(desc + 1);
+	const char *end = (const char *)payload + record->size;
+	struct replay_device *rdev;
+	OuvrtDevice *dev = NULL;
+	unsigned int i;
+
+	if (record->size < sizeof(*desc) || desc->num_devnodes != 3)
+		return;
+
+	/* Type name, three device nodes, serial number */
+	for (i = 0; i < G_N_ELEMENTS(strings); i++) {
+		const char *nul = memchr(p, '\0', end - p);
+
+		if (!nul)
+			return;
+		strings[i] = p;
+		p = nul + 1;
+	}
+
+	rdev = replay_device_get(record->dev_id);
+	if (rdev->dev)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS(replay_types); i++) {
+		if (strcmp(strings[0], replay_types[i].name) != 0)
+			continue;
+
+		/* The CV1 has a second hidraw device for the radio */
+		if (strcmp(strings[0], "OuvrtRift") == 0 && strings[2][0])
+			dev = rift_cv1_new(strings[1]);
+		else
+			dev = replay_types[i].new(strings[1]);
+		break;
+	}
+	if (!dev)
+		return;
+
+	for (i = 0; i < 3; i++) {
+		if (!dev->devnodes[i] && strings[1 + i][0])
+			dev->devnodes[i] = g_strdup(strings[1 + i]);
+	}
+	if (dev->name == NULL)
+		dev->name = strdup(strings[0]);
+	if (dev->serial == NULL && strings[4][0])
+		dev->serial = strdup(strings[4]);
+	dev->id = record->dev_id;
+	rdev->dev = dev;
+	device_list = g_list_append(device_list, dev);
+
+	if (OUVRT_IS_RIFT(dev)) {
+		rdev->tracker = ouvrt_rift_get_tracker(OUVRT_RIFT(dev));
+		if (!replay_tracker) {
+			replay_tracker = rdev->tracker;
+			g_hash_table_foreach(replay_devices, replay_link_sensor,
+					     NULL);
+		}
+	} else if (OUVRT_IS_RIFT_SENSOR(dev)) {
+		ouvrt_rift_sensor_set_observer(OUVRT_RIFT_SENSOR(dev),
+					       replay_sensor_observer, stats);
+		if (replay_tracker)
+			ouvrt_rift_sensor_set_tracker(OUVRT_RIFT_SENSOR(dev),
+						      replay_tracker);
+	} else if (OUVRT_IS_VIVE_HEADSET(dev)) {
+		/*
+		 * The range modes are read with a feature report, which is not
+		 * recorded. Assume the smallest ranges and no calibration.
+		 */
+		rdev->has_vive_imu = true;
+		rdev->imu.gyro_range = M_PI / 180.0 * 250;
+		rdev->imu.accel_range = STANDARD_GRAVITY * 2;
+		rdev->imu.acc_scale = (vec3){ 1.0f, 1.0f, 1.0f };
+		rdev->imu.gyro_scale = (vec3){ 1.0f, 1.0f, 1.0f };
+		rdev->imu.state.pose.rotation.w = 1.0;
+	}
+}
+
+static void replay_hidraw_report(struct replay_stats *stats,
+				 const struct recorder_record *record,
+				 const void *payload)
+{
+	struct replay_device *rdev = replay_device_get(record->dev_id);
+	struct imu_state states[REPLAY_MAX_IMU_STATES];
+	struct timespec ts = {
+		.tv_sec = record->time / 1000000000,
+		.tv_nsec = record->time % 1000000000,
+	};
+	unsigned int num, i;
+	int ret;
+
+	if (!rdev->dev) {
+		stats->skipped++;
+		return;
+	}
+
+	stats->reports++;
+
+	if (rdev->has_vive_imu) {
+		const struct vive_imu_report *report = payload;
+
+		if (record->flags == 0 && record->size == sizeof(*report) &&
+		    report->id == VIVE_IMU_REPORT_ID) {
+			vive_imu_decode_message(rdev->dev, &rdev->imu, payload,
+						record->size);
+			digest_update_pose(stats, &rdev->imu.state.pose);
+		} else {
+			stats->skipped++;
+		}
+		return;
+	}
+
+	ret = ouvrt_device_replay_report(rdev->dev, record->flags, payload,
+					 record->size, &ts);
+	if (ret == -ENOTSUP) {
+		stats->skipped++;
+		return;
+	}
+
+	if (!rdev->tracker)
+		return;
+
+	num = ouvrt_tracker_get_imu_states(rdev->tracker, &rdev->imu_reader,
+					   UINT64_MAX, states,
+					   REPLAY_MAX_IMU_STATES);
+	for (i = 0; i < num; i++)
+		digest_update_pose(stats, &states[i].pose);
+	stats->imu_states += num;
+}
+
+static void replay_usb_transfer(struct replay_stats *stats,
+				const struct recorder_record *record,
+				const void *payload)
+{
+	struct replay_device *rdev = replay_device_get(record->dev_id);
+	int ret = -ENOTSUP;
+
+	if (rdev->dev && OUVRT_IS_USB_DEVICE(rdev->dev)) {
+		ret = ouvrt_usb_device_replay_transfer(
+				OUVRT_USB_DEVICE(rdev->dev), payload,
+				record->size, record->time);
+	}
+
+	if (ret < 0)
+		stats->skipped++;
+	else
+		stats->transfers++;
+}
+
+static void replay_v4l2_frame(struct replay_stats *stats,
+			      const struct recorder_record *record,
+			      const void *payload)
+{
+	struct replay_device *rdev = replay_device_get(record->dev_id);
+	const struct recorder_v4l2_frame *info = payload;
+	const uint8_t *data = (const uint8_t *)(info + 1);
+	size_t size = record->size - sizeof(*info);
+	struct blobservation *ob = NULL;
+	int ret;
+
+	if (record->size < sizeof(*info) || !info->width || !info->height) {
+		stats->skipped++;
+		return;
+	}
+
+	if (!rdev->bw || rdev->width != (int)info->width ||
+	    rdev->height != (int)info->height) {
+		blobwatch_free(rdev->bw);
+		g_free(rdev->frame);
+		rdev->width = info->width;
+		rdev->height = info->height;
+		rdev->bw = blobwatch_new(rdev->width, rdev->height);
+		rdev->frame = g_malloc(rdev->width * rdev->height);
+	}
+
+	if (record->type == RECORD_V4L2_SPARSE_FRAME) {
+		ret = sparse_frame_decode(data, size, rdev->frame, rdev->width,
+					  rdev->height);
+		if (ret < 0) {
+			stats->skipped++;
+			return;
+		}
+	} else {
+		if (size < (size_t)(rdev->width * rdev->height)) {
+			stats->skipped++;
+			return;
+		}
+		memcpy(rdev->frame, data, rdev->width * rdev->height);
+	}
+
+	blobwatch_process(rdev->bw, rdev->frame, 0, 0, rdev->width,
+			  rdev->height, 0, NULL, &ob);
+
+	stats->frames++;
+	if (ob)
+		digest_update_blobs(stats, ob);
+}
+
+/*
+ * Replays the whole recording once, with freshly created virtual devices.
+ * Returns 0 on success, or a negative error code if the recording is
+ * corrupt.
+ */
+static int replay_run(struct replay_log *log, struct replay_stats *stats)
+{
+	const struct recorder_record *record;
+	const void *payload;
+	int ret;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->digest = FNV_OFFSET_BASIS;
+
+	replay_devices = g_hash_table_new_full(NULL, NULL, NULL,
+					       replay_device_free);
+	replay_tracker = NULL;
+	replay_log_rewind(log);
+
+	while ((ret = replay_log_next(log, &record, &payload)) > 0) {
+		if (!stats->first_time)
+			stats->first_time = record->time;
+		stats->last_time = MAX(stats->last_time, record->time);
+		stats->records++;
+		stats->bytes += sizeof(*record) + record->size;
+
+		switch (record->type) {
+		case RECORD_DEVICE:
+			replay_add_device(stats, record, payload);
+			break;
+		case RECORD_HIDRAW_REPORT:
+			replay_hidraw_report(stats, record, payload);
+			break;
+		case RECORD_USB_TRANSFER:
+			replay_usb_transfer(stats, record, payload);
+			break;
+		case RECORD_V4L2_FRAME:
+		case RECORD_V4L2_SPARSE_FRAME:
+			replay_v4l2_frame(stats, record, payload);
+			break;
+		default:
+			stats->skipped++;
+			break;
+		}
+	}
+
+	g_hash_table_destroy(replay_devices);
+	replay_devices = NULL;
+
+	return ret;
+}
+
+static void ouvrt_replay_usage(void)
+{
+	g_print("ouvrt-replay [OPTIONS...] DIR\n\n"
+		"Replays a session recorded with ouvrtd --record=DIR as\n"
+		"fast as possible and reports the throughput and a digest\n"
+		"of the results.\n\n"
+		"  -h --help          Show this help\n"
+		"  -l --loops=N       Replay the session N times and check\n"
+		"                     that all runs yield the same digest\n"
+		"  -T --trace=FILE    Write trace events of all runs to FILE\n"
+		"                     in Chrome trace format\n");
+}
+
+static const struct option ouvrt_replay_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "loops", required_argument, NULL, 'l' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ NULL }
+};
+
+int main(int argc, char *argv[])
+{
+	struct replay_stats stats;
+	struct replay_log *log;
+	struct timespec start, end;
+	uint64_t digest = 0;
+	char *trace = NULL;
+	int loops = 1;
+	int longind;
+	int ret;
+	int i;
+
+	setlocale(LC_CTYPE, "");
+
+	do {
+		ret = getopt_long(argc, argv, "hl:T:", ouvrt_replay_options,
+				  &longind);
+		switch (ret) {
+		case -1:
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			if (loops < 1) {
+				ouvrt_replay_usage();
+				return -1;
+			}
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'h':
+		default:
+			ouvrt_replay_usage();
+			exit(0);
+		}
+	} while (ret != -1);
+
+	if (optind != argc - 1) {
+		ouvrt_replay_usage();
+		return -1;
+	}
+
+	log = replay_log_open(argv[optind]);
+	if (!log)
+		return -1;
+
+	g_print("Replay: %zu bytes in %s\n", replay_log_size(log),
+		argv[optind]);
+
+	if (trace)
+		trace_init();
+
+	for (i = 0; i < loops; i++) {
+		double elapsed, duration;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = replay_run(log, &stats);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (ret < 0)
+			break;
+
+		elapsed = (end.tv_sec - start.tv_sec) +
+			  1e-9 * (end.tv_nsec - start.tv_nsec);
+		duration = 1e-9 * (stats.last_time - stats.first_time);
+
+		g_print("Run %d: %" G_GUINT64_FORMAT " records (%"
+			G_GUINT64_FORMAT " reports, %" G_GUINT64_FORMAT
+			" transfers, %" G_GUINT64_FORMAT " frames, %"
+			G_GUINT64_FORMAT " skipped) in %.3f s\n", i,
+			stats.records, stats.reports, stats.transfers,
+			stats.frames, stats.skipped, elapsed);
+		g_print("Run %d: %.0f records/s, %.1f MiB/s, %.1f frames/s, "
+			"%.1fx real time\n", i, stats.records / elapsed,
+			stats.bytes / elapsed / (1 << 20),
+			stats.frames / elapsed, duration / elapsed);
+		g_print("Run %d: %" G_GUINT64_FORMAT " blobs, %"
+			G_GUINT64_FORMAT " IMU states, digest %016"
+			G_GINT64_MODIFIER "x\n", i, stats.blobs,
+			stats.imu_states, stats.digest);
+
+		if (i > 0 && stats.digest != digest) {
+			g_print("Replay: Digest mismatch in run %d\n", i);
+			ret = -1;
+			break;
+		}
+		digest = stats.digest;
+	}
+
+	replay_log_close(log);
+
+	if (trace) {
+		if (trace_dump(trace) < 0)
+			g_print("Replay: Failed to write trace to %s\n", trace);
+		trace_deinit();
+	}
+
+	return ret < 0 ? -1 : 0;
+}
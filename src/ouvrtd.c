@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 #include <libudev.h>
 #include <locale.h>
@@ -28,8 +29,13 @@
 #include "hololens-imu.h"
 #include "motion-controller.h"
 #include "lenovo-explorer.h"
+#include "log.h"
 #include "pipewire.h"
+#include "reactor.h"
+#include "recorder.h"
 #include "telemetry.h"
+#include "thread-policy.h"
+#include "trace.h"
 #include "vive-headset.h"
 #include "vive-headset-mainboard.h"
 #include "vive-controller.h"
@@ -37,6 +43,9 @@
 
 #define NUM_MATCHES	14
 
+/* Maximum number of devices that are opened and started concurrently */
+#define NUM_START_THREADS	4
+
 struct interface_match {
 	int iface;
 	const char *subsystem;
@@ -162,6 +171,7 @@ static const struct device_match device_matches[NUM_MATCHES] = {
 GMainLoop *loop = NULL;
 GList *device_list = NULL;
 static int num_devices;
+static GThreadPool *start_pool;
 
 /*
  * Compares the device's parent against a given parent.
@@ -173,11 +183,14 @@ static gint ouvrt_device_cmp_parent_devpath(OuvrtDevice *dev,
 }
 
 /*
- * Compares the device's serial against a given serial.
+ * Compares the serial of another started device against the device's serial.
  */
-static gint ouvrt_device_cmp_serial(OuvrtDevice *dev, const char *serial)
+static gint ouvrt_device_cmp_serial(OuvrtDevice *other, OuvrtDevice *dev)
 {
-	return g_strcmp0(dev->serial, serial);
+	if (other == dev || !other->active)
+		return -1;
+
+	return g_strcmp0(other->serial, dev->serial);
 }
 
 /*
@@ -189,7 +202,7 @@ static void ouvrt_link_rift_dk2(OuvrtDevice *dev)
 	OuvrtRift *rift;
 	OuvrtCameraDK2 *camera;
 
-	link = g_list_find_custom(device_list, dev->serial,
+	link = g_list_find_custom(device_list, dev,
 				  (GCompareFunc)ouvrt_device_cmp_serial);
 	if (!link)
 		return;
@@ -219,7 +232,7 @@ static void ouvrt_link_rift_sensor_to_rift(gpointer data, gpointer user_data)
 	OuvrtRift *rift = OUVRT_RIFT(user_data);
 	OuvrtRiftSensor *camera;
 
-	if (!OUVRT_IS_RIFT_SENSOR(data))
+	if (!OUVRT_IS_RIFT_SENSOR(data) || !OUVRT_DEVICE(data)->active)
 		return;
 
 	camera = OUVRT_RIFT_SENSOR(data);
@@ -251,7 +264,8 @@ static void ouvrt_link_rift_cv1(OuvrtDevice *dev)
 		GList *link;
 
 		for (link = device_list; link != NULL; link = link->next) {
-			if (OUVRT_IS_RIFT(link->data)) {
+			if (OUVRT_IS_RIFT(link->data) &&
+			    OUVRT_DEVICE(link->data)->active) {
 				ouvrt_link_rift_sensor_to_rift(dev, link->data);
 				return;
 			}
@@ -259,6 +273,42 @@ static void ouvrt_link_rift_cv1(OuvrtDevice *dev)
 	}
 }
 
+/*
+ * Finishes device bring-up on the main loop after a start pool worker has
+ * started the device. Linking is deferred until here so that both devices
+ * of a pair are fully started, for example the Rift radio address must be
+ * known before the Rift Sensors can be synchronised to it.
+ */
+static gboolean ouvrtd_device_started(gpointer data)
+{
+	OuvrtDevice *d = OUVRT_DEVICE(data);
+
+	/* Skip devices that were removed while they were being started */
+	if (g_list_find(device_list, d) && d->active) {
+		if (d->serial)
+			ouvrt_link_rift_dk2(d);
+		ouvrt_link_rift_cv1(d);
+
+		ouvrt_dbus_export_device(d);
+	}
+
+	g_object_unref(d);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Opens and starts a device on the start pool, as this may block for a long
+ * time on feature reports, flash reads, or sensor initialization.
+ */
+static void ouvrtd_device_start_func(gpointer data,
+				     G_GNUC_UNUSED gpointer user_data)
+{
+	ouvrt_device_start(OUVRT_DEVICE(data));
+
+	g_idle_add(ouvrtd_device_started, data);
+}
+
 /*
  * Check if an added device matches the table of known hardware, if yes create
  * a new device structure and start the device.
@@ -441,14 +491,9 @@ static void ouvrtd_device_add(struct udev_device *dev)
 		if (serial)
 			d->serial = strdup(serial);
 	}
-	if (d->serial) {
+	if (d->serial)
 		g_print("%s: Serial %s\n", device_matches[i].name, d->serial);
 
-		ouvrt_link_rift_dk2(d);
-	}
-
-	ouvrt_link_rift_cv1(d);
-
 	device_list = g_list_append(device_list, d);
 
 	for (j = 0; j < device_matches[i].num_interfaces; j++) {
@@ -457,8 +502,7 @@ static void ouvrtd_device_add(struct udev_device *dev)
 	}
 
 start:
-	ouvrt_device_start(d);
-	ouvrt_dbus_export_device(d);
+	g_thread_pool_push(start_pool, g_object_ref(d), NULL);
 }
 
 /*
@@ -640,15 +684,67 @@ static void ouvrtd_signal_handler(int sig)
 	g_main_loop_quit(loop);
 }
 
+/*
+ * Writes the trace events recorded so far on SIGUSR1.
+ */
+static gboolean ouvrtd_trace_dump(gpointer user_data)
+{
+	const char *filename = user_data;
+	int ret;
+
+	ret = trace_dump(filename);
+	if (ret < 0)
+		g_print("Failed to write trace to %s: %d\n", filename, ret);
+	else
+		g_print("Trace written to %s\n", filename);
+
+	return G_SOURCE_CONTINUE;
+}
+
 static void ouvrtd_usage(void)
 {
 	g_print("ouvrtd [OPTIONS...] ...\n\n"
 		"Positional tracking daemon for Oculus VR Rift DK2.\n\n"
-		"  -h --help          Show this help\n");
+		"  -h --help          Show this help\n"
+		"  -c --config=FILE   Load thread policies from FILE instead of\n"
+		"                     $XDG_CONFIG_HOME/ouvrt/threads.conf\n"
+		"  -r --reactor       Handle HID devices in a single I/O thread\n"
+		"  -t --thread=CLASS:KEY=VALUE[,KEY=VALUE...]\n"
+		"                     Set thread policy for a device type or the\n"
+		"                     usb or reactor thread. Keys are name, cpus,\n"
+		"                     policy (fifo, rr, other), priority, nice\n"
+		"  -u --usb-cpu=CPUS  Pin the USB event thread to CPUS\n"
+		"  -p --usb-priority=PRIO\n"
+		"                     Run the USB event thread with SCHED_FIFO\n"
+		"                     priority PRIO\n"
+		"  -e --exposure-control\n"
+		"                     Adjust Rift Sensor exposure time and gain\n"
+		"                     to the tracked LED brightness\n"
+		"  -R --record=DIR    Record all device input into DIR\n"
+		"  -T --trace=FILE    Record trace events, write them to FILE\n"
+		"                     in Chrome trace format on SIGUSR1 and exit\n"
+		"  -w --window        Only read out a window around the tracked\n"
+		"                     LEDs from Rift Sensors\n"
+		"  --telemetry=udp:HOST:PORT|unix:PATH\n"
+		"                     Send telemetry to a UDP address, multicast\n"
+		"                     group, or SOCK_SEQPACKET socket\n"
+		"  --telemetry-rate=TYPE=HZ|off[,TYPE=HZ|off...]\n"
+		"                     Limit or disable telemetry packet types:\n"
+		"                     raw-buffer, raw-imu, imu, pose, lighthouse,\n"
+		"                     buttons (off only), axis (off only)\n");
 }
 
 static const struct option ouvrtd_options[] = {
 	{ "help", no_argument, NULL, 'h' },
+	{ "config", required_argument, NULL, 'c' },
+	{ "thread", required_argument, NULL, 't' },
+	{ "reactor", no_argument, NULL, 'r' },
+	{ "usb-cpu", required_argument, NULL, 'u' },
+	{ "usb-priority", required_argument, NULL, 'p' },
+	{ "exposure-control", no_argument, NULL, 'e' },
+	{ "record", required_argument, NULL, 'R' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "window", no_argument, NULL, 'w' },
 	{ NULL }
 };
 
@@ -659,6 +755,12 @@ static const struct option ouvrtd_options[] = {
 int main(int argc, char *argv[])
 {
 	struct udev *udev;
+	gboolean reactor = FALSE;
+	char *config = NULL;
+	char *record = NULL;
+	char *trace = NULL;
+	GSList *thread_specs = NULL;
+	GSList *l;
 	guint owner_id;
 	int longind;
 	int ret;
@@ -667,13 +769,50 @@ int main(int argc, char *argv[])
 
 	debug_stream_init(&argc, &argv);
 	pipewire_init(&argc, &argv);
-	telemetry_init(&argc, &argv);
+	ret = telemetry_init(&argc, &argv);
+	if (ret < 0)
+		return -1;
 
 	do {
-		ret = getopt_long(argc, argv, "h", ouvrtd_options, &longind);
+		ret = getopt_long(argc, argv, "hc:rt:u:p:eR:T:w", ouvrtd_options,
+				  &longind);
 		switch (ret) {
 		case -1:
 			break;
+		case 'r':
+			reactor = TRUE;
+			break;
+		case 'c':
+			g_free(config);
+			config = g_strdup(optarg);
+			break;
+		case 't':
+			thread_specs = g_slist_append(thread_specs,
+						      g_strdup(optarg));
+			break;
+		case 'u':
+			thread_specs = g_slist_append(thread_specs,
+					g_strdup_printf("usb:cpus=%s", optarg));
+			break;
+		case 'p':
+			thread_specs = g_slist_append(thread_specs,
+					g_strdup_printf("usb:policy=fifo,"
+							"priority=%s", optarg));
+			break;
+		case 'e':
+			rift_sensor_set_exposure_control(true);
+			break;
+		case 'R':
+			g_free(record);
+			record = g_strdup(optarg);
+			break;
+		case 'T':
+			g_free(trace);
+			trace = g_strdup(optarg);
+			break;
+		case 'w':
+			rift_sensor_set_windowing(true);
+			break;
 		case 'h':
 		default:
 			ouvrtd_usage();
@@ -681,24 +820,72 @@ int main(int argc, char *argv[])
 		}
 	} while (ret != -1);
 
+	if (config) {
+		ret = ouvrt_thread_policy_load(config, false);
+		g_free(config);
+	} else {
+		config = g_build_filename(g_get_user_config_dir(), "ouvrt",
+					  "threads.conf", NULL);
+		ret = ouvrt_thread_policy_load(config, true);
+		g_free(config);
+	}
+	for (l = thread_specs; l && ret == 0; l = l->next)
+		ret = ouvrt_thread_policy_parse(l->data);
+	g_slist_free_full(thread_specs, g_free);
+	if (ret < 0)
+		return -1;
+	ouvrt_thread_policy_report();
+
+	if (record) {
+		ret = recorder_init(record);
+		g_free(record);
+		if (ret < 0)
+			return -1;
+	}
+
+	if (trace) {
+		trace_init();
+		g_unix_signal_add(SIGUSR1, ouvrtd_trace_dump, trace);
+	}
+
 	signal(SIGINT, ouvrtd_signal_handler);
 
+	log_init();
+
 	udev = udev_new();
 	if (!udev)
 		return -1;
 
+	if (reactor)
+		ouvrt_reactor_init();
+
 	loop = g_main_loop_new(NULL, TRUE);
 	owner_id = ouvrt_dbus_own_name();
 
+	start_pool = g_thread_pool_new(ouvrtd_device_start_func, NULL,
+				       NUM_START_THREADS, FALSE, NULL);
+
 	ouvrtd_startup(udev);
 	g_main_loop_run(loop);
 
+	g_thread_pool_free(start_pool, FALSE, TRUE);
+	g_list_foreach(device_list, device_stop, NULL); /* user_data */
+	ouvrt_reactor_deinit();
+	log_deinit();
+	recorder_deinit();
+	if (trace) {
+		ouvrtd_trace_dump(trace);
+		trace_deinit();
+		g_free(trace);
+	}
+
 	g_bus_unown_name(owner_id);
 	udev_unref(udev);
 	g_main_loop_unref(loop);
 	telemetry_deinit();
 	pipewire_deinit();
 	debug_stream_deinit();
+	ouvrt_thread_policy_deinit();
 
 	return 0;
 }
@@ -18,12 +18,27 @@
 #include <pipewire/pipewire.h>
 
 #include "debug.h"
+#include "debug-queue.h"
+
+/*
+ * Buffer metadata carrying a struct ouvrt_debug_attachment with the blob
+ * observation, pose estimate, IMU samples, and timestamps for each frame.
+ * Consumers that can not access custom metadata, such as the GStreamer
+ * pipewiresrc element, find a copy appended to the frame data, the same
+ * way the GStreamer debug stream delivers it.
+ */
+#define OUVRT_TYPE_META_ATTACHMENT	SPA_TYPE_META_BASE "Ouvrt:Attachment"
+
+#define DEBUG_STREAM_MAX_BUFFERS	32
+/* Frames waiting to be queued before new frames are dropped */
+#define DEBUG_STREAM_MAX_PENDING	2
 
 struct type {
 	struct spa_type_media_type media_type;
 	struct spa_type_media_subtype media_subtype;
 	struct spa_type_format_video format_video;
 	struct spa_type_video_format video_format;
+	uint32_t meta_attachment;
 };
 
 static inline void init_type(struct type *type, struct spa_type_map *map)
@@ -32,6 +47,8 @@ static inline void init_type(struct type *type, struct spa_type_map *map)
 	spa_type_media_subtype_map(map, &type->media_subtype);
 	spa_type_format_video_map(map, &type->format_video);
 	spa_type_video_format_map(map, &type->video_format);
+	type->meta_attachment = spa_type_map_get_id(map,
+						OUVRT_TYPE_META_ATTACHMENT);
 }
 
 struct data;
@@ -39,6 +56,7 @@ struct data;
 struct debug_stream {
 	struct data *data;
 	struct pw_stream *stream;
+	struct debug_queue *queue;
 	struct spa_hook listener;
 	struct spa_video_info_raw format;
 	enum pw_stream_state state;
@@ -83,7 +101,7 @@ on_stream_format_changed(void *_data, const struct spa_pod *format)
 	uint8_t params_buffer[1024];
 	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(params_buffer,
 							sizeof(params_buffer));
-	const struct spa_pod *params[2];
+	const struct spa_pod *params[3];
 
 	if (format == NULL) {
 		pw_stream_finish_format(stream->stream, 0, NULL, 0);
@@ -107,10 +125,11 @@ on_stream_format_changed(void *_data, const struct spa_pod *format)
 	params[0] = spa_pod_builder_object(&b,
 		t->param.idBuffers, t->param_buffers.Buffers,
 		":", t->param_buffers.size,	"i", stream->stride *
-						     stream->format.size.height,
+						     stream->format.size.height +
+				sizeof(struct ouvrt_debug_attachment),
 		":", t->param_buffers.stride,	"i", stream->stride,
 		":", t->param_buffers.buffers,	"iru", 2,
-						SPA_POD_PROP_MIN_MAX(1, 32),
+				SPA_POD_PROP_MIN_MAX(1, DEBUG_STREAM_MAX_BUFFERS),
 		":", t->param_buffers.align,	"i", 16);
 
 	params[1] = spa_pod_builder_object(&b,
@@ -118,7 +137,13 @@ on_stream_format_changed(void *_data, const struct spa_pod *format)
 		":", t->param_meta.type, "I", t->meta.Header,
 		":", t->param_meta.size, "i", sizeof(struct spa_meta_header));
 
-	pw_stream_finish_format(stream->stream, 0, params, 2);
+	params[2] = spa_pod_builder_object(&b,
+		t->param.idMeta, t->param_meta.Meta,
+		":", t->param_meta.type, "I", data->type.meta_attachment,
+		":", t->param_meta.size, "i",
+				sizeof(struct ouvrt_debug_attachment));
+
+	pw_stream_finish_format(stream->stream, 0, params, 3);
 }
 
 static const struct pw_stream_events stream_events = {
@@ -141,6 +166,21 @@ static inline uint32_t format_to_pipewire(struct data *data, uint32_t format)
 	}
 }
 
+/*
+ * Queues buffers handed over from the tracking threads to the PipeWire
+ * stream. This takes the thread loop lock, which may be held by the
+ * PipeWire thread for a while.
+ */
+static void debug_stream_queue_func(void *item, void *user_data)
+{
+	struct debug_stream *stream = user_data;
+	struct pw_buffer *buf = *(struct pw_buffer **)item;
+
+	pw_thread_loop_lock(stream->data->main_loop);
+	pw_stream_queue_buffer(stream->stream, buf);
+	pw_thread_loop_unlock(stream->data->main_loop);
+}
+
 struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 {
 	struct data *data = global_data;
@@ -166,6 +206,10 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 
 	stream = calloc(sizeof(*stream), 1);
 	stream->data = data;
+	/* There are never more dequeued buffers than the stream has */
+	stream->queue = debug_queue_new("ouvrt-debug", DEBUG_STREAM_MAX_BUFFERS,
+					sizeof(struct pw_buffer *),
+					debug_stream_queue_func, stream);
 	stream->stream = pw_stream_new(data->remote, "ouvrt-camera",
 				pw_properties_new(
 					"media.class", "Video/Source",
@@ -199,9 +243,19 @@ struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc)
 
 struct debug_stream *debug_stream_unref(struct debug_stream *stream)
 {
+	uint64_t dropped;
+
 	if (!stream)
 		return NULL;
 
+	/* Pass on all pending buffers before disconnecting */
+	dropped = debug_queue_dropped(stream->queue);
+	debug_queue_free(stream->queue);
+	if (dropped) {
+		g_print("PipeWire: dropped %" G_GUINT64_FORMAT
+			" debug frames\n", dropped);
+	}
+
 	pw_thread_loop_lock(stream->data->main_loop);
 	pw_stream_disconnect(stream->stream);
 	pw_stream_destroy(stream->stream);
@@ -217,50 +271,173 @@ bool debug_stream_connected(struct debug_stream *stream)
 	return stream && stream->state == PW_STREAM_STATE_STREAMING;
 }
 
+/*
+ * Fills in the header and attachment metadata and hands the buffer over to
+ * the queue thread. The queue has room for all buffers of the stream, so
+ * it never overflows.
+ */
+static void debug_stream_queue(struct debug_stream *stream,
+			       struct pw_buffer *buf, uint32_t size,
+			       struct blobservation *ob, dquat *rot,
+			       dvec3 *trans, const struct imu_state *imu_samples,
+			       unsigned int num_imu_samples,
+			       double timestamps[4])
+{
+	struct ouvrt_debug_attachment *attach;
+	struct spa_buffer *b = buf->buffer;
+	struct spa_meta_header *h;
+
+	if ((h = spa_buffer_find_meta(b, stream->data->t->meta.Header))) {
+		h->pts = -1;
+		h->flags = 0;
+		h->seq = stream->seq++;
+		h->dts_offset = 0;
+	}
+
+	attach = spa_buffer_find_meta(b, stream->data->type.meta_attachment);
+	if (attach) {
+		if (ob)
+			debug_attachment_fill(attach, ob, rot, trans,
+					      imu_samples, num_imu_samples,
+					      timestamps);
+		else
+			memset(attach, 0, sizeof(*attach));
+
+		/* Append a copy after the frame for pipewiresrc consumers */
+		if (size && b->datas[0].maxsize >= size + sizeof(*attach)) {
+			memcpy((uint8_t *)b->datas[0].data + size, attach,
+			       sizeof(*attach));
+			size += sizeof(*attach);
+		}
+	}
+
+	b->datas[0].chunk->offset = 0;
+	b->datas[0].chunk->size = size;
+
+	if (!debug_queue_push(stream->queue, &buf))
+		debug_stream_queue_func(&buf, stream);
+}
+
+/*
+ * Copies the frame into a PipeWire buffer and queues it. The attachment is
+ * added by debug_stream_queue, so attach_offset is not used.
+ */
 void debug_stream_frame_push(struct debug_stream *stream, void *src,
 			     size_t size, size_t attach_offset,
 			     struct blobservation *ob, dquat *rot, dvec3 *trans,
-			     double timestamps[3])
+			     const struct imu_state *imu_samples,
+			     unsigned int num_imu_samples, double timestamps[3])
 {
-	struct spa_meta_header *h;
 	struct pw_buffer *buf;
 	struct spa_buffer *b;
+	uint32_t frame_size;
 
 	(void)size;
 	(void)attach_offset;
-	(void)ob;
-	(void)rot;
-	(void)trans;
-	(void)timestamps;
 
 	if (!stream || !debug_stream_connected(stream))
 		return;
 
+	/* Drop frames instead of delaying them if the consumer is slow */
+	if (debug_queue_pending(stream->queue) >= DEBUG_STREAM_MAX_PENDING) {
+		debug_queue_drop(stream->queue);
+		return;
+	}
+
 	buf = pw_stream_dequeue_buffer(stream->stream);
-	if (buf == NULL)
+	if (buf == NULL) {
+		debug_queue_drop(stream->queue);
 		return;
+	}
 
 	b = buf->buffer;
+	frame_size = stream->stride * stream->format.size.height;
 
-	if (!b->datas[0].data)
-		goto done;
+	if (!b->datas[0].data || b->datas[0].maxsize < frame_size) {
+		debug_stream_queue(stream, buf, 0, NULL, NULL, NULL, NULL, 0,
+				   NULL);
+		return;
+	}
 
-	if ((h = spa_buffer_find_meta(b, stream->data->t->meta.Header))) {
-		h->pts = -1;
-		h->flags = 0;
-		h->seq = stream->seq++;
-		h->dts_offset = 0;
+	memcpy(b->datas[0].data, src, frame_size);
+
+	debug_stream_queue(stream, buf, frame_size, ob, rot, trans,
+			   imu_samples, num_imu_samples, timestamps);
+}
+
+/*
+ * Dequeues a PipeWire buffer of at least size bytes, to be filled directly
+ * by the capture code. PipeWire buffers are backed by shared memory that is
+ * mapped by the consumers, so frames captured into them reach observers
+ * without any copy. Returns false if no buffer is available, in which case
+ * the caller falls back to debug_stream_frame_push, which counts the drop.
+ */
+bool debug_stream_buffer_get(struct debug_stream *stream,
+			     struct debug_buffer *buffer, size_t size)
+{
+	struct pw_buffer *buf;
+	struct spa_data *d;
+
+	if (!stream || !debug_stream_connected(stream) ||
+	    debug_queue_pending(stream->queue) >= DEBUG_STREAM_MAX_PENDING)
+		return false;
+
+	buf = pw_stream_dequeue_buffer(stream->stream);
+	if (buf == NULL)
+		return false;
+
+	d = &buf->buffer->datas[0];
+	if (!d->data || d->maxsize < size) {
+		debug_stream_queue(stream, buf, 0, NULL, NULL, NULL, NULL, 0,
+				   NULL);
+		return false;
 	}
 
-	memcpy(b->datas[0].data, src,
-	       stream->stride * stream->format.size.height);
+	buffer->data = d->data;
+	buffer->size = d->maxsize;
+	buffer->priv = buf;
 
-	b->datas[0].chunk->size = b->datas[0].maxsize;
+	return true;
+}
 
-done:
-	pw_thread_loop_lock(stream->data->main_loop);
-	pw_stream_queue_buffer(stream->stream, buf);
-	pw_thread_loop_unlock(stream->data->main_loop);
+/*
+ * Queues a buffer obtained with debug_stream_buffer_get after the frame was
+ * captured into it.
+ */
+void debug_stream_buffer_push(struct debug_stream *stream,
+			      struct debug_buffer *buffer,
+			      struct blobservation *ob, dquat *rot,
+			      dvec3 *trans, const struct imu_state *imu_samples,
+			      unsigned int num_imu_samples,
+			      double timestamps[4])
+{
+	debug_stream_queue(stream, buffer->priv,
+			   stream->stride * stream->format.size.height,
+			   ob, rot, trans, imu_samples, num_imu_samples,
+			   timestamps);
+	buffer->data = NULL;
+	buffer->priv = NULL;
+}
+
+/*
+ * Returns an unused buffer obtained with debug_stream_buffer_get. The buffer
+ * is not queued, as that would send an empty frame to the consumers. It is
+ * reclaimed when the stream is destroyed, so this must only be called right
+ * before the stream is released.
+ */
+void debug_stream_buffer_put(G_GNUC_UNUSED struct debug_stream *stream,
+			     struct debug_buffer *buffer)
+{
+	buffer->data = NULL;
+	buffer->priv = NULL;
+}
+
+/*
+ * Returns the number of frames dropped because the consumer was too slow.
+ */
+uint64_t debug_stream_dropped_frames(struct debug_stream *stream)
+{
+	return stream ? debug_queue_dropped(stream->queue) : 0;
 }
 
 static void on_state_changed(void *_data, enum pw_remote_state old,
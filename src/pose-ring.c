@@ -0,0 +1,147 @@
+/*
+ * Shared memory pose ring buffer
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * Poses are written into a memfd backed ring buffer that can be mapped
+ * read-only by clients. There is a single writer per ring. Each entry is
+ * protected by a sequence counter, so readers can poll the latest pose
+ * without any system calls and detect torn reads.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pose-ring.h"
+
+struct pose_ring {
+	int fd;
+	size_t size;
+	struct pose_ring_header *header;
+	struct pose_ring_entry *entries;
+};
+
+/*
+ * Creates a new memfd backed pose ring buffer.
+ */
+struct pose_ring *pose_ring_new(void)
+{
+	struct pose_ring *ring;
+	void *map;
+	int fd;
+
+	fd = memfd_create("ouvrt-pose-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		g_print("Failed to create pose ring: %d\n", errno);
+		return NULL;
+	}
+
+	ring = g_new0(struct pose_ring, 1);
+	ring->fd = fd;
+	ring->size = sizeof(struct pose_ring_header) +
+		     POSE_RING_NUM_ENTRIES * sizeof(struct pose_ring_entry);
+
+	if (ftruncate(fd, ring->size) < 0)
+		goto err_free;
+
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err_free;
+
+	ring->header = map;
+	ring->entries = (struct pose_ring_entry *)(ring->header + 1);
+
+	ring->header->magic = POSE_RING_MAGIC;
+	ring->header->version = POSE_RING_VERSION;
+	ring->header->header_size = sizeof(struct pose_ring_header);
+	ring->header->entry_size = sizeof(struct pose_ring_entry);
+	ring->header->num_entries = POSE_RING_NUM_ENTRIES;
+
+	return ring;
+
+err_free:
+	g_print("Failed to map pose ring: %d\n", errno);
+	close(fd);
+	g_free(ring);
+	return NULL;
+}
+
+void pose_ring_free(struct pose_ring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->header, ring->size);
+	close(ring->fd);
+	g_free(ring);
+}
+
+/*
+ * Returns a new read-only file descriptor for the ring buffer, to be passed
+ * to a client. Returns a negative error code on failure.
+ */
+int pose_ring_get_fd(struct pose_ring *ring)
+{
+	char path[32];
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", ring->fd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+/*
+ * Writes a new pose into the ring buffer. If time is zero, the current
+ * CLOCK_MONOTONIC time is used. Must only be called from a single thread.
+ */
+void pose_ring_push(struct pose_ring *ring, uint64_t time,
+		    const struct dpose *pose, const vec3 *angular_velocity,
+		    const vec3 *linear_velocity)
+{
+	struct pose_ring_header *header = ring->header;
+	struct pose_ring_entry *entry;
+	uint64_t head = header->head;
+	uint32_t seq;
+
+	if (!time) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	entry = &ring->entries[head % POSE_RING_NUM_ENTRIES];
+	seq = entry->sequence;
+
+	/* Mark the entry as being written before touching its contents */
+	__atomic_store_n(&entry->sequence, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->time = time;
+	entry->rotation[0] = pose->rotation.x;
+	entry->rotation[1] = pose->rotation.y;
+	entry->rotation[2] = pose->rotation.z;
+	entry->rotation[3] = pose->rotation.w;
+	entry->translation[0] = pose->translation.x;
+	entry->translation[1] = pose->translation.y;
+	entry->translation[2] = pose->translation.z;
+	entry->angular_velocity[0] = angular_velocity ? angular_velocity->x : 0;
+	entry->angular_velocity[1] = angular_velocity ? angular_velocity->y : 0;
+	entry->angular_velocity[2] = angular_velocity ? angular_velocity->z : 0;
+	entry->linear_velocity[0] = linear_velocity ? linear_velocity->x : 0;
+	entry->linear_velocity[1] = linear_velocity ? linear_velocity->y : 0;
+	entry->linear_velocity[2] = linear_velocity ? linear_velocity->z : 0;
+
+	__atomic_store_n(&entry->sequence, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,58 @@
+/*
+ * Shared memory pose ring buffer
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __POSE_RING_H__
+#define __POSE_RING_H__
+
+#include <stdint.h>
+
+#include "imu.h"
+#include "maths.h"
+
+#define POSE_RING_MAGIC		0x474e5250 /* "PRNG" */
+#define POSE_RING_VERSION	1
+#define POSE_RING_NUM_ENTRIES	256
+
+/*
+ * Shared memory layout, version 1. All fields are in host byte order. The
+ * region starts with a header, followed by num_entries entries of
+ * entry_size bytes each, starting at offset header_size.
+ */
+struct pose_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t num_entries;
+	uint32_t reserved;
+	/* Number of poses written so far, latest entry at (head - 1) % N */
+	uint64_t head;
+};
+
+/*
+ * A single timestamped pose, protected by a sequence counter. The sequence
+ * counter is odd while the entry is being written. The timestamp is taken
+ * from CLOCK_MONOTONIC, in nanoseconds. Rotation is stored as x, y, z, w.
+ */
+struct pose_ring_entry {
+	uint32_t sequence;
+	uint32_t reserved;
+	uint64_t time;
+	double rotation[4];
+	double translation[3];
+	float angular_velocity[3];
+	float linear_velocity[3];
+};
+
+struct pose_ring;
+
+struct pose_ring *pose_ring_new(void);
+void pose_ring_free(struct pose_ring *ring);
+int pose_ring_get_fd(struct pose_ring *ring);
+void pose_ring_push(struct pose_ring *ring, uint64_t time,
+		    const struct dpose *pose, const vec3 *angular_velocity,
+		    const vec3 *linear_velocity);
+
+#endif /* __POSE_RING_H__ */
@@ -269,6 +269,8 @@ static void psvr_decode_sensor_message(OuvrtPSVR *self,
 		pose_update(1e-6 * dt, &self->imu.pose, &imu);
 
 		telemetry_send_pose(self->dev.id, &self->imu.pose);
+		ouvrt_device_publish_pose(&self->dev, 0, &self->imu.pose,
+					  &imu.angular_velocity, NULL);
 
 		self->last_timestamp = raw.time;
 	}
@@ -413,6 +415,9 @@ static void psvr_control_transfer_callback(struct libusb_transfer *transfer)
 	OuvrtPSVR *psvr = transfer->user_data;
 	int ret;
 
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 			g_print("PSVR: Device vanished\n");
@@ -436,7 +441,8 @@ static void psvr_control_transfer_callback(struct libusb_transfer *transfer)
 				  transfer->actual_length);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+					       transfer);
 	if (ret < 0) {
 		g_print("PSVR: Failed to resubmit control transfer: %d\n", ret);
 	}
@@ -447,6 +453,9 @@ static void psvr_sensor_transfer_callback(struct libusb_transfer *transfer)
 	OuvrtPSVR *psvr = transfer->user_data;
 	int ret;
 
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
+
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
 			g_print("PSVR: Device vanished\n");
@@ -463,7 +472,8 @@ static void psvr_sensor_transfer_callback(struct libusb_transfer *transfer)
 				   transfer->actual_length);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+					       transfer);
 	if (ret < 0) {
 		g_print("PSVR: Failed to resubmit sensor transfer: %d\n", ret);
 	}
@@ -600,7 +610,11 @@ static int psvr_start(OuvrtDevice *dev)
 		return -ENOMEM;
 
 	for (i = 0; i < psvr->num_transfers; i++) {
-		psvr->transfer[i] = libusb_alloc_transfer(0);
+		psvr->transfer[i] = ouvrt_usb_device_alloc_transfer(
+						OUVRT_USB_DEVICE(psvr), 0);
+		if (!psvr->transfer[i])
+			return -ENOMEM;
+
 		void *buf = calloc(1, 64);
 		bEndpointAddress = (i ? psvr->control_endpoint :
 					psvr->sensor_endpoint) |
@@ -611,7 +625,8 @@ static int psvr_start(OuvrtDevice *dev)
 					       psvr_sensor_transfer_callback),
 					  psvr, 0);
 
-		ret = libusb_submit_transfer(psvr->transfer[i]);
+		ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(psvr),
+						       psvr->transfer[i]);
 		if (ret < 0) {
 			g_print("PSVR: Failed to submit bulk transfer %d\n", i);
 			return ret;
@@ -658,6 +673,7 @@ static void ouvrt_psvr_init(OuvrtPSVR *self)
 	ouvrt_usb_device_set_vid_pid(OUVRT_USB_DEVICE(self), VID_SONY, PID_PSVR);
 
 	self->dev.type = DEVICE_TYPE_HMD;
+	self->dev.has_pose = TRUE;
 	self->power = false;
 	self->vrmode = false;
 	self->state = PSVR_STATE_POWER_OFF;
@@ -0,0 +1,312 @@
+/*
+ * Shared epoll I/O thread for hidraw devices
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#include <errno.h>
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reactor.h"
+#include "device.h"
+#include "thread-policy.h"
+
+/* Maximum number of reports read from a single fd per wakeup */
+#define REACTOR_BATCH_SIZE	16
+#define REACTOR_MAX_EVENTS	16
+/* Interval between calls to the device tick operation in ms */
+#define REACTOR_TICK_INTERVAL	1000
+
+struct reactor_source {
+	OuvrtDevice *dev;
+	int index;
+};
+
+/*
+ * Instead of running one thread with its own poll loop per device, the
+ * reactor waits for input on the file descriptors of all registered devices
+ * in a single epoll thread and calls the device dispatch operation to read
+ * and decode the pending reports. Devices that have periodic work, such as
+ * sending keepalive reports, are called once per tick interval.
+ */
+struct reactor {
+	int epfd;
+	int eventfd;
+	GThread *thread;
+	GMutex lock;
+	GList *devices;
+	GList *sources;
+	gboolean active;
+};
+
+static struct reactor *reactor;
+
+static inline uint64_t timespec_to_ms(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000ULL + ts->tv_nsec / 1000000;
+}
+
+/*
+ * Stops watching the file descriptors of a device. Must be called with the
+ * reactor lock held.
+ */
+static void reactor_remove_device_locked(OuvrtDevice *dev)
+{
+	GList *link, *next;
+
+	for (link = reactor->sources; link; link = next) {
+		struct reactor_source *source = link->data;
+
+		next = link->next;
+		if (source->dev != dev)
+			continue;
+
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL,
+			  dev->fds[source->index], NULL);
+		reactor->sources = g_list_delete_link(reactor->sources, link);
+		g_free(source);
+	}
+
+	reactor->devices = g_list_remove(reactor->devices, dev);
+}
+
+/*
+ * Stops a device whose file descriptors failed from the main loop, so that
+ * the device stop and close operations are called and the device can be
+ * started again later.
+ */
+static gboolean reactor_stop_device(gpointer data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(data);
+
+	ouvrt_device_stop(dev);
+	g_object_unref(dev);
+
+	return FALSE;
+}
+
+/*
+ * Reads up to REACTOR_BATCH_SIZE pending reports from a single file
+ * descriptor. On error, stops watching the device and schedules it to be
+ * stopped.
+ */
+static void reactor_dispatch(struct reactor_source *source, uint32_t events,
+			     const struct timespec *ts)
+{
+	OuvrtDevice *dev = source->dev;
+	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
+	int ret;
+	int i;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		g_print("%s: Poll error: 0x%x\n", dev->name, events);
+		reactor_remove_device_locked(dev);
+		g_idle_add(reactor_stop_device, g_object_ref(dev));
+		return;
+	}
+
+	if (!(events & EPOLLIN))
+		return;
+
+	for (i = 0; i < REACTOR_BATCH_SIZE; i++) {
+		ret = klass->dispatch(dev, source->index, ts);
+		if (ret == -EAGAIN)
+			break;
+	}
+}
+
+static void reactor_tick(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(data);
+	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
+
+	if (klass->tick)
+		klass->tick(dev);
+}
+
+static gpointer reactor_thread(G_GNUC_UNUSED gpointer data)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	uint64_t next_tick = 0;
+	struct timespec ts;
+	int num;
+	int i;
+
+	while (reactor->active) {
+		num = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS,
+				 REACTOR_TICK_INTERVAL);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (num == -1) {
+			if (errno != EINTR)
+				g_print("Reactor: Poll failure: %d\n", errno);
+			continue;
+		}
+
+		g_mutex_lock(&reactor->lock);
+
+		for (i = 0; i < num; i++) {
+			struct reactor_source *source = events[i].data.ptr;
+
+			/* The wakeup eventfd has no source */
+			if (!source)
+				continue;
+
+			/* Skip sources that were removed in the meantime */
+			if (!g_list_find(reactor->sources, source))
+				continue;
+
+			reactor_dispatch(source, events[i].events, &ts);
+		}
+
+		if (timespec_to_ms(&ts) >= next_tick) {
+			g_list_foreach(reactor->devices, reactor_tick, NULL);
+			next_tick = timespec_to_ms(&ts) + REACTOR_TICK_INTERVAL;
+		}
+
+		g_mutex_unlock(&reactor->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Registers the file descriptors of a device with the reactor. The device
+ * class must implement the dispatch operation.
+ */
+int ouvrt_reactor_add_device(OuvrtDevice *dev)
+{
+	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
+	struct epoll_event event = {
+		.events = EPOLLIN,
+	};
+	struct reactor_source *source;
+	int ret = 0;
+	int i;
+
+	if (!reactor || !klass->dispatch)
+		return -ENOTSUP;
+
+	g_mutex_lock(&reactor->lock);
+
+	for (i = 0; i < 3; i++) {
+		if (dev->fds[i] == -1)
+			continue;
+
+		source = g_new0(struct reactor_source, 1);
+		source->dev = dev;
+		source->index = i;
+
+		event.data.ptr = source;
+		ret = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, dev->fds[i],
+				&event);
+		if (ret == -1) {
+			ret = -errno;
+			g_print("%s: Failed to add fd to reactor: %d\n",
+				dev->name, errno);
+			g_free(source);
+			break;
+		}
+
+		reactor->sources = g_list_append(reactor->sources, source);
+	}
+
+	if (ret < 0) {
+		reactor_remove_device_locked(dev);
+	} else {
+		reactor->devices = g_list_append(reactor->devices, dev);
+		if (klass->tick)
+			klass->tick(dev);
+	}
+
+	g_mutex_unlock(&reactor->lock);
+
+	return ret;
+}
+
+/*
+ * Unregisters the file descriptors of a device. After this returns, the
+ * reactor thread does not call into the device anymore.
+ */
+void ouvrt_reactor_remove_device(OuvrtDevice *dev)
+{
+	if (!reactor)
+		return;
+
+	g_mutex_lock(&reactor->lock);
+	reactor_remove_device_locked(dev);
+	g_mutex_unlock(&reactor->lock);
+}
+
+bool ouvrt_reactor_enabled(void)
+{
+	return reactor != NULL;
+}
+
+/*
+ * Creates the epoll instance and starts the reactor thread.
+ */
+int ouvrt_reactor_init(void)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	int ret;
+
+	reactor = g_new0(struct reactor, 1);
+	g_mutex_init(&reactor->lock);
+
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epfd == -1) {
+		ret = -errno;
+		g_print("Reactor: Failed to create epoll instance: %d\n",
+			errno);
+		g_free(reactor);
+		reactor = NULL;
+		return ret;
+	}
+
+	reactor->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (reactor->eventfd != -1)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->eventfd,
+			  &event);
+
+	reactor->active = TRUE;
+	reactor->thread = ouvrt_thread_new("reactor", "ouvrt-reactor",
+					   reactor_thread, NULL);
+
+	g_print("Reactor: Handling hidraw devices in a single I/O thread\n");
+
+	return 0;
+}
+
+/*
+ * Stops the reactor thread. All devices must have been removed before.
+ */
+void ouvrt_reactor_deinit(void)
+{
+	uint64_t val = 1;
+
+	if (!reactor)
+		return;
+
+	reactor->active = FALSE;
+	if (reactor->eventfd != -1 &&
+	    write(reactor->eventfd, &val, sizeof(val)) < 0)
+		g_print("Reactor: Failed to wake up thread: %d\n", errno);
+	g_thread_join(reactor->thread);
+
+	g_list_free_full(reactor->sources, g_free);
+	g_list_free(reactor->devices);
+	if (reactor->eventfd != -1)
+		close(reactor->eventfd);
+	close(reactor->epfd);
+	g_mutex_clear(&reactor->lock);
+	g_free(reactor);
+	reactor = NULL;
+}
@@ -0,0 +1,20 @@
+/*
+ * Shared epoll I/O thread for hidraw devices
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stdbool.h>
+
+#include "device.h"
+
+int ouvrt_reactor_init(void);
+void ouvrt_reactor_deinit(void);
+bool ouvrt_reactor_enabled(void);
+
+int ouvrt_reactor_add_device(OuvrtDevice *dev);
+void ouvrt_reactor_remove_device(OuvrtDevice *dev);
+
+#endif /* __REACTOR_H__ */
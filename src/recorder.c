@@ -0,0 +1,467 @@
+/*
+ * Session recorder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Records hidraw reports, USB transfers, and V4L2 frames, with host
+ * timestamps, into a directory of append-only segment files. Device threads
+ * copy records into large, page aligned blocks. A writer thread writes full
+ * blocks into the current segment, using O_DIRECT if the file system
+ * supports it, and appends an entry for each block to the index file. If
+ * the writer can not keep up and no free block is left, records are dropped
+ * and counted instead of delaying the device threads.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "thread-policy.h"
+
+#define RECORDER_NUM_BLOCKS		8
+#define RECORDER_BLOCKS_PER_SEGMENT	(RECORDER_SEGMENT_SIZE / \
+					 RECORDER_BLOCK_SIZE)
+/* Alignment of buffers, offsets, and sizes for O_DIRECT */
+#define RECORDER_DIRECT_ALIGN		4096
+
+#define RECORD_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+struct recorder_block {
+	uint8_t *data;
+	size_t used;
+	/* Number of threads still copying records into this block */
+	int writers;
+	uint32_t segment;
+	uint64_t time;
+	/* The final block, written when the recorder is stopped */
+	bool last;
+};
+
+struct recorder {
+	GMutex lock;
+	GCond cond;
+	GThread *thread;
+	bool stopping;
+
+	struct recorder_block blocks[RECORDER_NUM_BLOCKS];
+	GQueue free_blocks;
+	GQueue full_blocks;
+	struct recorder_block *current;
+	uint64_t num_blocks;
+
+	uint64_t records;
+	uint64_t dropped;
+
+	/* Only used by the writer thread */
+	char *dirname;
+	int fd;
+	int index_fd;
+	uint32_t segment;
+	uint64_t offset;
+	bool write_error;
+};
+
+bool recorder_enabled;
+
+static struct recorder recorder = {
+	.free_blocks = G_QUEUE_INIT,
+	.full_blocks = G_QUEUE_INIT,
+	.fd = -1,
+	.index_fd = -1,
+};
+
+static uint64_t recorder_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Opens a new segment file. Falls back to buffered I/O if the file system
+ * does not support O_DIRECT.
+ */
+static int recorder_open_segment(uint32_t segment)
+{
+	char *filename;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	int ret = 0;
+	int fd;
+
+	if (recorder.fd >= 0)
+		close(recorder.fd);
+
+	filename = g_strdup_printf("%s/segment-%06u.orec", recorder.dirname,
+				   segment);
+	fd = open(filename, flags | O_DIRECT, 0644);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(filename, flags, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		g_print("Recorder: Failed to open %s: %d\n", filename, ret);
+	}
+	g_free(filename);
+
+	recorder.fd = fd;
+	recorder.segment = segment;
+	recorder.offset = 0;
+
+	return ret;
+}
+
+static int recorder_write_all(int fd, const uint8_t *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes a block to its segment and adds it to the index. Blocks are always
+ * written in full, so that every block starts at a multiple of the block
+ * size, as the reader expects after padding. Only the final block written
+ * when the recorder is stopped is cut off at the next O_DIRECT alignment
+ * boundary after its last record.
+ */
+static void recorder_write_block(struct recorder_block *block)
+{
+	struct recorder_index_entry entry;
+	size_t len = RECORDER_BLOCK_SIZE;
+	int ret;
+
+	if (block->last && block->used < len) {
+		len = (block->used + RECORDER_DIRECT_ALIGN - 1) &
+		      ~(size_t)(RECORDER_DIRECT_ALIGN - 1);
+	}
+
+	if (recorder.fd < 0 || block->segment != recorder.segment) {
+		ret = recorder_open_segment(block->segment);
+		if (ret < 0)
+			return;
+	}
+
+	ret = recorder_write_all(recorder.fd, block->data, len);
+	if (ret < 0) {
+		if (!recorder.write_error)
+			g_print("Recorder: Write error: %d\n", ret);
+		recorder.write_error = true;
+		return;
+	}
+
+	entry.time = block->time;
+	entry.segment = block->segment;
+	entry.reserved = 0;
+	entry.offset = recorder.offset;
+	ret = recorder_write_all(recorder.index_fd, (uint8_t *)&entry,
+				 sizeof(entry));
+	if (ret < 0) {
+		if (!recorder.write_error)
+			g_print("Recorder: Index write error: %d\n", ret);
+		recorder.write_error = true;
+	}
+
+	/* The block itself was written, keep the segment offset in sync */
+	recorder.offset += len;
+}
+
+/*
+ * Writes full blocks as soon as all records are copied into them. Blocks
+ * still queued when the recorder is stopped are written before exiting.
+ */
+static gpointer recorder_thread(G_GNUC_UNUSED gpointer data)
+{
+	struct recorder_block *block;
+
+	g_mutex_lock(&recorder.lock);
+	for (;;) {
+		while (g_queue_is_empty(&recorder.full_blocks) &&
+		       !recorder.stopping)
+			g_cond_wait(&recorder.cond, &recorder.lock);
+
+		block = g_queue_pop_head(&recorder.full_blocks);
+		if (!block)
+			break;
+
+		while (block->writers)
+			g_cond_wait(&recorder.cond, &recorder.lock);
+		g_mutex_unlock(&recorder.lock);
+
+		recorder_write_block(block);
+
+		g_mutex_lock(&recorder.lock);
+		g_queue_push_tail(&recorder.free_blocks, block);
+	}
+	g_mutex_unlock(&recorder.lock);
+
+	return NULL;
+}
+
+/*
+ * Copies a record into previously reserved space in a block, and pads it to
+ * the next 8 byte boundary.
+ */
+static void recorder_copy(uint8_t *dest, const struct recorder_record *record,
+			  const struct iovec *iov, int iovcnt)
+{
+	uint8_t *start = dest;
+	int i;
+
+	memcpy(dest, record, sizeof(*record));
+	dest += sizeof(*record);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+		dest += iov[i].iov_len;
+	}
+	memset(dest, 0, RECORD_ALIGN(dest - start) - (dest - start));
+}
+
+/*
+ * Hands the current block over to the writer thread. The rest of the block
+ * is marked as padding. Must be called with the lock held.
+ */
+static void recorder_finish_block(void)
+{
+	struct recorder_block *block = recorder.current;
+	size_t remaining = RECORDER_BLOCK_SIZE - block->used;
+
+	memset(block->data + block->used, 0,
+	       MIN(remaining, sizeof(struct recorder_record)));
+
+	g_queue_push_tail(&recorder.full_blocks, block);
+	recorder.current = NULL;
+	g_cond_broadcast(&recorder.cond);
+}
+
+/*
+ * Starts a new block, beginning with a segment record if it is the first
+ * block of a segment. Must be called with the lock held. Returns NULL if no
+ * free block is available.
+ */
+static struct recorder_block *recorder_start_block(uint64_t time)
+{
+	struct recorder_block *block;
+
+	block = g_queue_pop_head(&recorder.free_blocks);
+	if (!block)
+		return NULL;
+
+	block->used = 0;
+	block->writers = 0;
+	block->last = false;
+	block->segment = recorder.num_blocks / RECORDER_BLOCKS_PER_SEGMENT;
+	block->time = time;
+
+	if (recorder.num_blocks % RECORDER_BLOCKS_PER_SEGMENT == 0) {
+		struct recorder_segment segment = {
+			.magic = RECORDER_MAGIC,
+			.version = RECORDER_VERSION,
+			.segment = block->segment,
+			.block_size = RECORDER_BLOCK_SIZE,
+		};
+		struct recorder_record record = {
+			.size = sizeof(segment),
+			.type = RECORD_SEGMENT,
+			.time = time,
+		};
+		struct iovec iov = { &segment, sizeof(segment) };
+
+		recorder_copy(block->data, &record, &iov, 1);
+		block->used = RECORD_ALIGN(sizeof(record) + sizeof(segment));
+	}
+
+	recorder.num_blocks++;
+	recorder.current = block;
+
+	return block;
+}
+
+/*
+ * Records the data given by the iovec array as a single record. If time is
+ * zero, the current CLOCK_MONOTONIC time is used. Space in the current block
+ * is reserved under the lock, the data is copied outside of it.
+ */
+void recorder_writev(uint16_t type, uint16_t flags, uint32_t dev_id,
+		     uint64_t time, const struct iovec *iov, int iovcnt)
+{
+	struct recorder_record record;
+	struct recorder_block *block;
+	size_t size = 0;
+	size_t needed;
+	uint8_t *dest;
+	int i;
+
+	if (!recorder_enabled)
+		return;
+
+	if (!time)
+		time = recorder_now();
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	needed = RECORD_ALIGN(sizeof(record) + size);
+
+	record.size = size;
+	record.type = type;
+	record.flags = flags;
+	record.dev_id = dev_id;
+	record.reserved = 0;
+	record.time = time;
+
+	g_mutex_lock(&recorder.lock);
+	if (needed > RECORDER_BLOCK_SIZE - RECORD_ALIGN(sizeof(record) +
+				sizeof(struct recorder_segment))) {
+		/* Would not even fit into an empty block */
+		recorder.dropped++;
+		g_mutex_unlock(&recorder.lock);
+		return;
+	}
+	block = recorder.current;
+	if (block && block->used + needed > RECORDER_BLOCK_SIZE) {
+		recorder_finish_block();
+		block = NULL;
+	}
+	if (!block)
+		block = recorder_start_block(time);
+	if (!block || block->used + needed > RECORDER_BLOCK_SIZE) {
+		recorder.dropped++;
+		g_mutex_unlock(&recorder.lock);
+		return;
+	}
+	dest = block->data + block->used;
+	block->used += needed;
+	block->writers++;
+	recorder.records++;
+	g_mutex_unlock(&recorder.lock);
+
+	recorder_copy(dest, &record, iov, iovcnt);
+
+	g_mutex_lock(&recorder.lock);
+	if (--block->writers == 0)
+		g_cond_broadcast(&recorder.cond);
+	g_mutex_unlock(&recorder.lock);
+}
+
+void recorder_write(uint16_t type, uint16_t flags, uint32_t dev_id,
+		    uint64_t time, const void *data, size_t size)
+{
+	struct iovec iov = { (void *)data, size };
+
+	recorder_writev(type, flags, dev_id, time, &iov, 1);
+}
+
+/*
+ * Creates the recording directory and index file, and starts the writer
+ * thread. The writer thread runs with the "recorder" thread policy.
+ */
+int recorder_init(const char *dirname)
+{
+	char *filename;
+	int i;
+
+	int ret;
+
+	if (g_mkdir_with_parents(dirname, 0755) < 0) {
+		ret = -errno;
+		g_print("Recorder: Failed to create %s: %d\n", dirname, ret);
+		return ret;
+	}
+
+	filename = g_build_filename(dirname, "index", NULL);
+	recorder.index_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC |
+				 O_APPEND | O_CLOEXEC, 0644);
+	if (recorder.index_fd < 0) {
+		ret = -errno;
+		g_print("Recorder: Failed to open %s: %d\n", filename, ret);
+		g_free(filename);
+		return ret;
+	}
+	g_free(filename);
+
+	for (i = 0; i < RECORDER_NUM_BLOCKS; i++) {
+		struct recorder_block *block = &recorder.blocks[i];
+
+		if (posix_memalign((void **)&block->data, RECORDER_DIRECT_ALIGN,
+				   RECORDER_BLOCK_SIZE)) {
+			g_print("Recorder: Failed to allocate buffers\n");
+			recorder_deinit();
+			return -ENOMEM;
+		}
+		g_queue_push_tail(&recorder.free_blocks, block);
+	}
+
+	g_mutex_init(&recorder.lock);
+	g_cond_init(&recorder.cond);
+	recorder.dirname = g_strdup(dirname);
+	recorder.thread = ouvrt_thread_new("recorder", "ouvrt-recorder",
+					   recorder_thread, NULL);
+	recorder_enabled = true;
+
+	g_print("Recorder: Recording to %s\n", dirname);
+
+	return 0;
+}
+
+/*
+ * Writes the last partial block, stops the writer thread, and reports the
+ * number of recorded and dropped records. Must only be called after all
+ * devices are stopped.
+ */
+void recorder_deinit(void)
+{
+	int i;
+
+	if (recorder.thread) {
+		recorder_enabled = false;
+
+		g_mutex_lock(&recorder.lock);
+		if (recorder.current) {
+			recorder.current->last = true;
+			recorder_finish_block();
+		}
+		recorder.stopping = true;
+		g_cond_broadcast(&recorder.cond);
+		g_mutex_unlock(&recorder.lock);
+
+		g_thread_join(recorder.thread);
+		recorder.thread = NULL;
+
+		g_print("Recorder: %" G_GUINT64_FORMAT " records, %"
+			G_GUINT64_FORMAT " dropped\n", recorder.records,
+			recorder.dropped);
+
+		g_mutex_clear(&recorder.lock);
+		g_cond_clear(&recorder.cond);
+	}
+
+	if (recorder.fd >= 0)
+		close(recorder.fd);
+	if (recorder.index_fd >= 0)
+		close(recorder.index_fd);
+	recorder.fd = -1;
+	recorder.index_fd = -1;
+
+	for (i = 0; i < RECORDER_NUM_BLOCKS; i++)
+		g_clear_pointer(&recorder.blocks[i].data, free);
+	g_queue_clear(&recorder.free_blocks);
+	g_queue_clear(&recorder.full_blocks);
+	g_clear_pointer(&recorder.dirname, g_free);
+}
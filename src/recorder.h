@@ -0,0 +1,115 @@
+/*
+ * Session recorder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define RECORDER_MAGIC		0x4345524f /* "OREC" */
+#define RECORDER_VERSION	1
+
+/* Segments are written in blocks, each block starts with a new record */
+#define RECORDER_BLOCK_SIZE	(4 << 20)
+#define RECORDER_SEGMENT_SIZE	(256 << 20)
+
+enum recorder_record_type {
+	/* Fills the rest of a block */
+	RECORD_PADDING = 0,
+	/* struct recorder_segment, first record in each segment */
+	RECORD_SEGMENT = 1,
+	/* struct recorder_device followed by NUL terminated strings */
+	RECORD_DEVICE = 2,
+	/* hidraw report, flags contain the hidraw device index */
+	RECORD_HIDRAW_REPORT = 3,
+	/* struct recorder_usb_transfer followed by packet lengths and data */
+	RECORD_USB_TRANSFER = 4,
+	/* struct recorder_v4l2_frame followed by the raw frame */
+	RECORD_V4L2_FRAME = 5,
+	/* struct recorder_v4l2_frame followed by a sparse encoded frame */
+	RECORD_V4L2_SPARSE_FRAME = 6,
+};
+
+/*
+ * Record header. All fields are in host byte order. The payload of size
+ * bytes follows the header, and the next record starts at the next 8 byte
+ * aligned offset. A padding record, or less than a header worth of space
+ * left, means the next record starts at the next block boundary. The time
+ * is taken from CLOCK_MONOTONIC, in nanoseconds.
+ */
+struct recorder_record {
+	uint32_t size;
+	uint16_t type;
+	uint16_t flags;
+	uint32_t dev_id;
+	uint32_t reserved;
+	uint64_t time;
+};
+
+struct recorder_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t segment;
+	uint32_t block_size;
+};
+
+/*
+ * Device description, followed by the type name, device nodes, and serial
+ * number as NUL terminated strings. Unused device nodes are empty.
+ */
+struct recorder_device {
+	uint32_t type;
+	uint32_t num_devnodes;
+};
+
+/*
+ * Completed USB transfer. For isochronous transfers, num_iso_packets packet
+ * lengths as uint32_t follow, then the data of all packets back to back.
+ * Otherwise, actual_length bytes of data follow.
+ */
+struct recorder_usb_transfer {
+	uint8_t endpoint;
+	uint8_t type;
+	uint16_t num_iso_packets;
+	int32_t status;
+	uint32_t actual_length;
+	uint32_t reserved;
+};
+
+/*
+ * Dequeued V4L2 frame. The timestamp is the V4L2 buffer timestamp.
+ */
+struct recorder_v4l2_frame {
+	uint32_t width;
+	uint32_t height;
+	uint32_t pixelformat;
+	uint32_t sequence;
+	uint64_t timestamp;
+};
+
+/*
+ * One entry per block in the index file, in the order they were written.
+ */
+struct recorder_index_entry {
+	uint64_t time;
+	uint32_t segment;
+	uint32_t reserved;
+	uint64_t offset;
+};
+
+extern bool recorder_enabled;
+
+int recorder_init(const char *dirname);
+void recorder_deinit(void);
+
+void recorder_writev(uint16_t type, uint16_t flags, uint32_t dev_id,
+		     uint64_t time, const struct iovec *iov, int iovcnt);
+void recorder_write(uint16_t type, uint16_t flags, uint32_t dev_id,
+		    uint64_t time, const void *data, size_t size);
+
+#endif /* __RECORDER_H__ */
@@ -0,0 +1,222 @@
+/*
+ * Session recording reader
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Memory maps the segment files written by the session recorder and
+ * iterates over the contained records in the order they were written.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+#define RECORD_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+struct replay_segment {
+	const uint8_t *data;
+	size_t size;
+	uint32_t block_size;
+};
+
+struct replay_log {
+	struct replay_segment *segments;
+	unsigned int num_segments;
+	size_t total_size;
+
+	unsigned int segment;
+	size_t offset;
+};
+
+/*
+ * Maps a single segment file and checks its segment record. Returns 0 on
+ * success, -ENOENT if the file does not exist, or another negative error
+ * code.
+ */
+static int replay_map_segment(const char *dirname, uint32_t index,
+			      struct replay_segment *segment)
+{
+	const struct recorder_segment *header;
+	const struct recorder_record *record;
+	char *filename;
+	struct stat st;
+	void *data;
+	int ret;
+	int fd;
+
+	filename = g_strdup_printf("%s/segment-%06u.orec", dirname, index);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		if (ret != -ENOENT)
+			g_print("Replay: Failed to open %s: %d\n", filename,
+				ret);
+		g_free(filename);
+		return ret;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0 || st.st_size < (off_t)(sizeof(*record) +
+					    sizeof(*header))) {
+		g_print("Replay: Invalid segment %s\n", filename);
+		g_free(filename);
+		close(fd);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		ret = -errno;
+		g_print("Replay: Failed to map %s: %d\n", filename, ret);
+		g_free(filename);
+		return ret;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+	record = data;
+	header = (const struct recorder_segment *)(record + 1);
+	if (record->type != RECORD_SEGMENT ||
+	    record->size < sizeof(*header) ||
+	    header->magic != RECORDER_MAGIC ||
+	    header->version != RECORDER_VERSION ||
+	    header->segment != index ||
+	    header->block_size < sizeof(*record) ||
+	    header->block_size % 8) {
+		g_print("Replay: Invalid segment header in %s\n", filename);
+		g_free(filename);
+		munmap(data, st.st_size);
+		return -EINVAL;
+	}
+	g_free(filename);
+
+	segment->data = data;
+	segment->size = st.st_size;
+	segment->block_size = header->block_size;
+
+	return 0;
+}
+
+/*
+ * Maps all consecutive segment files in the given directory, starting with
+ * the first segment. Returns NULL on error.
+ */
+struct replay_log *replay_log_open(const char *dirname)
+{
+	struct replay_log *log;
+	struct replay_segment segment;
+	GArray *segments;
+	unsigned int i;
+	int ret;
+
+	segments = g_array_new(FALSE, FALSE, sizeof(segment));
+	for (;;) {
+		ret = replay_map_segment(dirname, segments->len, &segment);
+		if (ret < 0)
+			break;
+		g_array_append_val(segments, segment);
+	}
+	if (segments->len == 0) {
+		if (ret == -ENOENT)
+			g_print("Replay: No segments found in %s\n", dirname);
+		g_array_free(segments, TRUE);
+		return NULL;
+	}
+
+	log = g_new0(struct replay_log, 1);
+	log->num_segments = segments->len;
+	log->segments = (struct replay_segment *)g_array_free(segments,
+							      FALSE);
+	for (i = 0; i < log->num_segments; i++)
+		log->total_size += log->segments[i].size;
+
+	return log;
+}
+
+void replay_log_close(struct replay_log *log)
+{
+	unsigned int i;
+
+	if (!log)
+		return;
+
+	for (i = 0; i < log->num_segments; i++) {
+		munmap((void *)log->segments[i].data,
+		       log->segments[i].size);
+	}
+	g_free(log->segments);
+	g_free(log);
+}
+
+/*
+ * Restarts iteration at the first record.
+ */
+void replay_log_rewind(struct replay_log *log)
+{
+	log->segment = 0;
+	log->offset = 0;
+}
+
+/*
+ * Returns the combined size of all mapped segments in bytes.
+ */
+size_t replay_log_size(struct replay_log *log)
+{
+	return log->total_size;
+}
+
+/*
+ * Returns the next record and its payload. Segment and padding records are
+ * skipped. Returns 1 if a record was returned, 0 at the end of the log, or
+ * -EINVAL if a record crosses a block boundary.
+ */
+int replay_log_next(struct replay_log *log,
+		    const struct recorder_record **record,
+		    const void **payload)
+{
+	const struct recorder_record *r;
+
+	while (log->segment < log->num_segments) {
+		struct replay_segment *segment = &log->segments[log->segment];
+		size_t block_size = segment->block_size;
+		size_t block_end = (log->offset / block_size + 1) * block_size;
+
+		if (log->offset >= segment->size) {
+			log->segment++;
+			log->offset = 0;
+			continue;
+		}
+
+		/* Padding, or no space for another record in this block */
+		r = (const void *)(segment->data + log->offset);
+		if (block_end - log->offset < sizeof(*r) ||
+		    log->offset + sizeof(*r) > segment->size ||
+		    r->type == RECORD_PADDING) {
+			log->offset = block_end;
+			continue;
+		}
+
+		if (log->offset + sizeof(*r) + r->size > MIN(block_end,
+							    segment->size)) {
+			g_print("Replay: Invalid record at %u:%zu\n",
+				log->segment, log->offset);
+			return -EINVAL;
+		}
+
+		log->offset += RECORD_ALIGN(sizeof(*r) + r->size);
+
+		if (r->type == RECORD_SEGMENT)
+			continue;
+
+		*record = r;
+		*payload = r + 1;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * Session recording reader
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "recorder.h"
+
+struct replay_log;
+
+struct replay_log *replay_log_open(const char *dirname);
+void replay_log_close(struct replay_log *log);
+
+void replay_log_rewind(struct replay_log *log);
+int replay_log_next(struct replay_log *log,
+		    const struct recorder_record **record,
+		    const void **payload);
+size_t replay_log_size(struct replay_log *log);
+
+#endif /* __REPLAY_H__ */
@@ -12,9 +12,11 @@
 #include "rift-hid-reports.h"
 #include "rift-radio.h"
 #include "buttons.h"
+#include "cache.h"
 #include "hidraw.h"
 #include "imu.h"
 #include "json.h"
+#include "log.h"
 #include "telemetry.h"
 #include "tracking-model.h"
 
@@ -331,8 +333,9 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 	} else if (dt > 3000 - 25 || dt < 3000 + 25) {
 		/* 3 ms */
 	} else {
-		g_print("%s: %d µs since last IMU sample\n", touch->base.name,
-			dt);
+		log_ratelimited(LOG_INFO, 1000,
+				"%s: %d µs since last IMU sample\n",
+				touch->base.name, dt);
 	}
 	touch->last_timestamp = timestamp;
 
@@ -487,11 +490,20 @@ static int rift_touch_parse_calibration(struct rift_touch_controller *touch,
 					struct rift_touch_calibration *c)
 {
 	JsonNode *node = json_from_string(json, NULL);
-	JsonObject *object = json_node_get_object(node);
+	JsonObject *object;
 	JsonArray *array;
 	unsigned int i, j;
 	int version;
 
+	if (!node)
+		return -EINVAL;
+
+	object = json_node_get_object(node);
+	if (!object) {
+		json_node_unref(node);
+		return -EINVAL;
+	}
+
 	object = json_object_get_object_member(object, "TrackedObject");
 	if (!object) {
 		json_node_unref(node);
@@ -575,9 +587,9 @@ static int rift_touch_get_calibration(struct rift_touch_controller *touch,
 	struct rift_wireless_device *dev = &touch->base;
 	uint8_t hash[16];
 	char hash_string[33];
+	uint16_t length;
 	gboolean success;
-	char *path;
-	char *filename;
+	char *name;
 	char *json;
 	int ret;
 	int i;
@@ -596,39 +608,49 @@ static int rift_touch_get_calibration(struct rift_touch_controller *touch,
 
 	g_print("Rift: %s: calibration hash: %s\n", dev->name, hash_string);
 
-	path = g_strdup_printf("%s/ouvrt", g_get_user_cache_dir());
-
-	filename = g_strdup_printf("%s/%.14s_%s.%ctouch", path, dev->serial,
-				   hash_string,
-				   (dev->id == RIFT_TOUCH_CONTROLLER_LEFT) ? 'l' : 'r');
+	name = g_strdup_printf("%.14s_%s.%ctouch", dev->serial, hash_string,
+			       (dev->id == RIFT_TOUCH_CONTROLLER_LEFT) ? 'l' : 'r');
 
-	success = g_file_get_contents(filename, &json, NULL, NULL);
+	/*
+	 * The hash changes whenever the calibration data in the controller
+	 * flash changes, so a cache hit allows to skip the slow readout of
+	 * the whole JSON blob in 20-byte chunks over the radio link.
+	 */
+	success = ouvrt_cache_get_contents(name, &json, NULL);
 	if (success) {
-		g_print("Rift: %s: read cached calibration data\n", dev->name);
-	} else {
-		uint16_t length;
+		ret = rift_touch_parse_calibration(touch, json,
+						   &touch->calibration);
+		g_free(json);
+		if (ret == 0) {
+			g_print("Rift: %s: read cached calibration data\n",
+				dev->name);
+			g_free(name);
+			return 0;
+		}
 
-		g_print("Rift: %s: reading calibration data\n", dev->name);
+		g_print("Rift: %s: invalid cached calibration data\n",
+			dev->name);
+		ouvrt_cache_remove(name);
+	}
 
-		ret = rift_radio_read_calibration(fd, dev->id, &json, &length);
-		if (ret < 0) {
-			g_free(filename);
-			g_free(path);
-			return ret;
-		}
+	g_print("Rift: %s: reading calibration data\n", dev->name);
 
-		g_mkdir_with_parents(path, 0755);
-		g_file_set_contents(filename, json, length, NULL);
+	ret = rift_radio_read_calibration(fd, dev->id, &json, &length);
+	if (ret < 0) {
+		g_free(name);
+		return ret;
+	}
 
+	ret = rift_touch_parse_calibration(touch, json, &touch->calibration);
+	if (ret < 0) {
+		g_print("Rift: %s: failed to parse calibration data\n",
+			dev->name);
+	} else if (ouvrt_cache_set_contents(name, json, length)) {
 		g_print("Rift: %s: wrote calibration data cache\n", dev->name);
 	}
 
-	g_free(filename);
-	g_free(path);
-
-	rift_touch_parse_calibration(touch, json, &touch->calibration);
-
 	g_free(json);
+	g_free(name);
 
 	return 0;
 }
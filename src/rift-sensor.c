@@ -15,12 +15,18 @@
 #include <glib-object.h>
 
 #include "rift-sensor.h"
+#include "blobwatch.h"
 #include "device.h"
 #include "esp770u.h"
+#include "exposure-control.h"
 #include "ar0134.h"
 #include "usb-ids.h"
 #include "uvc.h"
+#include "uvc-clock.h"
 #include "debug.h"
+#include "imu-ring.h"
+#include "log.h"
+#include "trace.h"
 
 #define RIFT_SENSOR_WIDTH	1280
 #define RIFT_SENSOR_HEIGHT	960
@@ -31,6 +37,43 @@
 #define UVC_INTERFACE_CONTROL	0
 #define UVC_INTERFACE_DATA	1
 
+/* High-bandwidth isochronous packets arrive once per microframe */
+#define RIFT_SENSOR_PACKET_INTERVAL	125000
+/* Maximum plausible delay between start of exposure and first payload */
+#define RIFT_SENSOR_MAX_PTS_DELAY	20000000
+
+/* Margin around the predicted LED bounding box, in pixels */
+#define RIFT_SENSOR_WINDOW_MARGIN	64
+/* Minimum number of blobs required to restrict the readout window */
+#define RIFT_SENSOR_WINDOW_MIN_BLOBS	4
+
+/*
+ * Coarse integration time in lines and global gain in 1/32 steps, starting
+ * from the synchronised exposure default, and the minimum time between
+ * updates in ns.
+ */
+#define RIFT_SENSOR_EXPOSURE		26
+#define RIFT_SENSOR_MIN_EXPOSURE	8
+#define RIFT_SENSOR_MAX_EXPOSURE	52
+#define RIFT_SENSOR_UNITY_GAIN		0x20
+#define RIFT_SENSOR_MAX_GAIN		0x80
+#define RIFT_SENSOR_EXPOSURE_INTERVAL	250000000
+
+/*
+ * Sensor readout window, in full sensor coordinates.
+ */
+struct rift_sensor_window {
+	uint16_t x;
+	uint16_t y;
+	uint16_t width;
+	uint16_t height;
+};
+
+static const struct rift_sensor_window rift_sensor_full_window = {
+	.width = RIFT_SENSOR_WIDTH,
+	.height = RIFT_SENSOR_HEIGHT,
+};
+
 struct _OuvrtRiftSensor {
 	OuvrtDevice dev;
 
@@ -44,19 +87,73 @@ struct _OuvrtRiftSensor {
 	bool sync;
 
 	unsigned char *frame;
-	int frame_size;
+	unsigned char *frame_buf;
+	struct debug_buffer debug_buf;
 	int payload_size;
 	int frame_id;
 	uint32_t pts;
+	bool pts_valid;
 	uint64_t time;
 	int64_t dt;
-
+	struct uvc_clock clock;
+	uint32_t sequence;
+
+	/* Window of the last complete frame */
+	struct rift_sensor_window window;
+	/* Last window written to the sensor when the current frame started */
+	struct rift_sensor_window next_window;
+	/* Last window written to the sensor, under control_lock */
+	struct rift_sensor_window written_window;
+	/* Window requested from the frame callback, under control_lock */
+	struct rift_sensor_window requested_window;
+	bool window_pending;
+	/* Exposure settings requested from the frame callback, same lock */
+	uint16_t requested_exposure;
+	uint16_t requested_gain;
+	bool exposure_pending;
+	/* Exposure mode change requested when the tracker changes, same lock */
+	bool requested_sync;
+	bool sync_pending;
+	GMutex control_lock;
+	GCond control_cond;
+
+	/* Exposure controller, only used from the frame callback */
+	struct exposure_control exposure;
+	bool exposure_reset;
+
+	/* Under control_lock, the frame callback takes its own reference */
 	OuvrtTracker *tracker;
+	struct blobwatch *bw;
+	struct imu_ring_reader imu_reader;
 	struct debug_stream *debug;
+
+	/* Only set for replay, before any frames are processed */
+	OuvrtRiftSensorObserver observer;
+	gpointer observer_data;
 };
 
 G_DEFINE_TYPE(OuvrtRiftSensor, ouvrt_rift_sensor, OUVRT_TYPE_USB_DEVICE)
 
+static bool rift_sensor_windowing;
+static bool rift_sensor_exposure_control;
+
+/*
+ * Enables reading out only a window around the tracked LEDs.
+ */
+void rift_sensor_set_windowing(bool enable)
+{
+	rift_sensor_windowing = enable;
+}
+
+/*
+ * Enables exposure time and gain control from blob statistics while
+ * synchronised exposure is enabled.
+ */
+void rift_sensor_set_exposure_control(bool enable)
+{
+	rift_sensor_exposure_control = enable;
+}
+
 static int rift_sensor_get_calibration(OuvrtRiftSensor *self)
 {
 	uint8_t buf[128];
@@ -146,27 +243,297 @@ static int rift_sensor_open(OuvrtDevice *dev)
 	return 0;
 }
 
+static bool rift_sensor_window_contains(const struct rift_sensor_window *w,
+					int x0, int y0, int x1, int y1)
+{
+	return x0 >= w->x && y0 >= w->y && x1 <= w->x + w->width &&
+	       y1 <= w->y + w->height;
+}
+
+static inline int rift_sensor_window_size(const struct rift_sensor_window *w)
+{
+	return w->width * w->height;
+}
+
+/*
+ * Returns true if two different windows have the same size, so that their
+ * frames could not be told apart.
+ */
+static bool rift_sensor_window_ambiguous(const struct rift_sensor_window *a,
+					 const struct rift_sensor_window *b)
+{
+	return memcmp(a, b, sizeof(*a)) &&
+	       rift_sensor_window_size(a) == rift_sensor_window_size(b);
+}
+
+/*
+ * Grows an aligned window that is smaller than the full frame by 8 rows or,
+ * if it already spans all rows, by 16 columns.
+ */
+static void rift_sensor_window_grow(struct rift_sensor_window *w)
+{
+	if (w->height < RIFT_SENSOR_HEIGHT) {
+		if (w->y + w->height + 8 > RIFT_SENSOR_HEIGHT)
+			w->y -= 8;
+		w->height += 8;
+	} else {
+		if (w->x + w->width + 16 > RIFT_SENSOR_WIDTH)
+			w->x -= 16;
+		w->width += 16;
+	}
+}
+
+/*
+ * Predicts the bounding box of the blobs in the next frame from their
+ * positions and velocities, and requests the sensor thread to read out only
+ * a window around it. If there are too few blobs, or if they are spread
+ * over most of the frame, the full frame is requested.
+ *
+ * The window of a received frame is told by its size, so the requested
+ * window is grown until its size differs from the window of the last frame
+ * and from the windows that were written or requested before.
+ */
+static void rift_sensor_update_window(OuvrtRiftSensor *self,
+				      struct blobservation *ob)
+{
+	struct rift_sensor_window window = rift_sensor_full_window;
+	struct rift_sensor_window current;
+	struct rift_sensor_window written;
+	const int margin = RIFT_SENSOR_WINDOW_MARGIN;
+	int x0 = RIFT_SENSOR_WIDTH;
+	int y0 = RIFT_SENSOR_HEIGHT;
+	int x1 = 0;
+	int y1 = 0;
+	int i;
+
+	if (!rift_sensor_windowing)
+		return;
+
+	g_mutex_lock(&self->control_lock);
+	current = self->requested_window;
+	written = self->written_window;
+	g_mutex_unlock(&self->control_lock);
+
+	if (ob && ob->num_blobs >= RIFT_SENSOR_WINDOW_MIN_BLOBS) {
+		for (i = 0; i < ob->num_blobs; i++) {
+			struct blob *b = &ob->blobs[i];
+
+			x0 = MIN(x0, b->x + MIN(b->vx, 0) - b->width / 2);
+			y0 = MIN(y0, b->y + MIN(b->vy, 0) - b->height / 2);
+			x1 = MAX(x1, b->x + MAX(b->vx, 0) + b->width / 2 + 1);
+			y1 = MAX(y1, b->y + MAX(b->vy, 0) + b->height / 2 + 1);
+		}
+
+		/*
+		 * Keep the current window as long as it contains the predicted
+		 * bounding box with half the margin, and is not much larger
+		 * than necessary.
+		 */
+		if (rift_sensor_window_contains(&current, x0 - margin / 2,
+						y0 - margin / 2,
+						x1 + margin / 2,
+						y1 + margin / 2) &&
+		    current.width * current.height <=
+		    2 * (x1 - x0 + 2 * margin) * (y1 - y0 + 2 * margin))
+			return;
+
+		/* Align to 16x8 pixels */
+		x0 = MAX(0, (x0 - margin) & ~15);
+		y0 = MAX(0, (y0 - margin) & ~7);
+		x1 = MIN(RIFT_SENSOR_WIDTH, (x1 + margin + 15) & ~15);
+		y1 = MIN(RIFT_SENSOR_HEIGHT, (y1 + margin + 7) & ~7);
+
+		if (4 * (x1 - x0) * (y1 - y0) < 3 * RIFT_SENSOR_FRAME_SIZE) {
+			window.x = x0;
+			window.y = y0;
+			window.width = x1 - x0;
+			window.height = y1 - y0;
+		}
+
+		while (rift_sensor_window_ambiguous(&window, &self->window) ||
+		       rift_sensor_window_ambiguous(&window, &written) ||
+		       rift_sensor_window_ambiguous(&window, &current))
+			rift_sensor_window_grow(&window);
+	}
+
+	if (!memcmp(&window, &current, sizeof(window)))
+		return;
+
+	g_mutex_lock(&self->control_lock);
+	self->requested_window = window;
+	self->window_pending = true;
+	g_cond_signal(&self->control_cond);
+	g_mutex_unlock(&self->control_lock);
+}
+
+/*
+ * Tells the window of a received frame from its size. The sensor switches
+ * to a new window at some frame boundary after the registers are written,
+ * so the frame either still uses the window of the last frame, or the
+ * window last written before it started. Returns false if the size matches
+ * neither.
+ */
+static bool rift_sensor_latch_window(OuvrtRiftSensor *self, int size)
+{
+	if (size == rift_sensor_window_size(&self->window))
+		return true;
+
+	if (size == rift_sensor_window_size(&self->next_window)) {
+		self->window = self->next_window;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Records that the sensor was reset to read out the full frame.
+ */
+static void rift_sensor_reset_window(OuvrtRiftSensor *self)
+{
+	g_mutex_lock(&self->control_lock);
+	self->requested_window = rift_sensor_full_window;
+	self->window_pending = false;
+	self->written_window = rift_sensor_full_window;
+	g_mutex_unlock(&self->control_lock);
+}
+
+/*
+ * Moves the rows of a windowed frame into place in the full frame buffer
+ * and clears the area outside of the window, for the debug stream.
+ */
+static void rift_sensor_expand_frame(OuvrtRiftSensor *self)
+{
+	const struct rift_sensor_window *w = &self->window;
+	const int stride = RIFT_SENSOR_WIDTH;
+	uint8_t *buf = self->frame_buf;
+	int y;
+
+	if (w->width == RIFT_SENSOR_WIDTH && w->height == RIFT_SENSOR_HEIGHT)
+		return;
+
+	/* Going bottom up, destination rows never overlap later sources */
+	for (y = w->height - 1; y >= 0; y--) {
+		memmove(buf + (w->y + y) * stride + w->x, buf + y * w->width,
+			w->width);
+	}
+
+	memset(buf, 0, w->y * stride);
+	for (y = w->y; y < w->y + w->height; y++) {
+		memset(buf + y * stride, 0, w->x);
+		memset(buf + y * stride + w->x + w->width, 0,
+		       stride - w->x - w->width);
+	}
+	memset(buf + (w->y + w->height) * stride, 0,
+	       (RIFT_SENSOR_HEIGHT - w->y - w->height) * stride);
+}
+
+/*
+ * Resets the exposure controller to the default exposure time at unity
+ * gain.
+ */
+static void rift_sensor_init_exposure(OuvrtRiftSensor *self)
+{
+	exposure_control_init(&self->exposure, RIFT_SENSOR_EXPOSURE,
+			      RIFT_SENSOR_MIN_EXPOSURE,
+			      RIFT_SENSOR_MAX_EXPOSURE,
+			      RIFT_SENSOR_UNITY_GAIN, RIFT_SENSOR_MAX_GAIN,
+			      RIFT_SENSOR_EXPOSURE_INTERVAL);
+}
+
+/*
+ * Feeds the blob statistics of the current frame into the exposure
+ * controller, and requests the sensor thread to write new exposure time
+ * and gain settings if they changed. Only active while synchronised
+ * exposure is enabled, otherwise the sensor's automatic exposure is used.
+ * After synchronised exposure was enabled, the controller restarts from
+ * the default exposure time at unity gain.
+ */
+static void rift_sensor_update_exposure(OuvrtRiftSensor *self,
+					struct blobservation *ob)
+{
+	struct exposure_control *ec = &self->exposure;
+
+	if (!rift_sensor_exposure_control ||
+	    !__atomic_load_n(&self->sync, __ATOMIC_ACQUIRE))
+		return;
+
+	if (__atomic_exchange_n(&self->exposure_reset, false,
+				__ATOMIC_ACQUIRE)) {
+		rift_sensor_init_exposure(self);
+		ec->last_update = self->time;
+	} else if (!exposure_control_update(ec, ob, self->time)) {
+		return;
+	}
+
+	g_mutex_lock(&self->control_lock);
+	self->requested_exposure = ec->exposure;
+	self->requested_gain = ec->gain;
+	self->exposure_pending = true;
+	g_cond_signal(&self->control_cond);
+	g_mutex_unlock(&self->control_lock);
+}
+
+/*
+ * Returns the start of exposure of the current frame in ns, mapped from its
+ * presentation time stamp. Until the device clock is known, the arrival of
+ * the first payload at the end of exposure is used instead.
+ */
+static uint64_t rift_sensor_frame_time(OuvrtRiftSensor *self)
+{
+	uint64_t time;
+
+	if (!self->pts_valid ||
+	    !uvc_clock_to_host(&self->clock, self->pts, &time) ||
+	    time > self->time || time + RIFT_SENSOR_MAX_PTS_DELAY < self->time)
+		return self->time;
+
+	return time;
+}
+
 static void default_frame_callback(OuvrtRiftSensor *self)
 {
+	struct imu_state imu_states[OUVRT_DEBUG_MAX_IMU_SAMPLES];
+	unsigned int num_imu_states = 0;
+	uint64_t time = rift_sensor_frame_time(self);
+	OuvrtTracker *tracker = NULL;
 	struct timespec tp;
 	double timestamps[4] = { 0 };
 
+	timestamps[0] = 1e-9 * time;
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
+	stats_count(&self->dev.stats, STATS_FRAMES, 1);
+
 	/*
 	 * Find bright blobs in the camera image and identify individual LEDs
 	 * using the estimated pose at time of exposure or, if that is not
 	 * available, using the LED blinking pattern.
 	 */
 	struct blobservation *ob = NULL;
-	if (self->tracker) {
-		ouvrt_tracker_process_frame(self->tracker,
-					    self->frame, RIFT_SENSOR_WIDTH,
-					    RIFT_SENSOR_HEIGHT, self->time,
-					    &ob);
+	g_mutex_lock(&self->control_lock);
+	if (self->tracker)
+		tracker = g_object_ref(self->tracker);
+	g_mutex_unlock(&self->control_lock);
+	if (tracker) {
+		ouvrt_tracker_process_frame(tracker, self->bw,
+					    self->frame_buf,
+					    self->window.x, self->window.y,
+					    self->window.width,
+					    self->window.height, time, &ob);
+		rift_sensor_update_window(self, ob);
+		rift_sensor_update_exposure(self, ob);
+		num_imu_states = ouvrt_tracker_get_imu_states(tracker,
+						&self->imu_reader, time,
+						imu_states,
+						OUVRT_DEBUG_MAX_IMU_SAMPLES);
+		g_object_unref(tracker);
 	}
 
+	if (self->observer)
+		self->observer(self, ob, self->observer_data);
+
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[2] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
@@ -177,12 +544,61 @@ static void default_frame_callback(OuvrtRiftSensor *self)
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[3] = tp.tv_sec + 1e-9 * tp.tv_nsec;
+	stats_add_frame_timestamps(&self->dev.stats, timestamps);
+
+	if (self->debug)
+		rift_sensor_expand_frame(self);
+
+	if (self->frame_buf == self->debug_buf.data) {
+		/* Assembled directly into a PipeWire buffer */
+		debug_stream_buffer_push(self->debug, &self->debug_buf, ob,
+					 &rot, &trans, imu_states,
+					 num_imu_states, timestamps);
+		self->frame_buf = self->frame;
+		return;
+	}
 
 	debug_stream_frame_push(self->debug, self->frame,
 				RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT +
 				sizeof(struct ouvrt_debug_attachment),
 				RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT,
-				ob, &rot, &trans, timestamps);
+				ob, &rot, &trans, imu_states, num_imu_states,
+				timestamps);
+}
+
+/*
+ * Selects the buffer to assemble the next frame in. If the debug stream has
+ * a free buffer, the frame is assembled directly in there, so that it does
+ * not have to be copied later.
+ */
+static void rift_sensor_get_frame_buffer(OuvrtRiftSensor *self)
+{
+	if (!self->debug_buf.data)
+		debug_stream_buffer_get(self->debug, &self->debug_buf,
+					RIFT_SENSOR_FRAME_SIZE);
+
+	self->frame_buf = self->debug_buf.data ? self->debug_buf.data :
+						 self->frame;
+}
+
+/*
+ * Hands a received frame to the frame callback if its size matches one of
+ * the possible readout windows, or drops it otherwise.
+ */
+static void rift_sensor_finish_frame(OuvrtRiftSensor *self)
+{
+	if (rift_sensor_latch_window(self, self->payload_size)) {
+		trace_instant(TRACE_FRAME_COMPLETE);
+		default_frame_callback(self);
+		trace_sequence(++self->sequence);
+	} else {
+		log_ratelimited(LOG_WARNING, 1000,
+				"%s: Dropping short frame: %u\n",
+				self->dev.name, self->payload_size);
+		stats_count(&self->dev.stats, STATS_SHORT_FRAMES, 1);
+	}
+
+	self->payload_size = 0;
 }
 
 enum process_payload_return {
@@ -193,16 +609,25 @@ enum process_payload_return {
 	PAYLOAD_FRAME_COMPLETE
 };
 
-enum process_payload_return process_payload(OuvrtRiftSensor *self,
-					    unsigned char *payload, size_t len)
+/*
+ * Appends the payload of a single isochronous packet to the current frame.
+ * The time in nanoseconds is used as frame time if the payload starts a new
+ * frame. A frame is complete when the payload has the end of frame bit set,
+ * or when it reaches the size of the largest possible readout window. If
+ * the frame ID toggles before, the previous frame is finished first.
+ */
+static enum process_payload_return
+process_payload(OuvrtRiftSensor *self, unsigned char *payload, size_t len,
+		uint64_t time)
 {
 	struct uvc_payload_header *h = (struct uvc_payload_header *)payload;
 	int payload_len;
 	int frame_id;
+	int max_size;
 	uint32_t pts;
 	bool error;
 
-	if (len == 0 || len == sizeof(struct uvc_payload_header))
+	if (len == 0)
 		return PAYLOAD_EMPTY;
 
 	if (h->bHeaderLength == 0) {
@@ -218,8 +643,16 @@ enum process_payload_return process_payload(OuvrtRiftSensor *self,
 
 	payload += h->bHeaderLength;
 	payload_len = len - h->bHeaderLength;
-	frame_id = h->bmHeaderInfo & 0x01;
-	error = h->bmHeaderInfo & 0x40;
+	frame_id = h->bmHeaderInfo & UVC_STREAM_FID;
+	error = h->bmHeaderInfo & UVC_STREAM_ERR;
+
+	if (payload_len == 0) {
+		/* Header-only payloads can still mark the end of frame */
+		if ((h->bmHeaderInfo & UVC_STREAM_EOF) &&
+		    frame_id == self->frame_id && self->payload_size)
+			return PAYLOAD_FRAME_COMPLETE;
+		return PAYLOAD_EMPTY;
+	}
 
 	if (error) {
 		g_print("%s: Frame error\n", self->dev.name);
@@ -231,50 +664,134 @@ enum process_payload_return process_payload(OuvrtRiftSensor *self,
 		self->pts = pts;
 
 	if (frame_id != self->frame_id) {
-		struct timespec ts;
-		uint64_t time;
-
-		if (self->payload_size != self->frame_size) {
-			g_print("%s: Dropping short frame: %u\n",
-				self->dev.name, self->payload_size);
-		}
+		/* The previous frame ended without end of frame bit */
+		if (self->payload_size)
+			rift_sensor_finish_frame(self);
 
 		/* Start of new frame */
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		time = ts.tv_sec * 1000000000 + ts.tv_nsec;
+		g_mutex_lock(&self->control_lock);
+		self->next_window = self->written_window;
+		g_mutex_unlock(&self->control_lock);
 		self->dt = time - self->time;
 
 		self->frame_id = frame_id;
 		self->pts = pts;
+		self->pts_valid = h->bmHeaderInfo & UVC_STREAM_PTS;
 		self->time = time;
 		self->payload_size = 0;
 	} else {
 		if (pts != self->pts) {
-			g_print("%s: PTS changed in-frame at %u!\n",
-				self->dev.name, self->payload_size);
+			log_ratelimited(LOG_WARNING, 1000,
+					"%s: PTS changed in-frame at %u!\n",
+					self->dev.name, self->payload_size);
 			self->pts = pts;
 		}
 	}
 
-	if (self->payload_size + payload_len > self->frame_size) {
-		g_print("%s: Frame buffer overflow: %u %u %u\n", self->dev.name,
-			self->payload_size, payload_len, self->frame_size);
+	if (self->payload_size + payload_len > RIFT_SENSOR_FRAME_SIZE) {
+		log_ratelimited(LOG_WARNING, 1000,
+				"%s: Frame buffer overflow: %u %u\n",
+				self->dev.name, self->payload_size,
+				payload_len);
 		return PAYLOAD_OVERFLOW;
 	}
 
-	memcpy(self->frame + self->payload_size, payload, payload_len);
+	if (self->payload_size == 0)
+		rift_sensor_get_frame_buffer(self);
+
+	memcpy(self->frame_buf + self->payload_size, payload, payload_len);
 	self->payload_size += payload_len;
 
-	return (self->payload_size == self->frame_size) ?
-	       PAYLOAD_FRAME_COMPLETE : PAYLOAD_FRAME_PARTIAL;
+	max_size = MAX(rift_sensor_window_size(&self->window),
+		       rift_sensor_window_size(&self->next_window));
+	if ((h->bmHeaderInfo & UVC_STREAM_EOF) ||
+	    self->payload_size == max_size)
+		return PAYLOAD_FRAME_COMPLETE;
+
+	return PAYLOAD_FRAME_PARTIAL;
+}
+
+/*
+ * Returns the estimated reception time of an isochronous packet, given the
+ * reception time of the transfer's last packet.
+ */
+static inline uint64_t packet_time(struct libusb_transfer *transfer, int i,
+				   uint64_t time)
+{
+	return time - (uint64_t)(transfer->num_iso_packets - 1 - i) *
+		      RIFT_SENSOR_PACKET_INTERVAL;
+}
+
+/*
+ * Adds the source clock reference of the last packet in the transfer that
+ * carries one to the device clock model.
+ */
+static void rift_sensor_add_clock_sample(OuvrtRiftSensor *self,
+					 struct libusb_transfer *transfer,
+					 uint64_t time)
+{
+	int i;
+
+	for (i = transfer->num_iso_packets - 1; i >= 0; i--) {
+		struct uvc_payload_header *h;
+		uint32_t stc;
+
+		if (transfer->iso_packet_desc[i].actual_length <
+		    sizeof(struct uvc_payload_header))
+			continue;
+
+		h = (struct uvc_payload_header *)
+		    libusb_get_iso_packet_buffer_simple(transfer, i);
+		if (h->bHeaderLength != sizeof(*h) ||
+		    !(h->bmHeaderInfo & UVC_STREAM_SCR))
+			continue;
+
+		stc = __le32_to_cpup((__le32 *)h->scrSourceClock);
+		uvc_clock_add_sample(&self->clock, stc,
+				     packet_time(transfer, i, time));
+		return;
+	}
+}
+
+/*
+ * Handles the isochronous packets contained in a completed transfer. The
+ * given time is the reception time of the last packet.
+ */
+static void rift_sensor_handle_transfer(OuvrtRiftSensor *self,
+					struct libusb_transfer *transfer,
+					uint64_t time)
+{
+	int i;
+
+	trace_sequence(self->sequence);
+	trace_instant(TRACE_USB_PAYLOAD);
+
+	rift_sensor_add_clock_sample(self, transfer, time);
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		enum process_payload_return ret;
+		unsigned char *payload;
+		size_t payload_len;
+
+		payload = libusb_get_iso_packet_buffer_simple(transfer, i);
+		payload_len = transfer->iso_packet_desc[i].actual_length;
+		ret = process_payload(self, payload, payload_len,
+				      packet_time(transfer, i, time));
+
+		if (ret == PAYLOAD_FRAME_COMPLETE)
+			rift_sensor_finish_frame(self);
+	}
 }
 
 static void iso_transfer_cb(struct libusb_transfer *transfer)
 {
 	OuvrtRiftSensor *self = transfer->user_data;
 	OuvrtDevice *dev = OUVRT_DEVICE(self);
+	struct timespec ts;
 	int ret;
-	int i;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		return;
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
@@ -290,22 +807,13 @@ static void iso_transfer_cb(struct libusb_transfer *transfer)
 	}
 
 	/* Handle contained isochronous packets */
-	for (i = 0; i < transfer->num_iso_packets; i++) {
-		enum process_payload_return ret;
-		unsigned char *payload;
-		size_t payload_len;
-
-		payload = libusb_get_iso_packet_buffer_simple(transfer, i);
-		payload_len = transfer->iso_packet_desc[i].actual_length;
-		ret = process_payload(self, payload, payload_len);
-
-		if (ret == PAYLOAD_FRAME_COMPLETE)
-			default_frame_callback(self);
-	}
-
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rift_sensor_handle_transfer(self, transfer,
+				    ts.tv_sec * 1000000000 + ts.tv_nsec);
 
 	/* Resubmit transfer */
-	ret = libusb_submit_transfer(transfer);
+	ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+					       transfer);
 	if (ret < 0) {
 		g_print("%s: Failed to resubmit: %d\n", dev->name, ret);
 		dev->active = false;
@@ -394,11 +902,23 @@ static int rift_sensor_start(OuvrtDevice *dev)
 		return ret;
 	}
 
-	self->frame_size = RIFT_SENSOR_FRAME_SIZE;
-	self->frame = calloc(1, self->frame_size +
+	/*
+	 * The maximum video frame size negotiated above stays at the full
+	 * frame size, the actual size follows the sensor readout window.
+	 */
+	self->window = rift_sensor_full_window;
+	self->next_window = rift_sensor_full_window;
+	rift_sensor_reset_window(self);
+	rift_sensor_init_exposure(self);
+	uvc_clock_reset(&self->clock);
+	self->frame = calloc(1, RIFT_SENSOR_FRAME_SIZE +
 			     sizeof(struct ouvrt_debug_attachment));
 	if (!self->frame)
 		return -ENOMEM;
+	self->frame_buf = self->frame;
+	self->bw = blobwatch_new(RIFT_SENSOR_WIDTH, RIFT_SENSOR_HEIGHT);
+	if (!self->bw)
+		return -ENOMEM;
 
 	self->num_transfers = 7; /* enough for a single frame */
 	self->transfer = calloc(self->num_transfers, sizeof(*self->transfer));
@@ -406,7 +926,8 @@ static int rift_sensor_start(OuvrtDevice *dev)
 		return -ENOMEM;
 
 	for (int i = 0; i < self->num_transfers; i++) {
-		self->transfer[i] = libusb_alloc_transfer(32);
+		self->transfer[i] = ouvrt_usb_device_alloc_transfer(
+						OUVRT_USB_DEVICE(self), 32);
 		if (!self->transfer[i])
 			return -ENOMEM;
 
@@ -420,7 +941,8 @@ static int rift_sensor_start(OuvrtDevice *dev)
 					 1000);
 		libusb_set_iso_packet_lengths(self->transfer[i], packet_size);
 
-		ret = libusb_submit_transfer(self->transfer[i]);
+		ret = ouvrt_usb_device_submit_transfer(OUVRT_USB_DEVICE(self),
+						       self->transfer[i]);
 		if (ret < 0) {
 			g_print("%s: Failed to submit iso transfer %d\n",
 				dev->name, i);
@@ -440,44 +962,179 @@ static int rift_sensor_start(OuvrtDevice *dev)
 }
 
 /*
- * Initializes the sensors and handles USB transfers.
+ * Writes the readout window to the sensor and records it, so that frames
+ * using it can be recognized.
  */
-static void rift_sensor_thread(OuvrtDevice *dev)
+static void rift_sensor_write_window(OuvrtRiftSensor *self,
+				     const struct rift_sensor_window *w)
 {
-	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(dev);
 	int ret;
 
-	usleep(1000000);
-
-	ret = ar0134_init(self->devh);
+	ret = ar0134_set_window(self->devh, w->x, w->y, w->x + w->width - 1,
+				w->y + w->height - 1);
 	if (ret < 0) {
-		g_print("%s: Failed to initialize AR0134 sensor\n", dev->name);
+		g_print("%s: Failed to set window: %d\n", self->dev.name, ret);
 		return;
 	}
 
-	/* Initialize the AR0134 sensor for CV1 tracking */
-	if (self->tracker) {
+	g_mutex_lock(&self->control_lock);
+	self->written_window = *w;
+	g_mutex_unlock(&self->control_lock);
+}
+
+/*
+ * Switches the sensor between synchronised exposure, with the exposure
+ * pulses of the tracker's radio, and automatic exposure. Only called from
+ * the sensor thread, so that the I2C sequences written through the bridge
+ * never interleave with the window and exposure updates.
+ */
+static void rift_sensor_set_sync(OuvrtRiftSensor *self, bool sync)
+{
+	OuvrtDevice *dev = &self->dev;
+	OuvrtTracker *tracker = NULL;
+	int ret;
+
+	if (sync) {
 		g_print("%s: Synchronised exposure\n", dev->name);
-		/* Enable synchronised exposure by default */
+		ret = ar0134_set_ae(self->devh, false);
+		if (ret < 0)
+			return;
+
 		ret = ar0134_set_sync(self->devh, true);
 		if (ret < 0)
 			return;
+		rift_sensor_reset_window(self);
+		__atomic_store_n(&self->exposure_reset, true, __ATOMIC_RELEASE);
+		__atomic_store_n(&self->sync, true, __ATOMIC_RELEASE);
+
+		g_mutex_lock(&self->control_lock);
+		if (self->tracker)
+			tracker = g_object_ref(self->tracker);
+		g_mutex_unlock(&self->control_lock);
+		if (!tracker)
+			return;
 
-		ouvrt_tracker_get_radio_address(self->tracker, self->radio_id);
+		ouvrt_tracker_get_radio_address(tracker, self->radio_id);
+		g_object_unref(tracker);
 		if (self->radio_id) {
-			ret = esp770u_setup_radio(self->devh,
-						  self->radio_id);
+			ret = esp770u_setup_radio(self->devh, self->radio_id);
 			if (ret < 0)
 				return;
 		}
 	} else {
 		g_print("%s: Automatic exposure\n", dev->name);
+		__atomic_store_n(&self->sync, false, __ATOMIC_RELEASE);
+		g_mutex_lock(&self->control_lock);
+		self->exposure_pending = false;
+		g_mutex_unlock(&self->control_lock);
+
+		ret = ar0134_set_sync(self->devh, false);
+		if (ret < 0)
+			return;
+		rift_sensor_reset_window(self);
+
 		ret = ar0134_set_ae(self->devh, true);
 		if (ret < 0)
 			return;
 	}
+}
+
+/*
+ * Writes the exposure mode changes requested by set_tracker, and the
+ * readout windows and exposure settings requested by the frame callback,
+ * to the sensor until the device is stopped. Requests made while the
+ * previous ones are written are collected and only the most recent
+ * settings are written.
+ */
+static void rift_sensor_control_loop(OuvrtRiftSensor *self)
+{
+	OuvrtDevice *dev = &self->dev;
+	struct rift_sensor_window w;
+	bool window_pending;
+	bool exposure_pending;
+	bool sync_pending;
+	bool sync;
+	uint16_t exposure;
+	uint16_t gain;
+	int ret;
+
+	while (dev->active) {
+		g_mutex_lock(&self->control_lock);
+		if (!self->window_pending && !self->exposure_pending &&
+		    !self->sync_pending) {
+			g_cond_wait_until(&self->control_cond,
+					  &self->control_lock,
+					  g_get_monotonic_time() +
+					  100 * G_TIME_SPAN_MILLISECOND);
+		}
+		sync_pending = self->sync_pending;
+		sync = self->requested_sync;
+		window_pending = self->window_pending;
+		exposure_pending = self->exposure_pending;
+		w = self->requested_window;
+		exposure = self->requested_exposure;
+		gain = self->requested_gain;
+		self->sync_pending = false;
+		self->window_pending = false;
+		self->exposure_pending = false;
+		g_mutex_unlock(&self->control_lock);
+
+		if (sync_pending &&
+		    sync != __atomic_load_n(&self->sync, __ATOMIC_ACQUIRE)) {
+			/* Window and exposure requests are for the old mode */
+			rift_sensor_set_sync(self, sync);
+			continue;
+		}
+
+		/* Automatic exposure may have been enabled in the meantime */
+		if (exposure_pending &&
+		    __atomic_load_n(&self->sync, __ATOMIC_ACQUIRE)) {
+			ret = ar0134_set_exposure(self->devh, exposure, gain);
+			if (ret < 0) {
+				g_print("%s: Failed to set exposure: %d\n",
+					dev->name, ret);
+			}
+		}
+
+		if (window_pending)
+			rift_sensor_write_window(self, &w);
+	}
+}
+
+/*
+ * Initializes the sensors. USB transfers are handled by the event thread,
+ * readout window and exposure changes are written to the sensor from this
+ * thread.
+ */
+static void rift_sensor_thread(OuvrtDevice *dev)
+{
+	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(dev);
+	bool sync;
+	int ret;
+
+	usleep(1000000);
+
+	ret = ar0134_init(self->devh);
+	if (ret < 0) {
+		g_print("%s: Failed to initialize AR0134 sensor\n", dev->name);
+		return;
+	}
+
+	/*
+	 * Initialize the AR0134 sensor for CV1 tracking, with synchronised
+	 * exposure if the sensor is already linked to a tracker. Later
+	 * changes are applied by the control loop.
+	 */
+	g_mutex_lock(&self->control_lock);
+	sync = self->tracker != NULL;
+	self->sync_pending = false;
+	g_mutex_unlock(&self->control_lock);
+
+	rift_sensor_set_sync(self, sync);
 
 	OUVRT_DEVICE_CLASS(ouvrt_rift_sensor_parent_class)->thread(dev);
+
+	rift_sensor_control_loop(self);
 }
 
 static void rift_sensor_stop(OuvrtDevice *dev)
@@ -486,10 +1143,63 @@ static void rift_sensor_stop(OuvrtDevice *dev)
 
 	g_print("%s: Stop\n", dev->name);
 
-	debug_stream_unref(self->debug);
+	if (self->imu_reader.overflows) {
+		g_print("%s: Lost %" G_GUINT64_FORMAT " IMU samples\n",
+			dev->name, self->imu_reader.overflows);
+	}
+
 	libusb_release_interface(self->devh, UVC_INTERFACE_CONTROL);
 }
 
+/*
+ * Releases the debug stream after all transfers are finished.
+ */
+static void rift_sensor_close(OuvrtDevice *dev)
+{
+	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(dev);
+
+	OUVRT_DEVICE_CLASS(ouvrt_rift_sensor_parent_class)->close(dev);
+
+	if (self->debug_buf.data)
+		debug_stream_buffer_put(self->debug, &self->debug_buf);
+	self->frame_buf = self->frame;
+	self->debug = debug_stream_unref(self->debug);
+
+	blobwatch_free(self->bw);
+	self->bw = NULL;
+}
+
+/*
+ * Handles a recorded transfer. The frame buffer and blob detector are
+ * allocated on first use, as the device is never started.
+ */
+static void rift_sensor_replay_transfer(OuvrtUSBDevice *usb,
+					struct libusb_transfer *transfer,
+					uint64_t time)
+{
+	OuvrtRiftSensor *self = OUVRT_RIFT_SENSOR(usb);
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		return;
+
+	if (!self->frame) {
+		self->frame = calloc(1, RIFT_SENSOR_FRAME_SIZE +
+				     sizeof(struct ouvrt_debug_attachment));
+		if (!self->frame)
+			return;
+		self->frame_buf = self->frame;
+	}
+
+	if (!self->bw) {
+		self->bw = blobwatch_new(RIFT_SENSOR_WIDTH,
+					 RIFT_SENSOR_HEIGHT);
+		if (!self->bw)
+			return;
+	}
+
+	rift_sensor_handle_transfer(self, transfer, time);
+}
+
 /*
  * Frees common fields of the device structure. To be called from the device
  * specific free operation.
@@ -500,6 +1210,12 @@ static void ouvrt_rift_sensor_finalize(GObject *object)
 
 	if (self->tracker)
 		g_object_unref(self->tracker);
+	free(self->frame);
+	blobwatch_free(self->bw);
+	g_mutex_clear(&self->control_lock);
+	g_cond_clear(&self->control_cond);
+
+	G_OBJECT_CLASS(ouvrt_rift_sensor_parent_class)->finalize(object);
 }
 
 static void ouvrt_rift_sensor_class_init(OuvrtRiftSensorClass *klass)
@@ -510,6 +1226,9 @@ static void ouvrt_rift_sensor_class_init(OuvrtRiftSensorClass *klass)
 	OUVRT_DEVICE_CLASS(klass)->start = rift_sensor_start;
 	OUVRT_DEVICE_CLASS(klass)->thread = rift_sensor_thread;
 	OUVRT_DEVICE_CLASS(klass)->stop = rift_sensor_stop;
+	OUVRT_DEVICE_CLASS(klass)->close = rift_sensor_close;
+	OUVRT_USB_DEVICE_CLASS(klass)->replay_transfer =
+						rift_sensor_replay_transfer;
 }
 
 static void ouvrt_rift_sensor_init(OuvrtRiftSensor *self)
@@ -517,6 +1236,13 @@ static void ouvrt_rift_sensor_init(OuvrtRiftSensor *self)
 	ouvrt_usb_device_set_vid_pid(OUVRT_USB_DEVICE(self), VID_OCULUSVR,
 				     PID_RIFT_SENSOR);
 	self->sync = false;
+	self->window = rift_sensor_full_window;
+	self->next_window = rift_sensor_full_window;
+	self->written_window = rift_sensor_full_window;
+	self->requested_window = rift_sensor_full_window;
+	rift_sensor_init_exposure(self);
+	g_mutex_init(&self->control_lock);
+	g_cond_init(&self->control_cond);
 }
 
 /*
@@ -535,57 +1261,31 @@ OuvrtDevice *rift_sensor_new(G_GNUC_UNUSED const char *devnode)
 	return OUVRT_DEVICE(camera);
 }
 
-void ouvrt_rift_sensor_set_sync_exposure(OuvrtRiftSensor *self, gboolean sync)
+/*
+ * Links the sensor to the tracker of a Rift HMD, or unlinks it if tracker is
+ * NULL. The sensor thread switches to synchronised exposure with the HMD's
+ * radio, or back to automatic exposure, as the sensor must only be accessed
+ * from there.
+ */
+void ouvrt_rift_sensor_set_tracker(OuvrtRiftSensor *self, OuvrtTracker *tracker)
 {
-	int ret;
-
-	if (sync == self->sync)
-		return;
-
-	self->sync = sync;
-
-	if (!self->dev.active)
-		return;
-
-	if (sync) {
-		ret = ar0134_set_ae(self->devh, false);
-		if (ret < 0)
-			return;
-
-		ret = ar0134_set_sync(self->devh, true);
-		if (ret < 0)
-			return;
-	} else {
-		ret = ar0134_set_sync(self->devh, false);
-		if (ret < 0)
-			return;
-
-		ret = ar0134_set_ae(self->devh, true);
-		if (ret < 0)
-			return;
+	g_mutex_lock(&self->control_lock);
+	if (!tracker != !self->tracker) {
+		self->requested_sync = tracker != NULL;
+		self->sync_pending = true;
+		g_cond_signal(&self->control_cond);
 	}
+	g_set_object(&self->tracker, tracker);
+	g_mutex_unlock(&self->control_lock);
 }
 
-void ouvrt_rift_sensor_set_tracker(OuvrtRiftSensor *self, OuvrtTracker *tracker)
+/*
+ * Sets a function that is called with the blobs observed in each frame.
+ */
+void ouvrt_rift_sensor_set_observer(OuvrtRiftSensor *self,
+				    OuvrtRiftSensorObserver observer,
+				    gpointer user_data)
 {
-	int ret;
-
-	if (self->devh) {
-		if (tracker && !self->tracker) {
-			g_print("%s: Synchronised exposure\n", self->dev.name);
-			ouvrt_rift_sensor_set_sync_exposure(self, true);
-
-			ouvrt_tracker_get_radio_address(tracker, self->radio_id);
-			if (self->radio_id) {
-				ret = esp770u_setup_radio(self->devh,
-							  self->radio_id);
-				if (ret < 0)
-					return;
-			}
-		} else if (!tracker && self->tracker) {
-			g_print("%s: Automatic exposure\n", self->dev.name);
-			ouvrt_rift_sensor_set_sync_exposure(self, false);
-		}
-	}
-	g_set_object(&self->tracker, tracker);
+	self->observer = observer;
+	self->observer_data = user_data;
 }
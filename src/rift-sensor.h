@@ -8,19 +8,35 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <stdbool.h>
 
 #include "tracker.h"
 #include "usb-device.h"
 
 G_BEGIN_DECLS
 
+struct blobservation;
+
 #define OUVRT_TYPE_RIFT_SENSOR (ouvrt_rift_sensor_get_type())
 G_DECLARE_FINAL_TYPE(OuvrtRiftSensor, ouvrt_rift_sensor, OUVRT, RIFT_SENSOR, \
 		     OuvrtUSBDevice)
 
 OuvrtDevice *rift_sensor_new(const char *devnode);
+void rift_sensor_set_windowing(bool enable);
+void rift_sensor_set_exposure_control(bool enable);
+
+/*
+ * Called from the frame callback with the blobs observed in each frame, or
+ * NULL if there are none, so that ouvrt-replay can check the results.
+ */
+typedef void (*OuvrtRiftSensorObserver)(OuvrtRiftSensor *self,
+					const struct blobservation *ob,
+					gpointer user_data);
 
 void ouvrt_rift_sensor_set_tracker(OuvrtRiftSensor *self, OuvrtTracker *tracker);
+void ouvrt_rift_sensor_set_observer(OuvrtRiftSensor *self,
+				    OuvrtRiftSensorObserver observer,
+				    gpointer user_data);
 
 G_END_DECLS
 
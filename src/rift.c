@@ -16,6 +16,7 @@
 #include "rift.h"
 #include "rift-hid-reports.h"
 #include "rift-radio.h"
+#include "cache.h"
 #include "debug.h"
 #include "device.h"
 #include "hidraw.h"
@@ -23,6 +24,7 @@
 #include "maths.h"
 #include "leds.h"
 #include "telemetry.h"
+#include "trace.h"
 #include "tracker.h"
 
 /* 44 LEDs + 1 IMU on CV1 */
@@ -48,6 +50,7 @@ struct _OuvrtRift {
 	bool reboot;
 	uint8_t boot_mode;
 	uint64_t last_message_time;
+	int keepalive_count;
 	uint64_t last_sample_timestamp;
 	uint32_t last_exposure_timestamp;
 	int32_t last_exposure_count;
@@ -514,7 +517,7 @@ static int rift_cv1_power_down(OuvrtRift *rift, uint8_t components)
  */
 static void rift_decode_sensor_message(OuvrtRift *rift,
 				       const unsigned char *buf,
-				       size_t len, struct timespec *ts)
+				       size_t len, const struct timespec *ts)
 {
 	struct rift_sensor_message *message = (void *)buf;
 	uint8_t num_samples;
@@ -544,6 +547,8 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 	temperature = __le16_to_cpu(message->temperature);
 	sample.temperature = 0.01f * temperature;
 
+	trace_sequence(sample_count);
+
 	sample_timestamp = __le32_to_cpu(message->timestamp);
 	/* µs, wraps every ~72 min */
 	sample.time = 1e-6 * sample_timestamp;
@@ -560,11 +565,14 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 		if (dt < 0)
 			g_print("Rift: got %u samples after %d µs\n",
 				num_samples, dt);
-		else if (dt + 1 >= (num_samples + 1) * rift->report_interval)
+		else if (dt + 1 >= (num_samples + 1) * rift->report_interval) {
 			g_print("Rift: got %u samples after %d µs, %u samples lost\n",
 				num_samples, dt,
 				(dt + 1) / rift->report_interval - num_samples);
-		else
+			stats_count(&rift->dev.stats, STATS_IMU_SAMPLES_LOST,
+				    (dt + 1) / rift->report_interval -
+				    num_samples);
+		} else
 			g_print("Rift: got %u samples after %d µs, too much jitter\n",
 				num_samples, dt);
 		return;
@@ -586,6 +594,10 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 
 	num_samples = num_samples > 1 ? 2 : 1;
 	for (i = 0; i < num_samples; i++) {
+		/* Samples are spread evenly over the report interval */
+		uint64_t sample_time = message_time - (num_samples - 1 - i) *
+				       dt * 1000LL / num_samples;
+
 		/* 10⁻⁴ m/s² */
 		unpack_3x21bit(1e-4f, message->sample[i].accel,
 			       &sample.acceleration);
@@ -598,8 +610,12 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 		pose_update(1e-6 / num_samples * dt, &rift->imu.pose, &sample);
 
 		telemetry_send_pose(rift->dev.id, &rift->imu.pose);
+		ouvrt_device_publish_pose(&rift->dev, sample_time,
+					  &rift->imu.pose,
+					  &sample.angular_velocity, NULL);
 
-		debug_imu_fifo_in(&rift->imu, 1);
+		ouvrt_tracker_add_imu_state(rift->tracker, sample_time,
+					    &rift->imu);
 	}
 
 	if (exposure_count != rift->last_exposure_count) {
@@ -610,7 +626,8 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 					 sample_expo_dt / dt;
 
 		ouvrt_tracker_add_exposure(rift->tracker, exposure_timestamp,
-					   exposure_time, led_pattern_phase);
+					   exposure_time, exposure_count,
+					   led_pattern_phase);
 
 		rift->last_exposure_timestamp = exposure_timestamp;
 		rift->last_exposure_count = exposure_count;
@@ -682,12 +699,161 @@ static int rift_read_flash(OuvrtRift *rift, uint8_t index, unsigned char *buf)
 	return 0;
 }
 
+/*
+ * Cached copy of the factory calibrated IR LED and IMU positions and the LED
+ * blinking patterns, stored in host byte order.
+ */
+#define RIFT_LED_CACHE_MAGIC	0x4c544652 /* "RFTL" */
+#define RIFT_LED_CACHE_VERSION	1
+
+struct rift_led_cache_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t num_leds;
+	vec3 imu_position;
+} __attribute__((packed));
+
+struct rift_led_cache_entry {
+	vec3 point;
+	vec3 normal;
+	uint16_t pattern;
+} __attribute__((packed));
+
+/*
+ * Returns the cache entry name for the LED model, keyed by serial number and
+ * UUID, or NULL if the HMD can not be identified.
+ */
+static char *rift_led_cache_name(OuvrtRift *rift)
+{
+	char uuid_string[41];
+	int i;
+
+	if (!rift->dev.serial)
+		return NULL;
+
+	for (i = 0; i < 20; i++)
+		g_snprintf(uuid_string + 2 * i, 3, "%02x", rift->uuid[i]);
+
+	return g_strdup_printf("%s_%s.%s", rift->dev.serial, uuid_string,
+			       rift->type == RIFT_CV1 ? "cv1" : "dk2");
+}
+
+/*
+ * Restores IR LED and IMU positions and LED blinking patterns from the cache,
+ * skipping the slow readout via position and pattern feature reports.
+ */
+static int rift_load_led_cache(OuvrtRift *rift, const char *name)
+{
+	const struct rift_led_cache_header *header;
+	const struct rift_led_cache_entry *entry;
+	char *contents;
+	gsize length;
+	int i;
+
+	if (!ouvrt_cache_get_contents(name, &contents, &length))
+		return -ENOENT;
+
+	header = (const struct rift_led_cache_header *)contents;
+	if (length < sizeof(*header) ||
+	    header->magic != RIFT_LED_CACHE_MAGIC ||
+	    header->version != RIFT_LED_CACHE_VERSION ||
+	    header->num_leds == 0 || header->num_leds >= MAX_POSITIONS ||
+	    length != sizeof(*header) + header->num_leds * sizeof(*entry)) {
+		g_print("Rift: Invalid LED cache entry\n");
+		ouvrt_cache_remove(name);
+		g_free(contents);
+		return -EINVAL;
+	}
+
+	leds_init(&rift->leds, header->num_leds);
+	rift->imu_position = header->imu_position;
+
+	entry = (const struct rift_led_cache_entry *)(header + 1);
+	for (i = 0; i < header->num_leds; i++, entry++) {
+		rift->leds.model.points[i] = entry->point;
+		rift->leds.model.normals[i] = entry->normal;
+		rift->leds.patterns[i] = entry->pattern;
+	}
+
+	g_free(contents);
+
+	return 0;
+}
+
+/*
+ * Stores IR LED and IMU positions and LED blinking patterns in the cache.
+ */
+static void rift_save_led_cache(OuvrtRift *rift, const char *name)
+{
+	struct rift_led_cache_header *header;
+	struct rift_led_cache_entry *entry;
+	int num_leds = rift->leds.model.num_points;
+	gsize length;
+	int i;
+
+	length = sizeof(*header) + num_leds * sizeof(*entry);
+	header = g_malloc0(length);
+
+	header->magic = RIFT_LED_CACHE_MAGIC;
+	header->version = RIFT_LED_CACHE_VERSION;
+	header->num_leds = num_leds;
+	header->imu_position = rift->imu_position;
+
+	entry = (struct rift_led_cache_entry *)(header + 1);
+	for (i = 0; i < num_leds; i++, entry++) {
+		entry->point = rift->leds.model.points[i];
+		entry->normal = rift->leds.model.normals[i];
+		entry->pattern = rift->leds.patterns[i];
+	}
+
+	if (ouvrt_cache_set_contents(name, (const char *)header, length))
+		g_print("Rift: Wrote LED cache\n");
+
+	g_free(header);
+}
+
+/*
+ * Reads IR LED and IMU positions and the LED blinking patterns from the Rift.
+ */
+static int rift_read_leds(OuvrtRift *rift)
+{
+	int ret;
+
+	ret = rift_get_positions(rift);
+	if (ret < 0) {
+		g_print("Rift: Error reading factory calibrated positions\n");
+		return ret;
+	}
+
+	if (rift->type == RIFT_CV1) {
+		unsigned char index[6] = { 0, 5, 3, 4, 36, 33 };
+		unsigned char buf[64];
+		int i;
+
+		for (i = 0; i < 6; i++) {
+			ret = rift_read_flash(rift, index[i], buf);
+			if (ret < 0)
+				return ret;
+			/* TODO: figure out what to do with these */
+		}
+	}
+
+	ret = rift_get_led_patterns(rift);
+	if (ret < 0) {
+		g_print("Rift: Error reading IR LED blinking patterns\n");
+		return ret;
+	}
+
+	return 0;
+}
+
 /*
  * Enables the IR tracking LEDs and registers them with the tracker.
  */
 static int rift_start(OuvrtDevice *dev)
 {
 	OuvrtRift *rift = OUVRT_RIFT(dev);
+	char *cache_name;
 	int ret;
 
 	if (rift->type == RIFT_CV1) {
@@ -724,30 +890,20 @@ static int rift_start(OuvrtDevice *dev)
 	if (ret < 0)
 		return ret;
 
-	ret = rift_get_positions(rift);
-	if (ret < 0) {
-		g_print("Rift: Error reading factory calibrated positions\n");
-		return ret;
-	}
-
-	if (rift->type == RIFT_CV1) {
-		unsigned char index[6] = { 0, 5, 3, 4, 36, 33 };
-		unsigned char buf[64];
-		int i;
-
-		for (i = 0; i < 6; i++) {
-			ret = rift_read_flash(rift, index[i], buf);
-			if (ret < 0)
-				return ret;
-			/* TODO: figure out what to do with these */
+	cache_name = rift_led_cache_name(rift);
+	if (cache_name && rift_load_led_cache(rift, cache_name) == 0) {
+		g_print("Rift: Read cached LED positions and patterns\n");
+	} else {
+		ret = rift_read_leds(rift);
+		if (ret < 0) {
+			g_free(cache_name);
+			return ret;
 		}
+		if (cache_name)
+			rift_save_led_cache(rift, cache_name);
 	}
+	g_free(cache_name);
 
-	ret = rift_get_led_patterns(rift);
-	if (ret < 0) {
-		g_print("Rift: Error reading IR LED blinking patterns\n");
-		return ret;
-	}
 	if ((rift->type == RIFT_DK2 && rift->leds.model.num_points != 40) ||
 	    (rift->type == RIFT_CV1 && rift->leds.model.num_points != 44)) {
 		g_print("Rift: Reported %d IR LEDs\n",
@@ -783,21 +939,95 @@ static int rift_start(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Reads and handles a single report from the IMU or radio hidraw device.
+ */
+static int rift_dispatch(OuvrtDevice *dev, int index,
+			 const struct timespec *ts)
+{
+	OuvrtRift *rift = OUVRT_RIFT(dev);
+	struct rift_wireless_device *c;
+	unsigned char buf[64];
+	int ret;
+
+	ret = ouvrt_device_read(dev, index, buf, sizeof(buf));
+	if (ret == -1) {
+		if (errno == EAGAIN)
+			return -EAGAIN;
+		g_print("%s: Read error: %d\n", dev->name, errno);
+		return -errno;
+	}
+
+	if (index == 0) {
+		if (ret < 64) {
+			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+				dev->name, ret, buf[0]);
+			return -EINVAL;
+		}
+
+		rift_decode_sensor_message(rift, buf, sizeof(buf), ts);
+		rift->keepalive_count++;
+
+		return 0;
+	}
+
+	if (ret != 64 ||
+	    (buf[0] != RIFT_RADIO_REPORT_ID &&
+	     buf[0] != RIFT_RADIO_UNKNOWN_MESSAGE_ID)) {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			dev->name, ret, buf[0]);
+		return -EINVAL;
+	}
+
+	rift_decode_radio_report(&rift->radio, dev->fds[1], buf, sizeof(buf));
+
+	c = &rift->radio.remote.base;
+	if (c->active && !c->dev_id)
+		c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+	c = &rift->radio.touch[0].base;
+	if (c->active && !c->dev_id)
+		c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+	c = &rift->radio.touch[1].base;
+	if (c->active && !c->dev_id)
+		c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+
+	return 0;
+}
+
+/*
+ * Sends a keepalive report if no IMU reports were received since the last
+ * call, or if the previous keepalive report is about to expire. Called about
+ * once per second by the reactor.
+ */
+static void rift_tick(OuvrtDevice *dev)
+{
+	OuvrtRift *rift = OUVRT_RIFT(dev);
+
+	if (rift->keepalive_count < 0) {
+		g_print("Rift: Sending keepalive\n");
+	} else if (rift->keepalive_count == 0) {
+		g_print("Rift: Resending keepalive\n");
+	} else if (rift->keepalive_count <= 8 * rift->report_rate) {
+		return;
+	}
+
+	rift_send_keepalive(rift);
+	rift->keepalive_count = 0;
+}
+
 /*
  * Keeps the Rift active.
  */
 static void rift_thread(OuvrtDevice *dev)
 {
 	OuvrtRift *rift = OUVRT_RIFT(dev);
-	unsigned char buf[64];
 	struct pollfd fds[2];
 	struct timespec ts;
-	int count;
 	int ret;
 
 	g_print("Rift: Sending keepalive\n");
 	rift_send_keepalive(rift);
-	count = 0;
+	rift->keepalive_count = 0;
 
 	while (dev->active) {
 		fds[0].fd = dev->fds[0];
@@ -810,11 +1040,11 @@ static void rift_thread(OuvrtDevice *dev)
 		ret = poll(fds, 2, 1000);
 		clock_gettime(CLOCK_MONOTONIC, &ts);
 		if (ret == -1 || ret == 0 ||
-		    count > 9 * rift->report_rate) {
+		    rift->keepalive_count > 9 * rift->report_rate) {
 			if (ret == -1 || ret == 0)
 				g_print("Rift: Resending keepalive\n");
 			rift_send_keepalive(rift);
-			count = 0;
+			rift->keepalive_count = 0;
 			continue;
 		}
 
@@ -822,53 +1052,10 @@ static void rift_thread(OuvrtDevice *dev)
 		    (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL)))
 			break;
 
-		if (fds[0].revents & POLLIN) {
-			ret = read(dev->fds[0], buf, sizeof(buf));
-			if (ret == -1) {
-				g_print("%s: Read error: %d\n", dev->name,
-					errno);
-				continue;
-			}
-			if (ret < 64) {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
-				continue;
-			}
-
-			rift_decode_sensor_message(rift, buf, sizeof(buf), &ts);
-			count++;
-		}
-		if (fds[1].revents & POLLIN) {
-			ret = read(dev->fds[1], buf, sizeof(buf));
-			if (ret == -1) {
-				g_print("%s: Read error: %d\n", dev->name,
-					errno);
-				continue;
-			}
-
-			if (ret != 64 ||
-			    (buf[0] != RIFT_RADIO_REPORT_ID &&
-			     buf[0] != RIFT_RADIO_UNKNOWN_MESSAGE_ID)) {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
-				continue;
-			}
-
-			rift_decode_radio_report(&rift->radio, dev->fds[1],
-						 buf, sizeof(buf));
-
-			struct rift_wireless_device *c;
-
-			c = &rift->radio.remote.base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-			c = &rift->radio.touch[0].base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-			c = &rift->radio.touch[1].base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-		}
+		if (fds[0].revents & POLLIN)
+			rift_dispatch(dev, 0, &ts);
+		if (fds[1].revents & POLLIN)
+			rift_dispatch(dev, 1, &ts);
 	}
 }
 
@@ -969,6 +1156,8 @@ static void ouvrt_rift_class_init(OuvrtRiftClass *klass)
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_rift_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = rift_start;
 	OUVRT_DEVICE_CLASS(klass)->thread = rift_thread;
+	OUVRT_DEVICE_CLASS(klass)->dispatch = rift_dispatch;
+	OUVRT_DEVICE_CLASS(klass)->tick = rift_tick;
 	OUVRT_DEVICE_CLASS(klass)->stop = rift_stop;
 	OUVRT_DEVICE_CLASS(klass)->radio_start_discovery = rift_radio_start_discovery;
 	OUVRT_DEVICE_CLASS(klass)->radio_stop_discovery = rift_radio_stop_discovery;
@@ -977,8 +1166,13 @@ static void ouvrt_rift_class_init(OuvrtRiftClass *klass)
 static void ouvrt_rift_init(OuvrtRift *self)
 {
 	self->dev.type = DEVICE_TYPE_HMD;
+	self->dev.has_pose = TRUE;
 	self->flicker = false;
 	self->last_sample_timestamp = 0;
+	self->keepalive_count = -1;
+	/* Configured in rift_start, assume the default until then */
+	self->report_rate = 1000;
+	self->report_interval = 1000;
 	rift_radio_init(&self->radio);
 	self->imu.pose.rotation.w = 1.0;
 }
@@ -0,0 +1,200 @@
+/*
+ * Sparse run-length encoded IR frames
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * Infrared tracking frames are almost entirely black. Instead of the full
+ * frame, only runs of pixels above the noise floor are stored, together
+ * with their position. The runs are widened by a margin, so that the edges
+ * of the LED blobs are kept as well.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "sparse-frame.h"
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+struct sparse_frame_writer {
+	struct sparse_frame_header *header;
+	uint8_t *end;
+	uint8_t *pos;
+	uint8_t *last_run;
+	int margin;
+	bool overflow;
+};
+
+/*
+ * Prepares the writer to encode a frame of the given size into buf.
+ */
+static void sparse_frame_writer_init(struct sparse_frame_writer *writer,
+				     void *buf, size_t size, int width,
+				     int height, uint8_t background, int margin)
+{
+	struct sparse_frame_header *header = buf;
+
+	memset(writer, 0, sizeof(*writer));
+	if (size < sizeof(*header)) {
+		writer->overflow = true;
+		return;
+	}
+
+	memset(header, 0, sizeof(*header));
+	header->magic = SPARSE_FRAME_MAGIC;
+	header->width = width;
+	header->height = height;
+	header->background = background;
+
+	writer->header = header;
+	writer->pos = (uint8_t *)(header + 1);
+	writer->end = (uint8_t *)buf + size;
+	writer->margin = margin;
+}
+
+/*
+ * Adds the pixels from start to end, inclusive, in row y. Runs must be added
+ * in row and column order. Runs that overlap or touch the previous run,
+ * after widening by the margin, are merged into it.
+ */
+static void sparse_frame_writer_add(struct sparse_frame_writer *writer,
+				    const uint8_t *line, int y, int start,
+				    int end)
+{
+	struct sparse_run run;
+	int length;
+
+	if (writer->overflow)
+		return;
+
+	start = max(start - writer->margin, 0);
+	end = min(end + writer->margin, writer->header->width - 1);
+	if (end < start)
+		return;
+
+	if (writer->last_run) {
+		memcpy(&run, writer->last_run, sizeof(run));
+		if (run.y == y && start <= run.x + run.length) {
+			int last_end = run.x + run.length - 1;
+
+			if (end <= last_end)
+				return;
+
+			/* Extend the previous run */
+			length = end - last_end;
+			if (writer->pos + length > writer->end) {
+				writer->overflow = true;
+				return;
+			}
+			memcpy(writer->pos, line + last_end + 1, length);
+			writer->pos += length;
+			run.length += length;
+			memcpy(writer->last_run, &run, sizeof(run));
+			return;
+		}
+	}
+
+	length = end - start + 1;
+	if (writer->pos + sizeof(run) + length > writer->end) {
+		writer->overflow = true;
+		return;
+	}
+
+	run.y = y;
+	run.x = start;
+	run.length = length;
+	memcpy(writer->pos, &run, sizeof(run));
+	writer->last_run = writer->pos;
+	writer->pos += sizeof(run);
+	memcpy(writer->pos, line + start, length);
+	writer->pos += length;
+	writer->header->num_runs++;
+}
+
+/*
+ * Finishes the encoded frame. Returns its size in bytes, or -ENOSPC if the
+ * buffer was too small.
+ */
+static ssize_t sparse_frame_writer_finish(struct sparse_frame_writer *writer)
+{
+	if (writer->overflow)
+		return -ENOSPC;
+
+	writer->header->size = writer->pos - (uint8_t *)writer->header;
+
+	return writer->header->size;
+}
+
+/*
+ * Encodes all runs of pixels brighter than threshold, widened by margin.
+ * Returns the encoded size in bytes, or -ENOSPC if the buffer was too small.
+ */
+ssize_t sparse_frame_encode(const uint8_t *frame, int width, int height,
+			    uint8_t threshold, int margin, void *buf,
+			    size_t size)
+{
+	struct sparse_frame_writer writer;
+	int x, y;
+
+	sparse_frame_writer_init(&writer, buf, size, width, height, 0, margin);
+
+	for (y = 0; y < height && !writer.overflow; y++) {
+		const uint8_t *line = frame + y * width;
+
+		for (x = 0; x < width; x++) {
+			int start;
+
+			if (line[x] <= threshold)
+				continue;
+
+			start = x++;
+			while (x < width && line[x] > threshold)
+				x++;
+
+			sparse_frame_writer_add(&writer, line, y, start, x - 1);
+		}
+	}
+
+	return sparse_frame_writer_finish(&writer);
+}
+
+/*
+ * Reconstructs the full frame from an encoded frame. The bulk of the work is
+ * done by memset and memcpy, which use the widest vector instructions
+ * available. Returns 0 on success, or -EINVAL if the encoded frame is
+ * invalid or does not match the frame size.
+ */
+int sparse_frame_decode(const void *buf, size_t size, uint8_t *frame,
+			int width, int height)
+{
+	const struct sparse_frame_header *header = buf;
+	const uint8_t *pos, *end;
+	struct sparse_run run;
+	uint32_t i;
+
+	if (size < sizeof(*header) || header->magic != SPARSE_FRAME_MAGIC ||
+	    header->width != width || header->height != height ||
+	    header->size > size)
+		return -EINVAL;
+
+	memset(frame, header->background, width * height);
+
+	pos = (const uint8_t *)(header + 1);
+	end = (const uint8_t *)buf + header->size;
+	for (i = 0; i < header->num_runs; i++) {
+		if (pos + sizeof(run) > end)
+			return -EINVAL;
+		memcpy(&run, pos, sizeof(run));
+		pos += sizeof(run);
+
+		if (run.y >= height || run.x + run.length > width ||
+		    pos + run.length > end)
+			return -EINVAL;
+
+		memcpy(frame + run.y * width + run.x, pos, run.length);
+		pos += run.length;
+	}
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Sparse run-length encoded IR frames
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __SPARSE_FRAME_H__
+#define __SPARSE_FRAME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPARSE_FRAME_MAGIC	0x53525053 /* "SPRS" */
+
+/*
+ * Encoded frame layout. All fields are in host byte order. The header is
+ * followed by num_runs runs, sorted by row and column. Each run consists of
+ * a struct sparse_run, without padding, immediately followed by length
+ * pixel values. All pixels not covered by any run have the background
+ * value. The total size includes the header.
+ */
+struct sparse_frame_header {
+	uint32_t magic;
+	uint16_t width;
+	uint16_t height;
+	uint8_t background;
+	uint8_t reserved[3];
+	uint32_t num_runs;
+	uint32_t size;
+};
+
+struct sparse_run {
+	uint16_t y;
+	uint16_t x;
+	uint16_t length;
+};
+
+ssize_t sparse_frame_encode(const uint8_t *frame, int width, int height,
+			    uint8_t threshold, int margin, void *buf,
+			    size_t size);
+int sparse_frame_decode(const void *buf, size_t size, uint8_t *frame,
+			int width, int height);
+
+#endif /* __SPARSE_FRAME_H__ */
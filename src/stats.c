@@ -0,0 +1,97 @@
+/*
+ * Per-device statistics
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * Event counters and fixed-bucket, log-scale latency histograms that can be
+ * updated from the device threads without locking, and read from the main
+ * loop to be exported via D-Bus.
+ */
+#include <stdint.h>
+
+#include "stats.h"
+
+static const char *const counter_names[STATS_NUM_COUNTERS] = {
+	[STATS_FRAMES] = "frames",
+	[STATS_DROPPED_FRAMES] = "dropped-frames",
+	[STATS_SHORT_FRAMES] = "short-frames",
+	[STATS_IMU_SAMPLES_LOST] = "imu-samples-lost",
+	[STATS_HID_READ_ERRORS] = "hid-read-errors",
+};
+
+static const char *const stage_names[STATS_NUM_STAGES] = {
+	[STATS_STAGE_CAPTURE] = "capture",
+	[STATS_STAGE_BLOBS] = "blobs",
+	[STATS_STAGE_POSE] = "pose",
+	[STATS_STAGE_TOTAL] = "total",
+};
+
+static void stats_add_interval(struct stats *stats, enum stats_stage stage,
+			       double start, double end)
+{
+	if (start <= 0 || end < start)
+		return;
+
+	stats_histogram_add(&stats->histograms[stage], (end - start) * 1e9);
+}
+
+/*
+ * Adds the stage latencies of a single camera frame. The timestamps are
+ * given in seconds, the start of exposure may be 0 if it is unknown.
+ */
+void stats_add_frame_timestamps(struct stats *stats,
+				const double timestamps[4])
+{
+	stats_add_interval(stats, STATS_STAGE_CAPTURE, timestamps[0],
+			   timestamps[1]);
+	stats_add_interval(stats, STATS_STAGE_BLOBS, timestamps[1],
+			   timestamps[2]);
+	stats_add_interval(stats, STATS_STAGE_POSE, timestamps[2],
+			   timestamps[3]);
+	stats_add_interval(stats, STATS_STAGE_TOTAL, timestamps[0],
+			   timestamps[3]);
+}
+
+uint64_t stats_get_counter(struct stats *stats, enum stats_counter counter)
+{
+	return __atomic_load_n(&stats->counters[counter], __ATOMIC_RELAXED);
+}
+
+/*
+ * Copies a histogram. Concurrent updates may cause the count and sum to be
+ * slightly out of sync with the buckets, which is fine for monitoring.
+ */
+void stats_get_histogram(struct stats *stats, enum stats_stage stage,
+			 struct stats_histogram *histogram)
+{
+	struct stats_histogram *h = &stats->histograms[stage];
+	unsigned int i;
+
+	histogram->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	histogram->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	for (i = 0; i < STATS_NUM_BUCKETS; i++) {
+		histogram->buckets[i] = __atomic_load_n(&h->buckets[i],
+							__ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Returns the exclusive upper limit of the given bucket in ns.
+ */
+uint64_t stats_bucket_limit(unsigned int bucket)
+{
+	if (bucket >= STATS_NUM_BUCKETS - 1)
+		return UINT64_MAX;
+
+	return 1ULL << (bucket + 10);
+}
+
+const char *stats_counter_name(enum stats_counter counter)
+{
+	return counter_names[counter];
+}
+
+const char *stats_stage_name(enum stats_stage stage)
+{
+	return stage_names[stage];
+}
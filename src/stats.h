@@ -0,0 +1,85 @@
+/*
+ * Per-device statistics
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+enum stats_counter {
+	STATS_FRAMES,
+	STATS_DROPPED_FRAMES,
+	STATS_SHORT_FRAMES,
+	STATS_IMU_SAMPLES_LOST,
+	STATS_HID_READ_ERRORS,
+	STATS_NUM_COUNTERS
+};
+
+/*
+ * Camera pipeline stages, measured between the four frame timestamps:
+ * start of exposure, frame received, blobs detected, and pose estimated.
+ */
+enum stats_stage {
+	STATS_STAGE_CAPTURE,
+	STATS_STAGE_BLOBS,
+	STATS_STAGE_POSE,
+	STATS_STAGE_TOTAL,
+	STATS_NUM_STAGES
+};
+
+/*
+ * Bucket 0 counts latencies below 1024 ns, bucket n counts latencies
+ * from 2^(n+9) ns up to 2^(n+10) ns, and the last bucket counts all
+ * latencies above.
+ */
+#define STATS_NUM_BUCKETS	24
+
+struct stats_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[STATS_NUM_BUCKETS];
+};
+
+/*
+ * All members are updated with relaxed atomic operations from the device
+ * threads and may be read at any time from other threads.
+ */
+struct stats {
+	uint64_t counters[STATS_NUM_COUNTERS];
+	struct stats_histogram histograms[STATS_NUM_STAGES];
+};
+
+static inline void stats_count(struct stats *stats,
+			       enum stats_counter counter, uint64_t n)
+{
+	__atomic_fetch_add(&stats->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_histogram_add(struct stats_histogram *histogram,
+				       uint64_t ns)
+{
+	uint64_t us = ns >> 10;
+	unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= STATS_NUM_BUCKETS)
+		bucket = STATS_NUM_BUCKETS - 1;
+
+	__atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+void stats_add_frame_timestamps(struct stats *stats,
+				const double timestamps[4]);
+
+uint64_t stats_get_counter(struct stats *stats, enum stats_counter counter);
+void stats_get_histogram(struct stats *stats, enum stats_stage stage,
+			 struct stats_histogram *histogram);
+uint64_t stats_bucket_limit(unsigned int bucket);
+
+const char *stats_counter_name(enum stats_counter counter);
+const char *stats_stage_name(enum stats_stage stage);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,300 @@
+/*
+ * Synthetic IR camera frames
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * Renders GREY8 frames of a tracked object's blinking IR LEDs, as seen by a
+ * camera with known intrinsics, for benchmarking the blob detection, LED
+ * identification, and pose estimation against known ground truth.
+ *
+ * Each LED is drawn as a round spot with an antialiased edge. Its radius
+ * shrinks with distance, its brightness with the angle between the LED
+ * normal and the line of sight, and LEDs facing away from the camera are
+ * not drawn at all. In the dim phases of its blink pattern, an LED spot has
+ * about half the area, which is what the flicker detection looks for.
+ * Occlusion by the object itself is not modeled.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "leds.h"
+#include "synthetic-frame.h"
+
+/* LEDs seen at more than about 80° off their normal are not drawn */
+#define MIN_FACING		0.17
+#define MIN_RADIUS		1.5
+#define DIM_RADIUS_SCALE	0.7
+#define BRIGHT_PEAK		255.0
+#define REFLECTION_PEAK		200.0
+
+struct synthetic_frame_generator {
+	struct leds *leds;
+	struct synthetic_camera camera;
+	struct synthetic_trajectory trajectory;
+	struct synthetic_options options;
+	uint32_t random;
+};
+
+static uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+/* Rotates v by the unit quaternion q */
+static void rotate(dvec3 *out, const dquat *q, const dvec3 *v)
+{
+	dvec3 t = {
+		2 * (q->y * v->z - q->z * v->y),
+		2 * (q->z * v->x - q->x * v->z),
+		2 * (q->x * v->y - q->y * v->x),
+	};
+
+	out->x = v->x + q->w * t.x + (q->y * t.z - q->z * t.y);
+	out->y = v->y + q->w * t.y + (q->z * t.x - q->x * t.z);
+	out->z = v->z + q->w * t.z + (q->x * t.y - q->y * t.x);
+}
+
+/*
+ * Projects a point in camera space to distorted pixel coordinates.
+ */
+static void project(const struct synthetic_camera *camera, const dvec3 *p,
+		    double *u, double *v)
+{
+	const double *m = camera->camera_matrix.m;
+	const double *d = camera->dist_coeffs;
+	double x = p->x / p->z;
+	double y = p->y / p->z;
+	double r2 = x * x + y * y;
+	double radial = 1 + r2 * (d[0] + r2 * (d[1] + r2 * d[4]));
+	double xd = x * radial + 2 * d[2] * x * y + d[3] * (r2 + 2 * x * x);
+	double yd = y * radial + d[2] * (r2 + 2 * y * y) + 2 * d[3] * x * y;
+
+	*u = m[0] * xd + m[1] * yd + m[2];
+	*v = m[4] * yd + m[5];
+}
+
+/*
+ * Draws an elliptic spot with a one pixel wide antialiased edge, keeping
+ * the brighter value where spots overlap.
+ */
+static void draw_spot(uint8_t *frame, int width, int height, double cx,
+		      double cy, double rx, double ry, double peak)
+{
+	double edge = rx < ry ? rx : ry;
+	int x0 = floor(cx - rx - 1);
+	int x1 = ceil(cx + rx + 1);
+	int y0 = floor(cy - ry - 1);
+	int y1 = ceil(cy + ry + 1);
+	int x, y;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > width - 1)
+		x1 = width - 1;
+	if (y1 > height - 1)
+		y1 = height - 1;
+
+	for (y = y0; y <= y1; y++) {
+		uint8_t *line = frame + y * width;
+		double dy = (y - cy) / ry;
+
+		for (x = x0; x <= x1; x++) {
+			double dx = (x - cx) / rx;
+			double level = 0.5 + (1 - sqrt(dx * dx + dy * dy)) *
+				       edge;
+			uint8_t value;
+
+			if (level <= 0)
+				continue;
+			if (level > 1)
+				level = 1;
+			value = peak * level;
+			if (value > line[x])
+				line[x] = value;
+		}
+	}
+}
+
+struct synthetic_frame_generator *
+synthetic_frame_generator_new(const struct leds *leds,
+			      const struct synthetic_camera *camera,
+			      const struct synthetic_trajectory *trajectory,
+			      const struct synthetic_options *options)
+{
+	struct synthetic_frame_generator *gen;
+
+	gen = calloc(1, sizeof(*gen));
+	if (!gen)
+		return NULL;
+
+	gen->leds = calloc(1, sizeof(*gen->leds));
+	if (!gen->leds) {
+		free(gen);
+		return NULL;
+	}
+	leds_copy(gen->leds, (struct leds *)leds);
+
+	gen->camera = *camera;
+	gen->trajectory = *trajectory;
+	gen->options = *options;
+	if (gen->options.frame_rate <= 0)
+		gen->options.frame_rate = 60;
+	if (gen->options.led_radius <= 0)
+		gen->options.led_radius = 0.004;
+
+	return gen;
+}
+
+void synthetic_frame_generator_free(struct synthetic_frame_generator *gen)
+{
+	if (!gen)
+		return;
+
+	leds_fini(gen->leds);
+	free(gen->leds);
+	free(gen);
+}
+
+/*
+ * Returns the object pose at the given frame index.
+ */
+void synthetic_frame_generator_pose(struct synthetic_frame_generator *gen,
+				    unsigned int index, struct dpose *pose)
+{
+	const struct synthetic_trajectory *traj = &gen->trajectory;
+	const dvec3 *w = &traj->angular_velocity;
+	const dquat *q = &traj->pose.rotation;
+	double t = index / gen->options.frame_rate;
+	double angle = sqrt(w->x * w->x + w->y * w->y + w->z * w->z) * t;
+	dquat r = { 0, 0, 0, 1 };
+
+	if (angle > 0) {
+		double s = sin(angle / 2) / (angle / t);
+
+		r.x = w->x * s;
+		r.y = w->y * s;
+		r.z = w->z * s;
+		r.w = cos(angle / 2);
+	}
+
+	/* Apply the rotation accumulated since the start in camera space */
+	pose->rotation.x = r.w * q->x + r.x * q->w + r.y * q->z - r.z * q->y;
+	pose->rotation.y = r.w * q->y - r.x * q->z + r.y * q->w + r.z * q->x;
+	pose->rotation.z = r.w * q->z + r.x * q->y - r.y * q->x + r.z * q->w;
+	pose->rotation.w = r.w * q->w - r.x * q->x - r.y * q->y - r.z * q->z;
+
+	pose->translation.x = traj->pose.translation.x + traj->velocity.x * t;
+	pose->translation.y = traj->pose.translation.y + traj->velocity.y * t;
+	pose->translation.z = traj->pose.translation.z + traj->velocity.z * t;
+}
+
+/*
+ * Renders the frame with the given index into frame, which must hold
+ * width * height pixels. Stores the ground truth for up to max_blobs spots
+ * with their center inside the frame into blobs, and the LED pattern phase
+ * of this frame into led_pattern_phase. Returns the number of stored spots.
+ */
+int synthetic_frame_generator_render(struct synthetic_frame_generator *gen,
+				     unsigned int index, uint8_t *frame,
+				     struct synthetic_blob *blobs,
+				     int max_blobs,
+				     uint8_t *led_pattern_phase)
+{
+	const struct synthetic_camera *camera = &gen->camera;
+	const struct tracking_model *model = &gen->leds->model;
+	const struct synthetic_options *options = &gen->options;
+	int width = camera->width;
+	int height = camera->height;
+	uint8_t phase = index % 10;
+	struct dpose pose;
+	int num_blobs = 0;
+	unsigned int i;
+	int j;
+
+	synthetic_frame_generator_pose(gen, index, &pose);
+
+	/* Restart the noise sequence, so that every frame is reproducible */
+	gen->random = (options->seed ? options->seed : 1) + index * 2654435761u;
+	if (options->noise) {
+		for (j = 0; j < width * height; j++)
+			frame[j] = xorshift32(&gen->random) %
+				   (options->noise + 1);
+	} else {
+		memset(frame, 0, width * height);
+	}
+
+	for (i = 0; i < model->num_points; i++) {
+		const vec3 *point = &model->points[i];
+		const vec3 *normal = &model->normals[i];
+		dvec3 p = { point->x, point->y, point->z };
+		dvec3 n = { normal->x, normal->y, normal->z };
+		double distance, facing, radius, peak, u, v;
+		bool bright;
+
+		rotate(&p, &pose.rotation, &p);
+		p.x += pose.translation.x;
+		p.y += pose.translation.y;
+		p.z += pose.translation.z;
+		if (p.z <= 0)
+			continue;
+
+		rotate(&n, &pose.rotation, &n);
+		distance = sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+		facing = -(n.x * p.x + n.y * p.y + n.z * p.z) / distance;
+		if (facing < MIN_FACING)
+			continue;
+
+		project(camera, &p, &u, &v);
+
+		bright = gen->leds->patterns[i] & (1 << phase);
+		radius = camera->camera_matrix.m[0] * options->led_radius /
+			 p.z;
+		if (radius < MIN_RADIUS)
+			radius = MIN_RADIUS;
+		if (!bright)
+			radius *= DIM_RADIUS_SCALE;
+		peak = BRIGHT_PEAK * (0.5 + 0.5 * facing);
+
+		draw_spot(frame, width, height, u, v, radius, radius, peak);
+		if (num_blobs < max_blobs && u >= 0 && u < width &&
+		    v >= 0 && v < height) {
+			blobs[num_blobs].x = u;
+			blobs[num_blobs].y = v;
+			blobs[num_blobs].radius = radius;
+			blobs[num_blobs].led_id = i;
+			blobs[num_blobs].bright = bright;
+			num_blobs++;
+		}
+
+		if (!options->reflections || i % 4)
+			continue;
+
+		/* A smeared reflection off a glossy surface below the LED */
+		v += 4 * radius + 2;
+		draw_spot(frame, width, height, u, v, 2.5 * radius, radius,
+			  REFLECTION_PEAK * facing);
+		if (num_blobs < max_blobs && u >= 0 && u < width &&
+		    v >= 0 && v < height) {
+			blobs[num_blobs].x = u;
+			blobs[num_blobs].y = v;
+			blobs[num_blobs].radius = radius;
+			blobs[num_blobs].led_id = -1;
+			blobs[num_blobs].bright = bright;
+			num_blobs++;
+		}
+	}
+
+	*led_pattern_phase = phase;
+
+	return num_blobs;
+}
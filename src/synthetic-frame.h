@@ -0,0 +1,80 @@
+/*
+ * Synthetic IR camera frames
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __SYNTHETIC_FRAME_H__
+#define __SYNTHETIC_FRAME_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "imu.h"
+#include "maths.h"
+
+struct leds;
+
+/*
+ * Camera intrinsics, using the same pinhole and distortion model as the
+ * pose estimation: camera_matrix is row major, dist_coeffs are k1, k2, p1,
+ * p2, and k3.
+ */
+struct synthetic_camera {
+	int width;
+	int height;
+	dmat3 camera_matrix;
+	double dist_coeffs[5];
+};
+
+/*
+ * Object motion in camera space, starting at pose, with constant linear
+ * velocity in m/s and angular velocity in rad/s.
+ */
+struct synthetic_trajectory {
+	struct dpose pose;
+	dvec3 velocity;
+	dvec3 angular_velocity;
+};
+
+struct synthetic_options {
+	/* Frames per second, the LED pattern phase advances every frame */
+	double frame_rate;
+	/* LED radius in m */
+	double led_radius;
+	/* Maximum background noise pixel value */
+	uint8_t noise;
+	/* Add a wide, dimmer reflection below every fourth LED */
+	bool reflections;
+	uint32_t seed;
+};
+
+/*
+ * Ground truth for a single rendered spot, in distorted pixel coordinates.
+ * Reflections have an led_id of -1.
+ */
+struct synthetic_blob {
+	double x;
+	double y;
+	double radius;
+	int led_id;
+	bool bright;
+};
+
+struct synthetic_frame_generator;
+
+struct synthetic_frame_generator *
+synthetic_frame_generator_new(const struct leds *leds,
+			      const struct synthetic_camera *camera,
+			      const struct synthetic_trajectory *trajectory,
+			      const struct synthetic_options *options);
+void synthetic_frame_generator_free(struct synthetic_frame_generator *gen);
+
+void synthetic_frame_generator_pose(struct synthetic_frame_generator *gen,
+				    unsigned int index, struct dpose *pose);
+int synthetic_frame_generator_render(struct synthetic_frame_generator *gen,
+				     unsigned int index, uint8_t *frame,
+				     struct synthetic_blob *blobs,
+				     int max_blobs,
+				     uint8_t *led_pattern_phase);
+
+#endif /* __SYNTHETIC_FRAME_H__ */
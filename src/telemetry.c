@@ -1,197 +1,859 @@
 /*
- * UDP Telemetry
+ * Telemetry
  * Copyright 2017 Philipp Zabel
  * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Telemetry packets are sent to one or more sinks, configured with one or
+ * more --telemetry=SINK options:
+ *
+ *   udp:HOST:PORT  UDP datagrams to a unicast or IPv4 multicast address
+ *   unix:PATH      AF_UNIX SOCK_SEQPACKET socket that consumers connect to
+ *
+ * If no sink is given, packets are sent to UDP port 28532 on localhost.
+ * Single packet types can be disabled or rate limited per device with
+ * --telemetry-rate=TYPE=HZ[,TYPE=HZ...], where HZ is a maximum rate, or
+ * "off". For example, --telemetry-rate=pose=90,raw-imu=off. Button and axis
+ * events can only be turned off.
  */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
 #include <errno.h>
+#include <glib.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "imu.h"
 #include "lighthouse.h"
 #include "telemetry.h"
 
-#define TELEMETRY_ADDRESS			INADDR_LOOPBACK
+#define TELEMETRY_DEFAULT_SINK	"udp:127.0.0.1:" \
+				G_STRINGIFY(TELEMETRY_DEFAULT_PORT)
 
-static struct sockaddr_in telemetry_addr;
-static int telemetry_fd;
+/* Keep batch packets below the typical Ethernet MTU */
+#define TELEMETRY_MAX_PACKET_SIZE		1472
+/* Maximum time a sample is held back before its batch is sent, in µs */
+#define TELEMETRY_FLUSH_INTERVAL		5000
+/* Maximum number of packets sent with a single sendmmsg call */
+#define TELEMETRY_MAX_PENDING			16
+/* Number of packets queued per device for the flush thread */
+#define TELEMETRY_QUEUE_SIZE			16
+#define TELEMETRY_NUM_PACKET_TYPES		(TELEMETRY_PACKET_BATCH + 1)
 
-int telemetry_send_raw_buffer(uint8_t dev_id, const char *buf, size_t len)
+/*
+ * A single packet, or a batch packet with count records that is sent when
+ * its deadline expires.
+ */
+struct telemetry_packet {
+	uint8_t data[TELEMETRY_MAX_PACKET_SIZE];
+	size_t len;
+	uint16_t count;
+	gint64 deadline;
+};
+
+/*
+ * Per-device packet queue. The device threads fill the packet at head and
+ * hand it over to the flush thread by incrementing head. The flush thread
+ * sends the packets between tail and head, and hands over partial batches
+ * whose deadline expired. The device lock is only held to update the
+ * queue, never while sending, and it is not shared between devices.
+ */
+struct telemetry_device {
+	GMutex lock;
+	struct telemetry_packet queue[TELEMETRY_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	uint32_t sequence;
+	uint64_t dropped;
+	/* Earliest time of the next packet per type, for rate limiting */
+	gint64 next[TELEMETRY_NUM_PACKET_TYPES];
+};
+
+/*
+ * A telemetry sink is either a UDP socket with a fixed destination address,
+ * or a listening SOCK_SEQPACKET socket with a list of connected clients.
+ * Sinks are only used by the flush thread.
+ */
+struct telemetry_sink {
+	int fd;
+	struct sockaddr_in addr;
+	gboolean seqpacket;
+	char *path;
+	GArray *clients;
+};
+
+static const char *telemetry_packet_names[TELEMETRY_NUM_PACKET_TYPES] = {
+	[TELEMETRY_PACKET_RAW_BUFFER] = "raw-buffer",
+	[TELEMETRY_PACKET_RAW_IMU_SAMPLE] = "raw-imu",
+	[TELEMETRY_PACKET_IMU_SAMPLE] = "imu",
+	[TELEMETRY_PACKET_POSE] = "pose",
+	[TELEMETRY_PACKET_LIGHTHOUSE_FRAME] = "lighthouse",
+	[TELEMETRY_PACKET_BUTTONS] = "buttons",
+	[TELEMETRY_PACKET_AXIS] = "axis",
+};
+
+static GList *telemetry_sinks;
+static gboolean telemetry_enabled;
+
+/* Minimum interval per packet type in µs, 0 is unlimited, -1 is off */
+static gint64 telemetry_interval[TELEMETRY_NUM_PACKET_TYPES];
+
+static struct telemetry_device *telemetry_devices[256];
+static GThread *telemetry_thread;
+static gint telemetry_running;
+static gint telemetry_idle;
+static int telemetry_eventfd = -1;
+
+/*
+ * Accepts new consumers on a SOCK_SEQPACKET sink.
+ */
+static void telemetry_sink_accept(struct telemetry_sink *sink)
 {
-	char packet[256];
+	int fd;
+
+	for (;;) {
+		fd = accept4(sink->fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			break;
+		g_array_append_val(sink->clients, fd);
+	}
+}
 
-	if (telemetry_fd <= 0)
-		return 0;
+/*
+ * Sends a vector of packets to all clients of a SOCK_SEQPACKET sink.
+ * Clients that disconnected are removed, clients that do not keep up
+ * lose packets.
+ */
+static void telemetry_sink_send_clients(struct telemetry_sink *sink,
+					struct mmsghdr *msgs, unsigned int n)
+{
+	unsigned int i = 0;
+	int ret;
 
-	if (len > sizeof(buf) - 2)
-		return -ENOSPC;
+	telemetry_sink_accept(sink);
 
-	packet[0] = TELEMETRY_PACKET_RAW_BUFFER;
-	packet[1] = dev_id;
-	memcpy(packet + 2, buf, len);
+	while (i < sink->clients->len) {
+		int fd = g_array_index(sink->clients, int, i);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+		ret = sendmmsg(fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			close(fd);
+			g_array_remove_index_fast(sink->clients, i);
+			continue;
+		}
+		i++;
+	}
 }
 
-int telemetry_send_raw_imu_sample(uint8_t dev_id, struct raw_imu_sample *raw)
+/*
+ * Sends a vector of packets to the destination address of a UDP sink.
+ */
+static void telemetry_sink_send_udp(struct telemetry_sink *sink,
+				    struct mmsghdr *msgs, unsigned int n)
 {
-	char packet[2 + sizeof(*raw)];
-	const size_t len = sizeof(packet);
+	unsigned int sent = 0;
+	unsigned int i;
+	int ret;
 
-	if (telemetry_fd <= 0)
-		return 0;
-
-	packet[0] = TELEMETRY_PACKET_RAW_IMU_SAMPLE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, raw, sizeof(*raw));
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_name = &sink->addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(sink->addr);
+	}
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	while (sent < n) {
+		ret = sendmmsg(sink->fd, msgs + sent, n - sent, 0);
+		if (ret <= 0)
+			break;
+		sent += ret;
+	}
 }
 
-int telemetry_send_imu_sample(uint8_t dev_id, struct imu_sample *sample)
+/*
+ * Returns the device's packet queue, allocating it on first use.
+ */
+static struct telemetry_device *telemetry_get_device(uint8_t dev_id)
 {
-	char packet[2 + sizeof(*sample)];
-	const size_t len = sizeof(packet);
+	struct telemetry_device *tdev;
+
+	tdev = g_atomic_pointer_get(&telemetry_devices[dev_id]);
+	if (tdev)
+		return tdev;
+
+	tdev = g_new0(struct telemetry_device, 1);
+	g_mutex_init(&tdev->lock);
+	if (!g_atomic_pointer_compare_and_exchange(&telemetry_devices[dev_id],
+						   NULL, tdev)) {
+		/* Another thread was first */
+		g_mutex_clear(&tdev->lock);
+		g_free(tdev);
+		tdev = g_atomic_pointer_get(&telemetry_devices[dev_id]);
+	}
 
-	if (telemetry_fd <= 0)
-		return 0;
+	return tdev;
+}
 
-	packet[0] = TELEMETRY_PACKET_IMU_SAMPLE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, sample, sizeof(*sample));
+/*
+ * Returns the packet at the head of the device's queue, or NULL if the
+ * queue is full. Must be called with the device lock held.
+ */
+static struct telemetry_packet *
+telemetry_queue_head(struct telemetry_device *tdev)
+{
+	if (tdev->head - tdev->tail == TELEMETRY_QUEUE_SIZE)
+		return NULL;
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return &tdev->queue[tdev->head % TELEMETRY_QUEUE_SIZE];
 }
 
-int telemetry_send_lighthouse_frame(uint8_t dev_id,
-				    struct lighthouse_frame *frame)
+/*
+ * Hands the packet at the head of the device's queue over to the flush
+ * thread, finalizing the header if it is a batch packet. Must be called
+ * with the device lock held.
+ */
+static void telemetry_queue_commit(uint8_t dev_id,
+				   struct telemetry_device *tdev)
 {
-	char packet[2 + sizeof(*frame)];
-	const size_t len = sizeof(packet);
+	struct telemetry_packet *packet = telemetry_queue_head(tdev);
+	struct telemetry_batch_header *header = (void *)packet->data;
+
+	if (packet->count) {
+		header->type = TELEMETRY_PACKET_BATCH;
+		header->dev_id = dev_id;
+		header->count = packet->count;
+		header->sequence = tdev->sequence++;
+	}
 
-	if (telemetry_fd <= 0)
-		return 0;
+	tdev->head++;
+}
 
-	packet[0] = TELEMETRY_PACKET_LIGHTHOUSE_FRAME;
-	packet[1] = dev_id;
-	memcpy(packet + 2, frame, sizeof(*frame));
+/*
+ * Wakes up the flush thread. This never blocks.
+ */
+static void telemetry_wake(void)
+{
+	uint64_t val = 1;
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	if (write(telemetry_eventfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		g_print("Telemetry: Failed to wake up thread: %d\n", errno);
 }
 
-int telemetry_send_pose(uint8_t dev_id, struct dpose *pose)
+/*
+ * Returns true if a packet of the given type should be dropped, either
+ * because the type is disabled or because of its rate limit. The deadline
+ * is advanced by the interval to keep the average rate at the limit, but
+ * it is resynchronized if the device has fallen more than one interval
+ * behind, so that a pause does not let a burst of packets through. Must be
+ * called with the device lock held.
+ */
+static gboolean telemetry_filter(struct telemetry_device *tdev, uint8_t type)
+{
+	gint64 interval = telemetry_interval[type];
+	gint64 now;
+
+	if (interval == 0)
+		return FALSE;
+	if (interval < 0)
+		return TRUE;
+
+	now = g_get_monotonic_time();
+	if (now < tdev->next[type])
+		return TRUE;
+	tdev->next[type] += interval;
+	if (tdev->next[type] <= now)
+		tdev->next[type] = now + interval;
+
+	return FALSE;
+}
+
+/*
+ * Appends a record to the device's batch packet. Full batches are handed
+ * over to the flush thread immediately, partial batches are sent by the
+ * flush thread after at most TELEMETRY_FLUSH_INTERVAL. If the flush thread
+ * does not keep up, the record is dropped.
+ */
+static int telemetry_push(uint8_t dev_id, uint8_t type, const void *data,
+			  size_t len)
 {
-	char packet[2 + sizeof(*pose)];
-	const size_t len = sizeof(packet);
+	struct telemetry_device *tdev;
+	struct telemetry_packet *packet;
+	gboolean wake = FALSE;
+
+	if (!telemetry_enabled)
+		return 0;
+
+	if (sizeof(struct telemetry_batch_header) + 1 + len >
+	    TELEMETRY_MAX_PACKET_SIZE)
+		return -ENOSPC;
+
+	tdev = telemetry_get_device(dev_id);
+	g_mutex_lock(&tdev->lock);
 
-	if (telemetry_fd <= 0)
+	if (telemetry_filter(tdev, type)) {
+		g_mutex_unlock(&tdev->lock);
 		return 0;
+	}
+
+	packet = telemetry_queue_head(tdev);
+	if (packet && packet->count &&
+	    packet->len + 1 + len > TELEMETRY_MAX_PACKET_SIZE) {
+		telemetry_queue_commit(dev_id, tdev);
+		packet = telemetry_queue_head(tdev);
+		wake = TRUE;
+	}
+
+	if (!packet) {
+		tdev->dropped++;
+		g_mutex_unlock(&tdev->lock);
+		return -ENOBUFS;
+	}
+
+	if (packet->count == 0) {
+		packet->len = sizeof(struct telemetry_batch_header);
+		packet->deadline = g_get_monotonic_time() +
+				   TELEMETRY_FLUSH_INTERVAL;
+		/* Only wake the flush thread if it is waiting for nothing */
+		if (g_atomic_int_get(&telemetry_idle))
+			wake = TRUE;
+	}
+
+	packet->data[packet->len] = type;
+	memcpy(packet->data + packet->len + 1, data, len);
+	packet->len += 1 + len;
+	packet->count++;
 
-	packet[0] = TELEMETRY_PACKET_POSE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, pose, sizeof(*pose));
+	g_mutex_unlock(&tdev->lock);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	if (wake)
+		telemetry_wake();
+
+	return 0;
 }
 
-int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis)
+/*
+ * Queues a single packet consisting of type, device id, and payload, and
+ * wakes up the flush thread to send it immediately. A partial batch of the
+ * same device is sent before it, to keep packets in order.
+ */
+static int telemetry_send(uint8_t dev_id, uint8_t type, const void *data,
+			  size_t len)
 {
-	char packet[2 + 1 + num_axis * sizeof(float)];
-	const size_t len = sizeof(packet);
+	struct telemetry_device *tdev;
+	struct telemetry_packet *packet;
 
-	if (telemetry_fd <= 0)
+	if (!telemetry_enabled)
 		return 0;
 
-	if (num_axis == 0)
+	if (2 + len > TELEMETRY_MAX_PACKET_SIZE)
+		return -ENOSPC;
+
+	tdev = telemetry_get_device(dev_id);
+	g_mutex_lock(&tdev->lock);
+
+	if (telemetry_filter(tdev, type)) {
+		g_mutex_unlock(&tdev->lock);
 		return 0;
+	}
+
+	packet = telemetry_queue_head(tdev);
+	if (packet && packet->count) {
+		telemetry_queue_commit(dev_id, tdev);
+		packet = telemetry_queue_head(tdev);
+	}
+
+	if (!packet) {
+		tdev->dropped++;
+		g_mutex_unlock(&tdev->lock);
+		return -ENOBUFS;
+	}
+
+	packet->data[0] = type;
+	packet->data[1] = dev_id;
+	memcpy(packet->data + 2, data, len);
+	packet->len = 2 + len;
+	telemetry_queue_commit(dev_id, tdev);
 
-	packet[0] = TELEMETRY_PACKET_AXIS;
-	packet[1] = dev_id;
-	packet[2] = index;
-	memcpy(packet + 3, axis, num_axis * sizeof(float));
+	g_mutex_unlock(&tdev->lock);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	telemetry_wake();
+
+	return 0;
 }
 
+/*
+ * Sends a vector of queued packets to all sinks, with a single system call
+ * per sink or consumer, and releases their queue slots.
+ */
+static void telemetry_send_packets(struct mmsghdr *msgs,
+				   struct telemetry_device **tdevs,
+				   unsigned int n)
+{
+	struct telemetry_packet *packet;
+	unsigned int i;
+	GList *l;
 
-int telemetry_send_buttons(uint8_t dev_id, uint8_t *buttons, int num_buttons)
+	for (l = telemetry_sinks; l; l = l->next) {
+		struct telemetry_sink *sink = l->data;
+
+		if (sink->seqpacket)
+			telemetry_sink_send_clients(sink, msgs, n);
+		else
+			telemetry_sink_send_udp(sink, msgs, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		g_mutex_lock(&tdevs[i]->lock);
+		packet = &tdevs[i]->queue[tdevs[i]->tail % TELEMETRY_QUEUE_SIZE];
+		packet->len = 0;
+		packet->count = 0;
+		tdevs[i]->tail++;
+		g_mutex_unlock(&tdevs[i]->lock);
+	}
+}
+
+/*
+ * Hands over partial batches whose deadline expired, or all of them if
+ * final is set, and sends the queued packets of all devices, coalesced
+ * into as few sendmmsg calls as possible. Returns the earliest deadline of
+ * the remaining partial batches, or G_MAXINT64.
+ */
+static gint64 telemetry_flush(gboolean final)
 {
-	char packet[2 + num_buttons];
-	const size_t len = sizeof(packet);
+	struct telemetry_device *tdevs[TELEMETRY_MAX_PENDING];
+	struct mmsghdr msgs[TELEMETRY_MAX_PENDING];
+	struct iovec iov[TELEMETRY_MAX_PENDING];
+	struct telemetry_device *tdev;
+	struct telemetry_packet *packet;
+	gint64 now = g_get_monotonic_time();
+	gint64 next = G_MAXINT64;
+	unsigned int tail, head;
+	unsigned int n = 0;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < 256; i++) {
+		tdev = g_atomic_pointer_get(&telemetry_devices[i]);
+		if (!tdev)
+			continue;
+
+		g_mutex_lock(&tdev->lock);
+		packet = telemetry_queue_head(tdev);
+		if (packet && packet->count) {
+			if (final || packet->deadline <= now)
+				telemetry_queue_commit(i, tdev);
+			else if (packet->deadline < next)
+				next = packet->deadline;
+		}
+		tail = tdev->tail;
+		head = tdev->head;
+		g_mutex_unlock(&tdev->lock);
+
+		/* Queued packets are not touched by the device threads */
+		for (; tail != head; tail++) {
+			packet = &tdev->queue[tail % TELEMETRY_QUEUE_SIZE];
+			iov[n].iov_base = packet->data;
+			iov[n].iov_len = packet->len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			tdevs[n] = tdev;
+			if (++n == TELEMETRY_MAX_PENDING) {
+				telemetry_send_packets(msgs, tdevs, n);
+				memset(msgs, 0, sizeof(msgs));
+				n = 0;
+			}
+		}
+	}
+
+	if (n)
+		telemetry_send_packets(msgs, tdevs, n);
 
-	if (telemetry_fd <= 0)
+	return next;
+}
+
+/*
+ * Sends queued packets when the device threads wake it up, and partial
+ * batches when their deadline expires.
+ */
+static gpointer telemetry_flush_thread(G_GNUC_UNUSED gpointer data)
+{
+	struct pollfd pfd = {
+		.fd = telemetry_eventfd,
+		.events = POLLIN,
+	};
+	uint64_t val;
+	gint64 next;
+	int timeout;
+
+	while (g_atomic_int_get(&telemetry_running)) {
+		next = telemetry_flush(FALSE);
+		if (next == G_MAXINT64) {
+			g_atomic_int_set(&telemetry_idle, TRUE);
+			/* Catch batches started before the idle flag was set */
+			next = telemetry_flush(FALSE);
+		}
+
+		if (next == G_MAXINT64) {
+			timeout = -1;
+		} else {
+			next -= g_get_monotonic_time();
+			timeout = next > 0 ? (next + 999) / 1000 : 0;
+		}
+
+		poll(&pfd, 1, timeout);
+		g_atomic_int_set(&telemetry_idle, FALSE);
+		if ((pfd.revents & POLLIN) &&
+		    read(telemetry_eventfd, &val, sizeof(val)) < 0 &&
+		    errno != EAGAIN)
+			g_print("Telemetry: Failed to clear wakeup: %d\n", errno);
+	}
+
+	/* Send remaining samples */
+	telemetry_flush(TRUE);
+
+	return NULL;
+}
+
+int telemetry_send_raw_buffer(uint8_t dev_id, const char *buf, size_t len)
+{
+	return telemetry_send(dev_id, TELEMETRY_PACKET_RAW_BUFFER, buf, len);
+}
+
+int telemetry_send_raw_imu_sample(uint8_t dev_id, struct raw_imu_sample *raw)
+{
+	return telemetry_push(dev_id, TELEMETRY_PACKET_RAW_IMU_SAMPLE, raw,
+			      sizeof(*raw));
+}
+
+int telemetry_send_imu_sample(uint8_t dev_id, struct imu_sample *sample)
+{
+	return telemetry_push(dev_id, TELEMETRY_PACKET_IMU_SAMPLE, sample,
+			      sizeof(*sample));
+}
+
+int telemetry_send_lighthouse_frame(uint8_t dev_id,
+				    struct lighthouse_frame *frame)
+{
+	return telemetry_push(dev_id, TELEMETRY_PACKET_LIGHTHOUSE_FRAME, frame,
+			      sizeof(*frame));
+}
+
+int telemetry_send_pose(uint8_t dev_id, struct dpose *pose)
+{
+	return telemetry_push(dev_id, TELEMETRY_PACKET_POSE, pose,
+			      sizeof(*pose));
+}
+
+int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis)
+{
+	uint8_t payload[1 + num_axis * sizeof(float)];
+
+	if (num_axis == 0)
 		return 0;
 
+	payload[0] = index;
+	memcpy(payload + 1, axis, num_axis * sizeof(float));
+
+	return telemetry_send(dev_id, TELEMETRY_PACKET_AXIS, payload,
+			      sizeof(payload));
+}
+
+int telemetry_send_buttons(uint8_t dev_id, uint8_t *buttons, int num_buttons)
+{
 	if (num_buttons == 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_BUTTONS;
-	packet[1] = dev_id;
-	memcpy(packet + 2, buttons, num_buttons);
-
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_send(dev_id, TELEMETRY_PACKET_BUTTONS, buttons,
+			      num_buttons);
 }
 
 /*
- * Initializes the telemetry UDP socket and target address.
+ * Creates a UDP sink from a "HOST:PORT" address. Multicast group addresses
+ * are looped back to local consumers.
  */
-int telemetry_init(int *argc, char **argv[])
+static int telemetry_sink_open_udp(struct telemetry_sink *sink,
+				   const char *address)
 {
 	struct sockaddr_in local_addr = {
 		.sin_family = AF_INET,
 		.sin_port = htons(0),
 		.sin_addr.s_addr = htonl(INADDR_ANY),
 	};
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *result;
+	const char *colon;
+	char *host;
 	int fd, ret;
 
-	(void)argc;
-	(void)argv;
+	colon = strrchr(address, ':');
+	if (!colon)
+		return -EINVAL;
 
-	if (telemetry_fd > 0)
-		return -EBUSY;
+	host = g_strndup(address, colon - address);
+	ret = getaddrinfo(host, colon + 1, &hints, &result);
+	g_free(host);
+	if (ret != 0)
+		return -EINVAL;
+	memcpy(&sink->addr, result->ai_addr, sizeof(sink->addr));
+	freeaddrinfo(result);
 
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	if (fd < 0)
-		return fd;
+		return -errno;
 
 	ret = bind(fd, (struct sockaddr *)&local_addr, sizeof(local_addr));
 	if (ret < 0) {
+		ret = -errno;
 		close(fd);
 		return ret;
 	}
 
-	telemetry_addr.sin_family = AF_INET;
-	telemetry_addr.sin_port = htons(TELEMETRY_DEFAULT_PORT);
-	telemetry_addr.sin_addr.s_addr = htonl(TELEMETRY_ADDRESS);
+	if (IN_MULTICAST(ntohl(sink->addr.sin_addr.s_addr))) {
+		unsigned char loop = 1;
 
-	telemetry_fd = fd;
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+			   sizeof(loop));
+	}
+
+	sink->fd = fd;
 
 	return 0;
 }
 
 /*
- * Closes the telemetry UDP socket.
+ * Creates a listening AF_UNIX SOCK_SEQPACKET sink at the given path.
+ */
+static int telemetry_sink_open_unix(struct telemetry_sink *sink,
+				    const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	unlink(path);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret == 0)
+		ret = listen(fd, 8);
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	sink->fd = fd;
+	sink->seqpacket = TRUE;
+	sink->path = g_strdup(path);
+	sink->clients = g_array_new(FALSE, FALSE, sizeof(int));
+
+	return 0;
+}
+
+static void telemetry_sink_free(gpointer data)
+{
+	struct telemetry_sink *sink = data;
+	unsigned int i;
+
+	if (sink->clients) {
+		for (i = 0; i < sink->clients->len; i++)
+			close(g_array_index(sink->clients, int, i));
+		g_array_free(sink->clients, TRUE);
+	}
+	if (sink->path) {
+		unlink(sink->path);
+		g_free(sink->path);
+	}
+	close(sink->fd);
+	g_free(sink);
+}
+
+/*
+ * Adds a telemetry sink, given as "udp:HOST:PORT" or "unix:PATH".
+ */
+static int telemetry_add_sink(const char *spec)
+{
+	struct telemetry_sink *sink;
+	int ret;
+
+	sink = g_new0(struct telemetry_sink, 1);
+	sink->fd = -1;
+
+	if (g_str_has_prefix(spec, "udp:"))
+		ret = telemetry_sink_open_udp(sink, spec + 4);
+	else if (g_str_has_prefix(spec, "unix:"))
+		ret = telemetry_sink_open_unix(sink, spec + 5);
+	else
+		ret = -EINVAL;
+	if (ret < 0) {
+		g_print("Telemetry: Failed to add sink %s: %d\n", spec, ret);
+		g_free(sink);
+		return ret;
+	}
+
+	g_print("Telemetry: Sending to %s\n", spec);
+	telemetry_sinks = g_list_append(telemetry_sinks, sink);
+
+	return 0;
+}
+
+/*
+ * Parses a list of "TYPE=HZ" rate limits, separated by commas. HZ must be
+ * between 1 and 1000000, or "off" or 0 to disable the packet type. Button
+ * and axis events can only be disabled.
+ */
+static int telemetry_set_rates(const char *spec)
+{
+	char **rates;
+	int ret = 0;
+	int i, type;
+
+	rates = g_strsplit(spec, ",", -1);
+	for (i = 0; rates[i] && ret == 0; i++) {
+		char *value = strchr(rates[i], '=');
+		char *end;
+		long hz;
+
+		ret = -EINVAL;
+		if (!value)
+			break;
+		*value++ = '\0';
+
+		for (type = 0; type < TELEMETRY_PACKET_BATCH; type++) {
+			if (strcmp(rates[i], telemetry_packet_names[type]))
+				continue;
+			if (strcmp(value, "off") == 0 ||
+			    strcmp(value, "0") == 0) {
+				telemetry_interval[type] = -1;
+				ret = 0;
+				break;
+			}
+			if (type == TELEMETRY_PACKET_BUTTONS ||
+			    type == TELEMETRY_PACKET_AXIS)
+				break;
+			errno = 0;
+			hz = strtol(value, &end, 10);
+			if (errno == 0 && end != value && *end == '\0' &&
+			    hz >= 1 && hz <= 1000000) {
+				telemetry_interval[type] = 1000000 / hz;
+				ret = 0;
+			}
+			break;
+		}
+	}
+	g_strfreev(rates);
+
+	if (ret < 0)
+		g_print("Telemetry: Invalid rate limit: %s\n", spec);
+
+	return ret;
+}
+
+/*
+ * Parses and removes the telemetry options from the command line, opens
+ * the telemetry sinks, and starts the flush thread. Returns a negative
+ * error code if an option is invalid or a sink cannot be opened.
+ */
+int telemetry_init(int *argc, char **argv[])
+{
+	int ret = 0;
+	int i, j;
+
+	if (telemetry_enabled)
+		return -EBUSY;
+
+	for (i = 1, j = 1; i < *argc; i++) {
+		char *arg = (*argv)[i];
+
+		if (g_str_has_prefix(arg, "--telemetry=")) {
+			if (ret == 0)
+				ret = telemetry_add_sink(arg + 12);
+		} else if (g_str_has_prefix(arg, "--telemetry-rate=")) {
+			if (ret == 0)
+				ret = telemetry_set_rates(arg + 17);
+		} else {
+			(*argv)[j++] = arg;
+		}
+	}
+	(*argv)[j] = NULL;
+	*argc = j;
+
+	if (ret == 0 && !telemetry_sinks)
+		ret = telemetry_add_sink(TELEMETRY_DEFAULT_SINK);
+
+	if (ret == 0) {
+		telemetry_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (telemetry_eventfd == -1) {
+			ret = -errno;
+			g_print("Telemetry: Failed to create eventfd: %d\n",
+				errno);
+		}
+	}
+
+	if (ret < 0) {
+		g_list_free_full(telemetry_sinks, telemetry_sink_free);
+		telemetry_sinks = NULL;
+		return ret;
+	}
+
+	telemetry_enabled = TRUE;
+	telemetry_running = TRUE;
+	telemetry_thread = g_thread_new("ouvrt-telemetry",
+					telemetry_flush_thread, NULL);
+
+	return 0;
+}
+
+/*
+ * Stops the flush thread after sending all queued packets, frees the
+ * per-device queues, and closes all telemetry sinks.
  */
 void telemetry_deinit()
 {
-	if (telemetry_fd > 0) {
-		close(telemetry_fd);
-		telemetry_fd = 0;
+	struct telemetry_device *tdev;
+	int i;
+
+	if (!telemetry_enabled)
+		return;
+
+	telemetry_enabled = FALSE;
+	g_atomic_int_set(&telemetry_running, FALSE);
+	telemetry_wake();
+	g_thread_join(telemetry_thread);
+	telemetry_thread = NULL;
+	close(telemetry_eventfd);
+	telemetry_eventfd = -1;
+
+	for (i = 0; i < 256; i++) {
+		tdev = telemetry_devices[i];
+		if (!tdev)
+			continue;
+		if (tdev->dropped) {
+			g_print("Telemetry: Dropped %" G_GUINT64_FORMAT
+				" records of device %d\n", tdev->dropped, i);
+		}
+		g_mutex_clear(&tdev->lock);
+		g_free(tdev);
+		telemetry_devices[i] = NULL;
 	}
+
+	g_list_free_full(telemetry_sinks, telemetry_sink_free);
+	telemetry_sinks = NULL;
 }
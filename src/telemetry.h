@@ -15,6 +15,22 @@
 #define TELEMETRY_PACKET_LIGHTHOUSE_FRAME	4
 #define TELEMETRY_PACKET_BUTTONS		5
 #define TELEMETRY_PACKET_AXIS			6
+#define TELEMETRY_PACKET_BATCH			7
+
+/*
+ * Raw IMU samples, IMU samples, poses, and lighthouse frames are coalesced
+ * per device into batch packets. A batch packet starts with this header,
+ * followed by count records. Each record consists of a single byte packet
+ * type, followed by the same payload as the corresponding single packet.
+ * The sequence number is incremented for each batch packet sent for a
+ * device, so receivers can detect packet loss.
+ */
+struct telemetry_batch_header {
+	uint8_t type;
+	uint8_t dev_id;
+	uint16_t count;
+	uint32_t sequence;
+} __attribute__((packed));
 
 struct imu_sample;
 struct raw_imu_sample;
@@ -0,0 +1,411 @@
+/*
+ * Thread scheduling and CPU affinity policies
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Policies are configured per thread class, which is either a device type
+ * name such as OuvrtRiftSensor, or one of the shared threads "usb" and
+ * "reactor". They can be loaded from a key file with one group per class:
+ *
+ *   [OuvrtRift]
+ *   name=rift-imu
+ *   cpus=2-3
+ *   policy=fifo
+ *   priority=20
+ *
+ * or given on the command line as "CLASS:KEY=VALUE[,KEY=VALUE...]".
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <glib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "thread-policy.h"
+
+struct thread_policy {
+	char *class_name;
+	char *name;
+	char *cpu_list;
+	cpu_set_t cpus;
+	int sched_policy;
+	int priority;
+	int nice;
+	bool has_nice;
+};
+
+struct thread_start {
+	const struct thread_policy *policy;
+	GThreadFunc func;
+	gpointer data;
+};
+
+static GHashTable *policies;
+
+static void thread_policy_free(gpointer data)
+{
+	struct thread_policy *policy = data;
+
+	g_free(policy->class_name);
+	g_free(policy->name);
+	g_free(policy->cpu_list);
+	g_free(policy);
+}
+
+static struct thread_policy *thread_policy_get(const char *class_name)
+{
+	struct thread_policy *policy;
+
+	if (!policies) {
+		policies = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+						 thread_policy_free);
+	}
+
+	policy = g_hash_table_lookup(policies, class_name);
+	if (!policy) {
+		policy = g_new0(struct thread_policy, 1);
+		policy->class_name = g_strdup(class_name);
+		policy->sched_policy = SCHED_OTHER;
+		/* Lowest real-time priority, if fifo or rr is configured */
+		policy->priority = 1;
+		g_hash_table_insert(policies, policy->class_name, policy);
+	}
+
+	return policy;
+}
+
+/*
+ * Parses a CPU list such as "0,2-3" into a CPU set.
+ */
+static int parse_cpu_list(const char *str, cpu_set_t *cpus)
+{
+	char **ranges;
+	int ret = 0;
+	int i;
+
+	CPU_ZERO(cpus);
+
+	ranges = g_strsplit(str, ",", -1);
+	for (i = 0; ranges[i]; i++) {
+		unsigned long first, last;
+		char *endp;
+
+		first = strtoul(ranges[i], &endp, 10);
+		if (endp == ranges[i]) {
+			ret = -EINVAL;
+			break;
+		}
+		last = first;
+		if (*endp == '-')
+			last = strtoul(endp + 1, &endp, 10);
+		if (*endp != '\0' || last < first || last >= CPU_SETSIZE) {
+			ret = -EINVAL;
+			break;
+		}
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+	}
+	g_strfreev(ranges);
+
+	if (ret == 0 && CPU_COUNT(cpus) == 0)
+		ret = -EINVAL;
+
+	return ret;
+}
+
+static int parse_int(const char *str, int min, int max, int *value)
+{
+	char *endp;
+	long val;
+
+	val = strtol(str, &endp, 10);
+	if (endp == str || *endp != '\0' || val < min || val > max)
+		return -EINVAL;
+
+	*value = val;
+	return 0;
+}
+
+/*
+ * Sets a single policy field from its key and string value.
+ */
+static int thread_policy_set(struct thread_policy *policy, const char *key,
+			     const char *value)
+{
+	int ret;
+
+	if (strcmp(key, "name") == 0) {
+		g_free(policy->name);
+		policy->name = g_strndup(value, 15);
+	} else if (strcmp(key, "cpus") == 0) {
+		ret = parse_cpu_list(value, &policy->cpus);
+		if (ret < 0)
+			return ret;
+		g_free(policy->cpu_list);
+		policy->cpu_list = g_strdup(value);
+	} else if (strcmp(key, "policy") == 0) {
+		if (strcmp(value, "fifo") == 0)
+			policy->sched_policy = SCHED_FIFO;
+		else if (strcmp(value, "rr") == 0)
+			policy->sched_policy = SCHED_RR;
+		else if (strcmp(value, "other") == 0)
+			policy->sched_policy = SCHED_OTHER;
+		else
+			return -EINVAL;
+	} else if (strcmp(key, "priority") == 0) {
+		return parse_int(value, 1, 99, &policy->priority);
+	} else if (strcmp(key, "nice") == 0) {
+		ret = parse_int(value, -20, 19, &policy->nice);
+		if (ret < 0)
+			return ret;
+		policy->has_nice = true;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Loads thread policies from a key file. If optional is set, a missing file
+ * is not an error.
+ */
+int ouvrt_thread_policy_load(const char *filename, bool optional)
+{
+	GError *error = NULL;
+	GKeyFile *key_file;
+	gchar **groups;
+	int ret = 0;
+	int i, j;
+
+	key_file = g_key_file_new();
+	if (!g_key_file_load_from_file(key_file, filename, G_KEY_FILE_NONE,
+				       &error)) {
+		if (!optional || !g_error_matches(error, G_FILE_ERROR,
+						  G_FILE_ERROR_NOENT)) {
+			g_print("Failed to load %s: %s\n", filename,
+				error->message);
+			ret = -EINVAL;
+		}
+		g_error_free(error);
+		g_key_file_free(key_file);
+		return ret;
+	}
+
+	groups = g_key_file_get_groups(key_file, NULL);
+	for (i = 0; groups[i] && ret == 0; i++) {
+		struct thread_policy *policy = thread_policy_get(groups[i]);
+		gchar **keys;
+
+		keys = g_key_file_get_keys(key_file, groups[i], NULL, NULL);
+		for (j = 0; keys && keys[j]; j++) {
+			gchar *value = g_key_file_get_string(key_file,
+							     groups[i],
+							     keys[j], NULL);
+
+			ret = thread_policy_set(policy, keys[j], value);
+			if (ret < 0) {
+				g_print("%s: Invalid thread policy %s=%s\n",
+					filename, keys[j], value);
+			}
+			g_free(value);
+			if (ret < 0)
+				break;
+		}
+		g_strfreev(keys);
+	}
+	g_strfreev(groups);
+	g_key_file_free(key_file);
+
+	return ret;
+}
+
+/*
+ * Parses a thread policy given as "CLASS:KEY=VALUE[,KEY=VALUE...]". Fields
+ * not mentioned keep the value from a previously loaded configuration.
+ */
+int ouvrt_thread_policy_parse(const char *spec)
+{
+	struct thread_policy *policy;
+	const char *colon;
+	char *class_name;
+	char **fields;
+	int ret = 0;
+	int i;
+
+	colon = strchr(spec, ':');
+	if (!colon || colon == spec) {
+		g_print("Invalid thread policy: %s\n", spec);
+		return -EINVAL;
+	}
+
+	class_name = g_strndup(spec, colon - spec);
+	policy = thread_policy_get(class_name);
+	g_free(class_name);
+
+	fields = g_strsplit(colon + 1, ",", -1);
+	for (i = 0; fields[i]; i++) {
+		char *value = strchr(fields[i], '=');
+
+		if (!value) {
+			ret = -EINVAL;
+		} else {
+			*value++ = '\0';
+			ret = thread_policy_set(policy, fields[i], value);
+		}
+		if (ret < 0) {
+			g_print("Invalid thread policy: %s\n", spec);
+			break;
+		}
+	}
+	g_strfreev(fields);
+
+	return ret;
+}
+
+/*
+ * Returns true if a policy is configured for the given thread class.
+ */
+bool ouvrt_thread_policy_exists(const char *class_name)
+{
+	return policies && g_hash_table_contains(policies, class_name);
+}
+
+static const char *sched_policy_name(int sched_policy)
+{
+	switch (sched_policy) {
+	case SCHED_FIFO:
+		return "fifo";
+	case SCHED_RR:
+		return "rr";
+	default:
+		return "other";
+	}
+}
+
+static void thread_policy_print(G_GNUC_UNUSED gpointer key, gpointer value,
+				G_GNUC_UNUSED gpointer user_data)
+{
+	struct thread_policy *policy = value;
+	GString *str = g_string_new(NULL);
+
+	if (policy->name)
+		g_string_append_printf(str, " name=%s", policy->name);
+	if (policy->cpu_list)
+		g_string_append_printf(str, " cpus=%s", policy->cpu_list);
+	g_string_append_printf(str, " policy=%s",
+			       sched_policy_name(policy->sched_policy));
+	if (policy->sched_policy != SCHED_OTHER)
+		g_string_append_printf(str, " priority=%d", policy->priority);
+	if (policy->has_nice)
+		g_string_append_printf(str, " nice=%d", policy->nice);
+
+	g_print("Thread policy %s:%s\n", policy->class_name, str->str);
+	g_string_free(str, TRUE);
+}
+
+/*
+ * Prints all configured thread policies.
+ */
+void ouvrt_thread_policy_report(void)
+{
+	if (!policies || g_hash_table_size(policies) == 0) {
+		g_print("Thread policy: default for all threads\n");
+		return;
+	}
+
+	g_hash_table_foreach(policies, thread_policy_print, NULL);
+}
+
+/*
+ * Frees all thread policies. Must only be called after all threads that were
+ * started with ouvrt_thread_new are joined.
+ */
+void ouvrt_thread_policy_deinit(void)
+{
+	g_clear_pointer(&policies, g_hash_table_destroy);
+}
+
+/*
+ * Applies the policy to the calling thread. Failures, for example due to
+ * missing CAP_SYS_NICE, are reported but not fatal.
+ */
+static void thread_policy_apply(const struct thread_policy *policy)
+{
+	struct sched_param param;
+	int ret;
+
+	if (policy->cpu_list) {
+		ret = pthread_setaffinity_np(pthread_self(),
+					     sizeof(policy->cpus),
+					     &policy->cpus);
+		if (ret) {
+			g_print("%s: Failed to set CPU affinity to %s: %s\n",
+				policy->class_name, policy->cpu_list,
+				strerror(ret));
+		}
+	}
+
+	if (policy->sched_policy != SCHED_OTHER) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = policy->priority;
+		ret = pthread_setschedparam(pthread_self(),
+					    policy->sched_policy, &param);
+		if (ret) {
+			g_print("%s: Failed to set scheduling policy %s: %s\n",
+				policy->class_name,
+				sched_policy_name(policy->sched_policy),
+				strerror(ret));
+		}
+	}
+
+	if (policy->has_nice) {
+		ret = setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+				  policy->nice);
+		if (ret < 0) {
+			g_print("%s: Failed to set nice value %d: %s\n",
+				policy->class_name, policy->nice,
+				strerror(errno));
+		}
+	}
+}
+
+static gpointer thread_start_routine(gpointer data)
+{
+	struct thread_start *start = data;
+	GThreadFunc func = start->func;
+	gpointer func_data = start->data;
+
+	if (start->policy)
+		thread_policy_apply(start->policy);
+	g_free(start);
+
+	return func(func_data);
+}
+
+/*
+ * Creates a new thread that runs with the policy configured for the given
+ * thread class, if any. The configured thread name takes precedence over
+ * the name passed in.
+ */
+GThread *ouvrt_thread_new(const char *class_name, const char *name,
+			  GThreadFunc func, gpointer data)
+{
+	struct thread_start *start;
+
+	start = g_new0(struct thread_start, 1);
+	start->func = func;
+	start->data = data;
+	if (policies)
+		start->policy = g_hash_table_lookup(policies, class_name);
+
+	if (start->policy && start->policy->name)
+		name = start->policy->name;
+
+	return g_thread_new(name, thread_start_routine, start);
+}
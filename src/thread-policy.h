@@ -0,0 +1,21 @@
+/*
+ * Thread scheduling and CPU affinity policies
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __THREAD_POLICY_H__
+#define __THREAD_POLICY_H__
+
+#include <glib.h>
+#include <stdbool.h>
+
+int ouvrt_thread_policy_load(const char *filename, bool optional);
+int ouvrt_thread_policy_parse(const char *spec);
+bool ouvrt_thread_policy_exists(const char *class_name);
+void ouvrt_thread_policy_report(void);
+void ouvrt_thread_policy_deinit(void);
+
+GThread *ouvrt_thread_new(const char *class_name, const char *name,
+			  GThreadFunc func, gpointer data);
+
+#endif /* __THREAD_POLICY_H__ */
@@ -0,0 +1,205 @@
+/*
+ * Trace events for frame latency analysis
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ *
+ * Each thread that records trace events gets its own ring buffer of
+ * timestamped events, so that recording never contends on a lock. Rings
+ * are kept until tracing is deinitialized, even after their thread exits,
+ * and are written out as Chrome trace event JSON, which can be loaded into
+ * chrome://tracing or the Perfetto UI.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* 256 KiB per thread */
+#define TRACE_RING_SIZE		16384
+
+struct trace_entry {
+	uint64_t time;
+	uint32_t sequence;
+	uint16_t event;
+	char phase;
+	uint8_t reserved;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	pid_t tid;
+	char name[16];
+	uint32_t sequence;
+	uint64_t head;
+	struct trace_entry entries[TRACE_RING_SIZE];
+};
+
+static const char *const event_names[TRACE_NUM_EVENTS] = {
+	[TRACE_USB_PAYLOAD] = "usb-payload",
+	[TRACE_FRAME_COMPLETE] = "frame-complete",
+	[TRACE_BLOB_DETECT] = "blob-detect",
+	[TRACE_IDENTIFY] = "identify",
+	[TRACE_PNP] = "pnp",
+	[TRACE_FUSION] = "fusion",
+	[TRACE_PUBLISH] = "publish",
+};
+
+bool trace_enabled;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings;
+static __thread struct trace_ring *trace_ring;
+
+/*
+ * Allocates the calling thread's ring buffer on its first event.
+ */
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring = trace_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+
+	pthread_mutex_lock(&trace_mutex);
+	ring->next = trace_rings;
+	trace_rings = ring;
+	pthread_mutex_unlock(&trace_mutex);
+
+	trace_ring = ring;
+
+	return ring;
+}
+
+void trace_record(enum trace_event event, char phase)
+{
+	struct trace_ring *ring = trace_ring_get();
+	struct trace_entry *entry;
+	struct timespec ts;
+
+	if (!ring)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	entry = &ring->entries[ring->head % TRACE_RING_SIZE];
+	entry->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	entry->sequence = ring->sequence;
+	entry->event = event;
+	entry->phase = phase;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_record_sequence(uint32_t sequence)
+{
+	struct trace_ring *ring = trace_ring_get();
+
+	if (ring)
+		ring->sequence = sequence;
+}
+
+/*
+ * Starts recording trace events.
+ */
+void trace_init(void)
+{
+	trace_enabled = true;
+}
+
+static void trace_dump_ring(FILE *f, struct trace_ring *ring, pid_t pid,
+			    bool *first)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+	fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+		"\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+		*first ? "" : ",", pid, ring->tid, ring->name);
+	*first = false;
+
+	/*
+	 * The oldest entries may be overwritten while they are written out,
+	 * which only garbles the beginning of the trace.
+	 */
+	for (; i < head; i++) {
+		struct trace_entry *entry = &ring->entries[i % TRACE_RING_SIZE];
+
+		fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"ouvrt\", "
+			"\"ph\": \"%c\", \"ts\": %llu.%03llu, \"pid\": %d, "
+			"\"tid\": %d, %s\"args\": {\"sequence\": %u}}",
+			entry->event < TRACE_NUM_EVENTS ?
+			event_names[entry->event] : "unknown", entry->phase,
+			(unsigned long long)entry->time / 1000,
+			(unsigned long long)entry->time % 1000, pid, ring->tid,
+			entry->phase == TRACE_PHASE_INSTANT ? "\"s\": \"t\", " :
+			"", entry->sequence);
+	}
+}
+
+/*
+ * Writes the events recorded so far by all threads to a file in Chrome
+ * trace event JSON format. Recording continues. Returns 0 on success or a
+ * negative error code.
+ */
+int trace_dump(const char *filename)
+{
+	struct trace_ring *ring;
+	bool first = true;
+	pid_t pid = getpid();
+	FILE *f;
+	int ret;
+
+	f = fopen(filename, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+	pthread_mutex_lock(&trace_mutex);
+	for (ring = trace_rings; ring; ring = ring->next)
+		trace_dump_ring(f, ring, pid, &first);
+	pthread_mutex_unlock(&trace_mutex);
+
+	fprintf(f, "\n]}\n");
+
+	ret = ferror(f) ? -EIO : 0;
+	if (fclose(f) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * Stops recording trace events and frees all ring buffers. Must only be
+ * called after all threads that record events have been stopped.
+ */
+void trace_deinit(void)
+{
+	struct trace_ring *ring, *next;
+
+	trace_enabled = false;
+
+	pthread_mutex_lock(&trace_mutex);
+	for (ring = trace_rings; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	trace_rings = NULL;
+	pthread_mutex_unlock(&trace_mutex);
+
+	trace_ring = NULL;
+}
@@ -0,0 +1,69 @@
+/*
+ * Trace events for frame latency analysis
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum trace_event {
+	TRACE_USB_PAYLOAD,
+	TRACE_FRAME_COMPLETE,
+	TRACE_BLOB_DETECT,
+	TRACE_IDENTIFY,
+	TRACE_PNP,
+	TRACE_FUSION,
+	TRACE_PUBLISH,
+	TRACE_NUM_EVENTS
+};
+
+/* Chrome trace event phases */
+#define TRACE_PHASE_BEGIN	'B'
+#define TRACE_PHASE_END		'E'
+#define TRACE_PHASE_INSTANT	'i'
+
+extern bool trace_enabled;
+
+void trace_record(enum trace_event event, char phase);
+void trace_record_sequence(uint32_t sequence);
+
+/*
+ * All trace points compile to a single, statically predicted not taken
+ * branch while tracing is disabled.
+ */
+static inline void trace_begin(enum trace_event event)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record(event, TRACE_PHASE_BEGIN);
+}
+
+static inline void trace_end(enum trace_event event)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record(event, TRACE_PHASE_END);
+}
+
+static inline void trace_instant(enum trace_event event)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record(event, TRACE_PHASE_INSTANT);
+}
+
+/*
+ * Sets the frame or IMU sample sequence number attached to all following
+ * events of the calling thread.
+ */
+static inline void trace_sequence(uint32_t sequence)
+{
+	if (__builtin_expect(trace_enabled, 0))
+		trace_record_sequence(sequence);
+}
+
+void trace_init(void);
+int trace_dump(const char *filename);
+void trace_deinit(void);
+
+#endif /* __TRACE_H__ */
@@ -7,24 +7,23 @@
 
 #include "blobwatch.h"
 #include "debug.h"
+#include "exposure-ring.h"
+#include "imu-ring.h"
 #include "leds.h"
 #include "maths.h"
 #include "opencv.h"
+#include "trace.h"
 #include "tracker.h"
 
+/* Frames are matched with exposures less than half a frame interval apart */
+#define TRACKER_EXPOSURE_MAX_DISTANCE	9000000
+
 struct _OuvrtTracker {
 	GObject parent_instance;
-	struct blobwatch *bw;
 	struct leds leds;
 	uint8_t radio_address[5];
-
-	uint64_t exposure_timestamp;
-	uint64_t exposure_time;
-	uint8_t led_pattern_phase;
-
-	uint64_t last_exposure_timestamp;
-	uint64_t last_exposure_time;
-	uint8_t last_led_pattern_phase;
+	struct imu_ring *imu_ring;
+	struct exposure_ring *exposure_ring;
 };
 
 G_DEFINE_TYPE(OuvrtTracker, ouvrt_tracker, G_TYPE_OBJECT)
@@ -54,33 +53,70 @@ void ouvrt_tracker_get_radio_address(OuvrtTracker *tracker, uint8_t address[5])
 	memcpy(address, tracker->radio_address, 5);
 }
 
+/*
+ * Stores an exposure reported by the tracked device, with its device
+ * timestamp, estimated CLOCK_MONOTONIC time in nanoseconds, exposure
+ * counter, and LED pattern phase. Must only be called from the device's IMU
+ * thread.
+ */
 void ouvrt_tracker_add_exposure(OuvrtTracker *tracker,
 				uint64_t device_timestamp, uint64_t time,
-				uint8_t led_pattern_phase)
+				uint32_t count, uint8_t led_pattern_phase)
 {
-	tracker->last_exposure_timestamp = tracker->exposure_timestamp;
-	tracker->last_exposure_time = tracker->exposure_time;
-	tracker->last_led_pattern_phase = tracker->led_pattern_phase;
-	tracker->exposure_timestamp = device_timestamp;
-	tracker->exposure_time = time;
-	tracker->led_pattern_phase = led_pattern_phase;
+	const struct exposure exposure = {
+		.device_timestamp = device_timestamp,
+		.time = time,
+		.count = count,
+		.led_pattern_phase = led_pattern_phase,
+	};
+
+	exposure_ring_push(tracker->exposure_ring, &exposure);
 }
 
-void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t *frame,
-				 int width, int height, uint64_t sof_time,
-				 struct blobservation **ob)
+/*
+ * Stores an IMU state of the tracked device, taken at the given
+ * CLOCK_MONOTONIC time in nanoseconds. Must only be called from the
+ * device's IMU thread.
+ */
+void ouvrt_tracker_add_imu_state(OuvrtTracker *tracker, uint64_t time,
+				 const struct imu_state *state)
+{
+	imu_ring_push(tracker->imu_ring, time, state);
+}
+
+/*
+ * Retrieves up to n IMU states taken since the previous call with the same
+ * reader, and before the given time, usually the start of exposure of the
+ * current camera frame. Each camera thread must use its own reader.
+ */
+unsigned int ouvrt_tracker_get_imu_states(OuvrtTracker *tracker,
+					  struct imu_ring_reader *reader,
+					  uint64_t time,
+					  struct imu_state *states,
+					  unsigned int n)
 {
-	uint8_t led_pattern_phase;
+	return imu_ring_read(tracker->imu_ring, reader, time, states, n);
+}
 
-	if (tracker->bw == NULL)
-		tracker->bw = blobwatch_new(width, height);
+/*
+ * Detects and identifies blobs in a frame. If the camera only read out a
+ * window of its sensor, x and y give the position of the window. Blobs are
+ * tracked over time in the given blob detector state, each camera must use
+ * its own.
+ */
+void ouvrt_tracker_process_frame(OuvrtTracker *tracker, struct blobwatch *bw,
+				 uint8_t *frame, int x, int y, int width,
+				 int height, uint64_t sof_time,
+				 struct blobservation **ob)
+{
+	uint8_t led_pattern_phase = 0;
+	struct exposure exposure;
 
-	if (sof_time < tracker->exposure_time)
-		led_pattern_phase = tracker->last_led_pattern_phase;
-	else
-		led_pattern_phase = tracker->led_pattern_phase;
+	if (exposure_ring_find_time(tracker->exposure_ring, sof_time,
+				    TRACKER_EXPOSURE_MAX_DISTANCE, &exposure))
+		led_pattern_phase = exposure.led_pattern_phase;
 
-	blobwatch_process(tracker->bw, frame, width, height, led_pattern_phase,
+	blobwatch_process(bw, frame, x, y, width, height, led_pattern_phase,
 			  &tracker->leds, ob);
 }
 
@@ -97,19 +133,33 @@ void ouvrt_tracker_process_blobs(OuvrtTracker *tracker,
 	/*
 	 * Estimate initial pose without previously known [rot|trans].
 	 */
+	trace_begin(TRACE_PNP);
 	estimate_initial_pose(blobs, num_blobs, leds->model.points,
 			      leds->model.num_points,
 			      camera_matrix, dist_coeffs, rot, trans,
 			      true);
+	trace_end(TRACE_PNP);
+}
+
+static void ouvrt_tracker_finalize(GObject *object)
+{
+	OuvrtTracker *self = OUVRT_TRACKER(object);
+
+	imu_ring_free(self->imu_ring);
+	exposure_ring_free(self->exposure_ring);
+	G_OBJECT_CLASS(ouvrt_tracker_parent_class)->finalize(object);
 }
 
-static void ouvrt_tracker_class_init(OuvrtTrackerClass *klass G_GNUC_UNUSED)
+static void ouvrt_tracker_class_init(OuvrtTrackerClass *klass)
 {
+	G_OBJECT_CLASS(klass)->finalize = ouvrt_tracker_finalize;
 }
 
 static void ouvrt_tracker_init(OuvrtTracker *self)
 {
 	leds_fini(&self->leds);
+	self->imu_ring = imu_ring_new();
+	self->exposure_ring = exposure_ring_new();
 }
 
 OuvrtTracker *ouvrt_tracker_new(void)
@@ -17,6 +17,9 @@ G_DECLARE_FINAL_TYPE(OuvrtTracker, ouvrt_tracker, OUVRT, TRACKER, GObject)
 struct leds;
 struct blob;
 struct blobservation;
+struct blobwatch;
+struct imu_state;
+struct imu_ring_reader;
 
 void ouvrt_tracker_register_leds(OuvrtTracker *tracker, struct leds *leds);
 void ouvrt_tracker_unregister_leds(OuvrtTracker *tracker, struct leds *leds);
@@ -27,10 +30,19 @@ void ouvrt_tracker_get_radio_address(OuvrtTracker *tracker, uint8_t address[5]);
 
 void ouvrt_tracker_add_exposure(OuvrtTracker *tracker,
 				uint64_t device_timestamp, uint64_t time,
-				uint8_t led_pattern_phase);
-
-void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t *frame,
-				 int width, int height, uint64_t sof_time,
+				uint32_t count, uint8_t led_pattern_phase);
+
+void ouvrt_tracker_add_imu_state(OuvrtTracker *tracker, uint64_t time,
+				 const struct imu_state *state);
+unsigned int ouvrt_tracker_get_imu_states(OuvrtTracker *tracker,
+					  struct imu_ring_reader *reader,
+					  uint64_t time,
+					  struct imu_state *states,
+					  unsigned int n);
+
+void ouvrt_tracker_process_frame(OuvrtTracker *tracker, struct blobwatch *bw,
+				 uint8_t *frame, int x, int y, int width,
+				 int height, uint64_t sof_time,
 				 struct blobservation **ob);
 void ouvrt_tracker_process_blobs(OuvrtTracker *tracker,
 				 struct blob *blobs, int num_blobs,
@@ -6,20 +6,414 @@
 #include <errno.h>
 #include <libusb.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
+#include "recorder.h"
+#include "thread-policy.h"
 #include "usb-device.h"
 
-typedef struct {
+/*
+ * All USB devices share a single libusb context, and a single event thread
+ * handles the transfers of all devices. The context is created when the first
+ * USB device is opened and destroyed when the last one is closed.
+ */
+struct usb_engine {
+	GMutex lock;
+	libusb_context *context;
+	int refcount;
+	GThread *thread;
+	int active;
+};
+
+static struct usb_engine usb_engine;
+
+/*
+ * Every transfer allocated via ouvrt_usb_device_alloc_transfer is tracked in
+ * the device's transfer pool, so that in-flight transfers can be cancelled
+ * and waited for before the device handle is closed.
+ */
+struct usb_transfer_entry {
+	struct libusb_transfer *transfer;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	struct _OuvrtUSBDevicePrivate *priv;
+	OuvrtDevice *dev;
+};
+
+typedef struct _OuvrtUSBDevicePrivate {
 	uint16_t vid;
 	uint16_t pid;
-	libusb_context *context;
 	libusb_device_handle *devh;
-	int completed;
+
+	GMutex lock;
+	GCond cond;
+	GList *transfers;
+	int busy;
+	bool stopping;
 } OuvrtUSBDevicePrivate;
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE(OuvrtUSBDevice, ouvrt_usb_device, \
 				    OUVRT_TYPE_DEVICE)
 
+/*
+ * Handles USB transfers of all devices.
+ */
+static gpointer usb_engine_thread(G_GNUC_UNUSED gpointer data)
+{
+	struct timeval tv = {
+		.tv_sec = 1,
+	};
+	int ret;
+
+	while (g_atomic_int_get(&usb_engine.active)) {
+		ret = libusb_handle_events_timeout_completed(usb_engine.context,
+							     &tv, NULL);
+		if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			g_print("libusb_handle_events failed with: %d\n", ret);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the shared libusb context, creating it and starting the event
+ * thread if necessary.
+ */
+static libusb_context *usb_engine_ref(void)
+{
+	libusb_context *context = NULL;
+	int ret;
+
+	g_mutex_lock(&usb_engine.lock);
+
+	if (usb_engine.refcount == 0) {
+		ret = libusb_init(&usb_engine.context);
+		if (ret < 0) {
+			g_print("USB: Failed to initialize libusb: %d\n", ret);
+			g_mutex_unlock(&usb_engine.lock);
+			return NULL;
+		}
+
+		usb_engine.active = 1;
+		usb_engine.thread = ouvrt_thread_new("usb", "ouvrt-usb",
+						     usb_engine_thread, NULL);
+	}
+
+	usb_engine.refcount++;
+	context = usb_engine.context;
+
+	g_mutex_unlock(&usb_engine.lock);
+
+	return context;
+}
+
+/*
+ * Stops the event thread and destroys the shared libusb context after the
+ * last USB device was closed.
+ */
+static void usb_engine_unref(void)
+{
+	g_mutex_lock(&usb_engine.lock);
+
+	if (--usb_engine.refcount == 0) {
+		g_atomic_int_set(&usb_engine.active, 0);
+#if LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(usb_engine.context);
+#endif
+		g_thread_join(usb_engine.thread);
+		usb_engine.thread = NULL;
+
+		libusb_exit(usb_engine.context);
+		usb_engine.context = NULL;
+	}
+
+	g_mutex_unlock(&usb_engine.lock);
+}
+
+/*
+ * Allocates a transfer that belongs to the device's transfer pool. It must
+ * only be submitted with ouvrt_usb_device_submit_transfer. The transfer and
+ * its buffer are freed when the device is closed.
+ */
+struct libusb_transfer *ouvrt_usb_device_alloc_transfer(OuvrtUSBDevice *self,
+							int iso_packets)
+{
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	struct usb_transfer_entry *entry;
+	struct libusb_transfer *transfer;
+
+	transfer = libusb_alloc_transfer(iso_packets);
+	if (!transfer)
+		return NULL;
+
+	entry = g_new0(struct usb_transfer_entry, 1);
+	entry->transfer = transfer;
+	entry->priv = priv;
+	entry->dev = OUVRT_DEVICE(self);
+
+	g_mutex_lock(&priv->lock);
+	priv->transfers = g_list_prepend(priv->transfers, entry);
+	g_mutex_unlock(&priv->lock);
+
+	return transfer;
+}
+
+/*
+ * Writes a completed transfer to the session recording. For isochronous
+ * transfers, only the received part of each packet is recorded.
+ */
+static void usb_transfer_record(OuvrtDevice *dev,
+				struct libusb_transfer *transfer)
+{
+	struct recorder_usb_transfer info = {
+		.endpoint = transfer->endpoint,
+		.type = transfer->type,
+		.num_iso_packets = transfer->num_iso_packets,
+		.status = transfer->status,
+		.actual_length = transfer->actual_length,
+	};
+	int num_packets = transfer->num_iso_packets;
+	struct iovec *iov;
+	uint32_t *lengths;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		struct iovec data[2] = {
+			{ &info, sizeof(info) },
+			{ transfer->buffer, MAX(transfer->actual_length, 0) },
+		};
+
+		recorder_writev(RECORD_USB_TRANSFER, 0, dev->id, 0, data, 2);
+		return;
+	}
+
+	iov = g_newa(struct iovec, 2 + num_packets);
+	lengths = g_newa(uint32_t, num_packets);
+
+	iov[0].iov_base = &info;
+	iov[0].iov_len = sizeof(info);
+	iov[1].iov_base = lengths;
+	iov[1].iov_len = num_packets * sizeof(*lengths);
+	for (i = 0; i < num_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc =
+			&transfer->iso_packet_desc[i];
+
+		lengths[i] = desc->status == LIBUSB_TRANSFER_COMPLETED ?
+			     desc->actual_length : 0;
+		iov[2 + i].iov_base = libusb_get_iso_packet_buffer(transfer, i);
+		iov[2 + i].iov_len = lengths[i];
+	}
+
+	recorder_writev(RECORD_USB_TRANSFER, 0, dev->id, 0, iov,
+			2 + num_packets);
+}
+
+/*
+ * Calls the device's transfer callback and keeps track of in-flight
+ * transfers.
+ */
+static void usb_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct usb_transfer_entry *entry = transfer->user_data;
+	OuvrtUSBDevicePrivate *priv = entry->priv;
+
+	if (recorder_enabled)
+		usb_transfer_record(entry->dev, transfer);
+
+	transfer->callback = entry->callback;
+	transfer->user_data = entry->user_data;
+
+	entry->callback(transfer);
+
+	g_mutex_lock(&priv->lock);
+	priv->busy--;
+	g_cond_broadcast(&priv->cond);
+	g_mutex_unlock(&priv->lock);
+}
+
+static struct usb_transfer_entry *
+usb_transfer_entry_find(OuvrtUSBDevicePrivate *priv,
+			struct libusb_transfer *transfer)
+{
+	GList *link;
+
+	for (link = priv->transfers; link; link = link->next) {
+		struct usb_transfer_entry *entry = link->data;
+
+		if (entry->transfer == transfer)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Submits a transfer from the device's transfer pool. This may be called
+ * from the transfer callback to resubmit the transfer. Returns
+ * LIBUSB_ERROR_INTERRUPTED if the device is being closed.
+ */
+int ouvrt_usb_device_submit_transfer(OuvrtUSBDevice *self,
+				     struct libusb_transfer *transfer)
+{
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+	struct usb_transfer_entry *entry;
+	int ret;
+
+	g_mutex_lock(&priv->lock);
+	entry = usb_transfer_entry_find(priv, transfer);
+	if (!entry || priv->stopping) {
+		g_mutex_unlock(&priv->lock);
+		return entry ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_NOT_FOUND;
+	}
+	priv->busy++;
+	g_mutex_unlock(&priv->lock);
+
+	entry->callback = transfer->callback;
+	entry->user_data = transfer->user_data;
+	transfer->callback = usb_transfer_cb;
+	transfer->user_data = entry;
+
+	ret = libusb_submit_transfer(transfer);
+	if (ret < 0) {
+		transfer->callback = entry->callback;
+		transfer->user_data = entry->user_data;
+
+		g_mutex_lock(&priv->lock);
+		priv->busy--;
+		g_cond_broadcast(&priv->cond);
+		g_mutex_unlock(&priv->lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Cancels all in-flight transfers of the device, waits for their callbacks
+ * to return, and frees the transfer pool.
+ */
+static void usb_transfer_pool_free(OuvrtUSBDevicePrivate *priv)
+{
+	gint64 end_time = g_get_monotonic_time() + G_USEC_PER_SEC;
+	GList *link;
+
+	g_mutex_lock(&priv->lock);
+	priv->stopping = true;
+	if (priv->busy) {
+		for (link = priv->transfers; link; link = link->next) {
+			struct usb_transfer_entry *entry = link->data;
+
+			libusb_cancel_transfer(entry->transfer);
+		}
+	}
+	while (priv->busy) {
+		if (!g_cond_wait_until(&priv->cond, &priv->lock, end_time)) {
+			g_print("USB: %d transfers still in flight\n",
+				priv->busy);
+			break;
+		}
+	}
+
+	/* Leak transfers that are still in flight, rather than crash */
+	if (priv->busy == 0) {
+		for (link = priv->transfers; link; link = link->next) {
+			struct usb_transfer_entry *entry = link->data;
+
+			free(entry->transfer->buffer);
+			libusb_free_transfer(entry->transfer);
+			g_free(entry);
+		}
+	}
+	g_list_free(priv->transfers);
+	priv->transfers = NULL;
+	priv->stopping = false;
+	g_mutex_unlock(&priv->lock);
+}
+
+/*
+ * Reconstructs a completed transfer from a recorded RECORD_USB_TRANSFER
+ * payload and passes it to the device's replay_transfer operation, with the
+ * time it was received. Isochronous packets are laid out with a fixed stride,
+ * as expected by libusb_get_iso_packet_buffer_simple. The device must not be
+ * started. Returns -ENOTSUP if the device does not support replay, or
+ * -EINVAL if the payload is invalid.
+ */
+int ouvrt_usb_device_replay_transfer(OuvrtUSBDevice *self, const void *data,
+				     size_t size, uint64_t time)
+{
+	OuvrtUSBDeviceClass *klass = OUVRT_USB_DEVICE_GET_CLASS(self);
+	const struct recorder_usb_transfer *info = data;
+	const uint8_t *payload = (const uint8_t *)(info + 1);
+	const uint32_t *lengths = (const uint32_t *)payload;
+	struct libusb_transfer *transfer;
+	uint32_t stride = 0;
+	size_t total = 0;
+	int num_packets;
+	int i;
+
+	if (!klass->replay_transfer)
+		return -ENOTSUP;
+
+	if (size < sizeof(*info))
+		return -EINVAL;
+	size -= sizeof(*info);
+
+	num_packets = info->num_iso_packets;
+	if (size < num_packets * sizeof(*lengths))
+		return -EINVAL;
+	for (i = 0; i < num_packets; i++) {
+		stride = MAX(stride, lengths[i]);
+		total += lengths[i];
+	}
+	if (num_packets) {
+		payload += num_packets * sizeof(*lengths);
+		size -= num_packets * sizeof(*lengths);
+	} else {
+		stride = info->actual_length;
+		total = info->actual_length;
+	}
+	if (size < total)
+		return -EINVAL;
+
+	transfer = libusb_alloc_transfer(num_packets);
+	if (!transfer)
+		return -ENOMEM;
+
+	transfer->endpoint = info->endpoint;
+	transfer->type = info->type;
+	transfer->status = info->status;
+	transfer->actual_length = info->actual_length;
+	transfer->num_iso_packets = num_packets;
+	transfer->length = num_packets ? num_packets * stride : stride;
+	transfer->buffer = g_malloc(MAX(transfer->length, 1));
+
+	if (num_packets) {
+		for (i = 0; i < num_packets; i++) {
+			struct libusb_iso_packet_descriptor *desc =
+				&transfer->iso_packet_desc[i];
+
+			desc->length = stride;
+			desc->actual_length = lengths[i];
+			desc->status = LIBUSB_TRANSFER_COMPLETED;
+			memcpy(transfer->buffer + i * stride, payload,
+			       lengths[i]);
+			payload += lengths[i];
+		}
+	} else {
+		memcpy(transfer->buffer, payload, total);
+	}
+
+	klass->replay_transfer(self, transfer, time);
+
+	g_free(transfer->buffer);
+	libusb_free_transfer(transfer);
+
+	return 0;
+}
+
 libusb_device_handle *ouvrt_usb_device_get_handle(OuvrtUSBDevice *self)
 {
 	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
@@ -47,6 +441,7 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(dev);
 	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
 	struct libusb_device_descriptor desc;
+	libusb_context *context;
 	libusb_device **devices;
 	uint8_t bus, address;
 	gchar *endp;
@@ -63,15 +458,22 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 
 	address = g_ascii_strtoull(endp + 1, NULL, 10);
 
-	libusb_init(&priv->context);
+	context = usb_engine_ref();
+	if (!context)
+		return -ENODEV;
 
-	num = libusb_get_device_list(priv->context, &devices);
-	if (num < 0)
+	num = libusb_get_device_list(context, &devices);
+	if (num < 0) {
+		usb_engine_unref();
 		return num;
+	}
 	for (i = 0; i < num; i++) {
 		ret = libusb_get_device_descriptor(devices[i], &desc);
-		if (ret < 0)
+		if (ret < 0) {
+			libusb_free_device_list(devices, 1);
+			usb_engine_unref();
 			return ret;
+		}
 
 		if (desc.idVendor == priv->vid && desc.idProduct == priv->pid &&
 		    bus == libusb_get_bus_number(devices[i]) &&
@@ -80,6 +482,7 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 	}
 	if (i == num) {
 		libusb_free_device_list(devices, 1);
+		usb_engine_unref();
 		return -ENODEV;
 	}
 
@@ -102,6 +505,7 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 		} else {
 			g_print("%s: failed to open: %d\n", dev->name, ret);
 		}
+		usb_engine_unref();
 		return ret;
 	}
 
@@ -109,27 +513,11 @@ static int ouvrt_usb_device_open(OuvrtDevice *dev)
 }
 
 /*
- * Handles USB transfers.
+ * USB transfers are handled by the shared event thread, there is nothing to
+ * do here. Subclasses may chain up after their own setup.
  */
-static void ouvrt_usb_device_thread(OuvrtDevice *dev)
+static void ouvrt_usb_device_thread(G_GNUC_UNUSED OuvrtDevice *dev)
 {
-	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(dev);
-	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
-	struct timeval tv = {
-		.tv_sec = 1,
-	};
-	int ret;
-
-	while (dev->active) {
-		ret = libusb_handle_events_timeout_completed(priv->context, &tv,
-							     &priv->completed);
-		if (ret != 0) {
-			g_print("libusb_handle_events failed with: %d\n", ret);
-			break;
-		}
-		if (priv->completed)
-			dev->active = false;
-	}
 }
 
 /*
@@ -140,8 +528,15 @@ static void ouvrt_usb_device_close(OuvrtDevice *dev)
 	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(dev);
 	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
 
+	if (!priv->devh)
+		return;
+
+	usb_transfer_pool_free(priv);
+
 	libusb_close(priv->devh);
 	priv->devh = NULL;
+
+	usb_engine_unref();
 }
 
 /*
@@ -149,6 +544,12 @@ static void ouvrt_usb_device_close(OuvrtDevice *dev)
  */
 static void ouvrt_usb_device_finalize(GObject *object)
 {
+	OuvrtUSBDevice *self = OUVRT_USB_DEVICE(object);
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+
+	g_cond_clear(&priv->cond);
+	g_mutex_clear(&priv->lock);
+
 	G_OBJECT_CLASS(ouvrt_usb_device_parent_class)->finalize(object);
 }
 
@@ -160,6 +561,10 @@ static void ouvrt_usb_device_class_init(OuvrtUSBDeviceClass *klass)
 	OUVRT_DEVICE_CLASS(klass)->close = ouvrt_usb_device_close;
 }
 
-static void ouvrt_usb_device_init(G_GNUC_UNUSED OuvrtUSBDevice *self)
+static void ouvrt_usb_device_init(OuvrtUSBDevice *self)
 {
+	OuvrtUSBDevicePrivate *priv = ouvrt_usb_device_get_instance_private(self);
+
+	g_mutex_init(&priv->lock);
+	g_cond_init(&priv->cond);
 }
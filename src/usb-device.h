@@ -21,11 +21,21 @@ G_DECLARE_DERIVABLE_TYPE(OuvrtUSBDevice, ouvrt_usb_device, OUVRT, USB_DEVICE, \
 
 struct _OuvrtUSBDeviceClass {
 	OuvrtDeviceClass parent_class;
+
+	void (*replay_transfer)(OuvrtUSBDevice *self,
+				struct libusb_transfer *transfer,
+				uint64_t time);
 };
 
 libusb_device_handle *ouvrt_usb_device_get_handle(OuvrtUSBDevice *self);
 void ouvrt_usb_device_set_vid_pid(OuvrtUSBDevice *self, uint16_t vid,
 				  uint16_t pid);
+struct libusb_transfer *ouvrt_usb_device_alloc_transfer(OuvrtUSBDevice *self,
+							int iso_packets);
+int ouvrt_usb_device_submit_transfer(OuvrtUSBDevice *self,
+				     struct libusb_transfer *transfer);
+int ouvrt_usb_device_replay_transfer(OuvrtUSBDevice *self, const void *data,
+				     size_t size, uint64_t time);
 
 G_END_DECLS
 
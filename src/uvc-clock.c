@@ -0,0 +1,173 @@
+/*
+ * UVC device clock to host time mapping
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * The device clock rate is estimated by a least squares fit of source clock
+ * values against host reception times. Reception is delayed by a varying
+ * amount of USB scheduling and completion latency, so the line is moved
+ * down to the sample with the lowest latency instead of going through the
+ * average. The remaining error is the minimum latency, which is constant.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "uvc-clock.h"
+
+/* Minimum number of samples and time span before the mapping is used */
+#define UVC_CLOCK_MIN_SAMPLES	16
+#define UVC_CLOCK_MIN_SPAN	50000000
+/* Samples further apart than this restart the estimation */
+#define UVC_CLOCK_MAX_GAP	1000000000
+
+void uvc_clock_reset(struct uvc_clock *clock)
+{
+	memset(clock, 0, sizeof(*clock));
+}
+
+/*
+ * Finds the sample in the given range of the window that lies furthest
+ * below a line with the given slope, relative to the oldest sample.
+ */
+static void uvc_clock_min_residual(const struct uvc_clock *clock,
+				   unsigned int first, unsigned int start,
+				   unsigned int end, double slope, double *x,
+				   double *y)
+{
+	uint64_t stc0 = clock->stc[first];
+	uint64_t time0 = clock->time[first];
+	double min = 0;
+	unsigned int i;
+
+	for (i = start; i < end; i++) {
+		unsigned int j = (first + i) % UVC_CLOCK_SAMPLES;
+		double xj = clock->stc[j] - stc0;
+		double yj = clock->time[j] - time0;
+
+		if (i == start || yj - slope * xj < min) {
+			min = yj - slope * xj;
+			*x = xj;
+			*y = yj;
+		}
+	}
+}
+
+static void uvc_clock_fit(struct uvc_clock *clock)
+{
+	unsigned int first = (clock->head + UVC_CLOCK_SAMPLES - clock->count) %
+			     UVC_CLOCK_SAMPLES;
+	uint64_t stc0 = clock->stc[first];
+	uint64_t time0 = clock->time[first];
+	double mx = 0, my = 0, sxx = 0, sxy = 0;
+	double slope, offset;
+	unsigned int i, j, k;
+	double x, y;
+
+	for (i = 0; i < clock->count; i++) {
+		j = (first + i) % UVC_CLOCK_SAMPLES;
+		mx += clock->stc[j] - stc0;
+		my += clock->time[j] - time0;
+	}
+	mx /= clock->count;
+	my /= clock->count;
+
+	for (i = 0; i < clock->count; i++) {
+		double dx, dy;
+
+		j = (first + i) % UVC_CLOCK_SAMPLES;
+		dx = clock->stc[j] - stc0 - mx;
+		dy = clock->time[j] - time0 - my;
+		sxx += dx * dx;
+		sxy += dx * dy;
+	}
+
+	if (sxx <= 0 || sxy <= 0)
+		return;
+	slope = sxy / sxx;
+
+	/*
+	 * Refine the slope with a line through the samples with the least
+	 * reception latency in the older and newer half of the window.
+	 */
+	for (k = 0; k < 2; k++) {
+		double xa, ya, xb, yb;
+
+		uvc_clock_min_residual(clock, first, 0, clock->count / 2,
+				       slope, &xa, &ya);
+		uvc_clock_min_residual(clock, first, clock->count / 2,
+				       clock->count, slope, &xb, &yb);
+		if (xb <= xa || yb <= ya)
+			break;
+		slope = (yb - ya) / (xb - xa);
+	}
+
+	/* Lower envelope: the sample with the least reception latency */
+	uvc_clock_min_residual(clock, first, 0, clock->count, slope, &x, &y);
+	offset = y - slope * x;
+
+	clock->stc0 = stc0;
+	clock->time0 = time0;
+	clock->slope = slope;
+	clock->offset = offset;
+	clock->valid = true;
+}
+
+/*
+ * Adds the 32-bit source time clock value of a payload header's SCR field,
+ * and the time in ns when the payload was received.
+ */
+void uvc_clock_add_sample(struct uvc_clock *clock, uint32_t stc,
+			  uint64_t time)
+{
+	unsigned int last = (clock->head + UVC_CLOCK_SAMPLES - 1) %
+			    UVC_CLOCK_SAMPLES;
+	uint64_t stc64;
+
+	if (clock->count) {
+		/* Source clock values are expected to increase */
+		if ((int32_t)(stc - (uint32_t)clock->last_stc) <= 0 ||
+		    time > clock->time[last] + UVC_CLOCK_MAX_GAP) {
+			uvc_clock_reset(clock);
+			stc64 = stc;
+		} else {
+			stc64 = clock->last_stc +
+				(uint32_t)(stc - (uint32_t)clock->last_stc);
+		}
+	} else {
+		stc64 = stc;
+	}
+
+	clock->stc[clock->head] = stc64;
+	clock->time[clock->head] = time;
+	clock->head = (clock->head + 1) % UVC_CLOCK_SAMPLES;
+	if (clock->count < UVC_CLOCK_SAMPLES)
+		clock->count++;
+	clock->last_stc = stc64;
+
+	if (clock->count >= UVC_CLOCK_MIN_SAMPLES &&
+	    time - clock->time[(clock->head + UVC_CLOCK_SAMPLES -
+				clock->count) % UVC_CLOCK_SAMPLES] >=
+	    UVC_CLOCK_MIN_SPAN)
+		uvc_clock_fit(clock);
+}
+
+/*
+ * Converts a 32-bit presentation time stamp close to the last added source
+ * clock value into host time in ns. Returns false if there are not enough
+ * samples yet.
+ */
+bool uvc_clock_to_host(const struct uvc_clock *clock, uint32_t pts,
+		       uint64_t *time)
+{
+	int64_t stc;
+
+	if (!clock->valid)
+		return false;
+
+	stc = clock->last_stc + (int32_t)(pts - (uint32_t)clock->last_stc) -
+	      clock->stc0;
+	*time = clock->time0 + (int64_t)(clock->offset + clock->slope * stc);
+
+	return true;
+}
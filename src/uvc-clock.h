@@ -0,0 +1,40 @@
+/*
+ * UVC device clock to host time mapping
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __UVC_CLOCK_H__
+#define __UVC_CLOCK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UVC_CLOCK_SAMPLES	128
+
+/*
+ * Maps the device clock that is used for the presentation time stamps and
+ * source clock reference in UVC payload headers to CLOCK_MONOTONIC time,
+ * from pairs of source clock values and host reception times in ns.
+ */
+struct uvc_clock {
+	uint64_t stc[UVC_CLOCK_SAMPLES];
+	uint64_t time[UVC_CLOCK_SAMPLES];
+	unsigned int head;
+	unsigned int count;
+	uint64_t last_stc;
+
+	/* time = time0 + offset + slope * (stc - stc0) */
+	bool valid;
+	uint64_t stc0;
+	uint64_t time0;
+	double offset;
+	double slope;
+};
+
+void uvc_clock_reset(struct uvc_clock *clock);
+void uvc_clock_add_sample(struct uvc_clock *clock, uint32_t stc,
+			  uint64_t time);
+bool uvc_clock_to_host(const struct uvc_clock *clock, uint32_t pts,
+		       uint64_t *time);
+
+#endif /* __UVC_CLOCK_H__ */
@@ -30,6 +30,12 @@ struct uvc_probe_commit_control {
 	__u8 bMaxVersion;
 } __attribute__((packed));
 
+#define UVC_STREAM_FID		(1 << 0)
+#define UVC_STREAM_EOF		(1 << 1)
+#define UVC_STREAM_PTS		(1 << 2)
+#define UVC_STREAM_SCR		(1 << 3)
+#define UVC_STREAM_ERR		(1 << 6)
+
 struct uvc_payload_header {
 	__u8 bHeaderLength;
 	__u8 bmHeaderInfo;
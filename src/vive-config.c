@@ -4,26 +4,180 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <zlib.h>
 
+#include "vive-config.h"
+#include "cache.h"
 #include "device.h"
 #include "hidraw.h"
 #include "vive-hid-reports.h"
 
+/* Upper limit for compressed configuration data, to catch runaway reads */
+#define VIVE_CONFIG_MAX_SIZE		65536
+/* Output buffer increment for streaming inflate */
+#define VIVE_CONFIG_INFLATE_STEP	4096
+
+/*
+ * The cache entry stores the first configuration read report payload as a
+ * fingerprint in front of the inflated JSON data. Reading this single report
+ * from the device is enough to check whether the cached data still matches.
+ */
+#define VIVE_CONFIG_CACHE_MAGIC		0x43455649 /* "IVEC" */
+#define VIVE_CONFIG_CACHE_VERSION	1
+
+struct vive_config_cache_header {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t len;
+	uint8_t payload[62];
+} __attribute__((packed));
+
+/*
+ * Reads the next chunk of compressed configuration data.
+ */
+static int vive_config_read(OuvrtDevice *dev,
+			    struct vive_config_read_report *report, int count)
+{
+	int ret;
+
+	ret = hid_get_feature_report_timeout(dev->fd, report, sizeof(*report),
+					     100);
+	if (ret < 0) {
+		g_print("%s: Read error after %d bytes: %d\n", dev->name,
+			count, errno);
+		return ret;
+	}
+
+	if (report->len > 62) {
+		g_print("%s: Invalid configuration data at %d\n", dev->name,
+			count);
+		return -EINVAL;
+	}
+
+	return report->len;
+}
+
+/*
+ * Inflates a chunk of compressed configuration data, growing the output
+ * array as necessary. Returns 1 at the end of the zlib stream, 0 if more
+ * input is required, or a negative error code.
+ */
+static int vive_config_inflate(z_stream *strm, GByteArray *json,
+			       unsigned char *buf, unsigned int len)
+{
+	guint offset;
+	int ret;
+
+	strm->next_in = buf;
+	strm->avail_in = len;
+
+	do {
+		offset = json->len;
+		g_byte_array_set_size(json, offset + VIVE_CONFIG_INFLATE_STEP);
+		strm->next_out = json->data + offset;
+		strm->avail_out = VIVE_CONFIG_INFLATE_STEP;
+
+		ret = inflate(strm, Z_NO_FLUSH);
+		g_byte_array_set_size(json, json->len - strm->avail_out);
+		if (ret == Z_STREAM_END)
+			return 1;
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return -EINVAL;
+	} while (strm->avail_out == 0);
+
+	return 0;
+}
+
+/*
+ * Returns the cache entry name for the device's configuration data, or NULL
+ * if the device can not be identified.
+ */
+static char *vive_config_cache_name(OuvrtDevice *dev,
+				    uint32_t firmware_version)
+{
+	if (!dev->serial || !firmware_version)
+		return NULL;
+
+	return g_strdup_printf("%s_%u.vive", dev->serial, firmware_version);
+}
+
+/*
+ * Returns the cached configuration data if its fingerprint matches the
+ * first read report, or NULL.
+ */
+static char *vive_config_cache_lookup(const char *name,
+				      struct vive_config_read_report *report)
+{
+	struct vive_config_cache_header *header;
+	char *contents;
+	char *json;
+	gsize length;
+
+	if (!ouvrt_cache_get_contents(name, &contents, &length))
+		return NULL;
+
+	header = (struct vive_config_cache_header *)contents;
+	if (length <= sizeof(*header) ||
+	    header->magic != VIVE_CONFIG_CACHE_MAGIC ||
+	    header->version != VIVE_CONFIG_CACHE_VERSION) {
+		ouvrt_cache_remove(name);
+		g_free(contents);
+		return NULL;
+	}
+
+	if (header->len != report->len ||
+	    memcmp(header->payload, report->payload, report->len) != 0) {
+		g_free(contents);
+		return NULL;
+	}
+
+	json = g_strndup(contents + sizeof(*header), length - sizeof(*header));
+	g_free(contents);
+
+	return json;
+}
+
+static void vive_config_cache_store(const char *name,
+				    struct vive_config_read_report *report,
+				    const char *json, gsize json_len)
+{
+	struct vive_config_cache_header *header;
+	gsize length = sizeof(*header) + json_len;
+
+	header = g_malloc0(length);
+	header->magic = VIVE_CONFIG_CACHE_MAGIC;
+	header->version = VIVE_CONFIG_CACHE_VERSION;
+	header->len = report->len;
+	memcpy(header->payload, report->payload, report->len);
+	memcpy(header + 1, json, json_len);
+
+	ouvrt_cache_set_contents(name, (const char *)header, length);
+
+	g_free(header);
+}
+
 /*
  * Downloads configuration data stored in the Vive headset and controller.
+ * If the firmware version is known, the inflated data is cached on disk and
+ * only the first read report is needed to validate the cache entry later.
  */
-char *ouvrt_vive_get_config(OuvrtDevice *dev)
+char *ouvrt_vive_get_config(OuvrtDevice *dev, uint32_t firmware_version)
 {
 	struct vive_config_start_report start_report = {
 		.id = VIVE_CONFIG_START_REPORT_ID,
 	};
+	struct vive_config_read_report first_report = {
+		.id = VIVE_CONFIG_READ_REPORT_ID,
+	};
 	struct vive_config_read_report read_report = {
 		.id = VIVE_CONFIG_READ_REPORT_ID,
 	};
-	unsigned char *config_json;
-	unsigned char *config_z;
+	struct vive_config_read_report *report = &first_report;
+	GByteArray *json;
+	char *cache_name;
+	char *config_json;
 	z_stream strm;
 	int count = 0;
 	int ret;
@@ -35,38 +189,21 @@ char *ouvrt_vive_get_config(OuvrtDevice *dev)
 		return NULL;
 	}
 
-	config_z = g_malloc(4096);
-
-	do {
-		ret = hid_get_feature_report_timeout(dev->fd, &read_report,
-						     sizeof(read_report), 100);
-		if (ret < 0) {
-			g_print("%s: Read error after %d bytes: %d\n",
-				dev->name, count, errno);
-			g_free(config_z);
-			return NULL;
-		}
-
-		if (read_report.len > 62) {
-			g_print("%s: Invalid configuration data at %d\n",
-				dev->name, count);
-			g_free(config_z);
-			return NULL;
-		}
+	ret = vive_config_read(dev, &first_report, count);
+	if (ret < 0)
+		return NULL;
 
-		if (count + read_report.len > 4096) {
-			g_print("%s: Configuration data too large\n",
+	cache_name = vive_config_cache_name(dev, firmware_version);
+	if (cache_name) {
+		config_json = vive_config_cache_lookup(cache_name,
+						       &first_report);
+		if (config_json) {
+			g_debug("%s: Read cached configuration data\n",
 				dev->name);
-			g_free(config_z);
-			return NULL;
+			g_free(cache_name);
+			return config_json;
 		}
-
-		memcpy(config_z + count, read_report.payload, read_report.len);
-		count += read_report.len;
-	} while (read_report.len);
-
-	g_debug("%s: Read configuration data: %d bytes\n", dev->name,
-		count);
+	}
 
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
@@ -76,30 +213,75 @@ char *ouvrt_vive_get_config(OuvrtDevice *dev)
 	ret = inflateInit(&strm);
 	if (ret != Z_OK) {
 		g_print("inflate_init failed: %d\n", ret);
-		g_free(config_z);
+		g_free(cache_name);
 		return NULL;
 	}
 
-	config_json = g_malloc(32768);
+	json = g_byte_array_sized_new(VIVE_CONFIG_INFLATE_STEP);
+
+	for (;;) {
+		if (report->len == 0) {
+			g_print("%s: Truncated configuration data: %d bytes\n",
+				dev->name, count);
+			ret = -EINVAL;
+			break;
+		}
+
+		count += report->len;
+
+		ret = vive_config_inflate(&strm, json, report->payload,
+					  report->len);
+		if (ret < 0) {
+			g_print("%s: Failed to inflate configuration data\n",
+				dev->name);
+			break;
+		}
+		if (ret == 1)
+			break;
+
+		if (count > VIVE_CONFIG_MAX_SIZE) {
+			g_print("%s: Configuration data too large\n",
+				dev->name);
+			ret = -EFBIG;
+			break;
+		}
+
+		report = &read_report;
+		ret = vive_config_read(dev, report, count);
+		if (ret < 0)
+			break;
+	}
 
-	strm.avail_in = count;
-	strm.next_in = config_z;
-	strm.avail_out = 32768;
-	strm.next_out = config_json;
+	inflateEnd(&strm);
 
-	ret = inflate(&strm, Z_FINISH);
-	g_free(config_z);
-	if (ret != Z_STREAM_END) {
-		g_print("%s: Failed to inflate configuration data: %d\n",
-			dev->name, ret);
-		g_free(config_json);
+	if (ret < 0) {
+		g_byte_array_free(json, TRUE);
+		g_free(cache_name);
 		return NULL;
 	}
 
-	g_debug("%s: Inflated configuration data: %lu bytes\n",
-		dev->name, strm.total_out);
+	/* Drain the remaining reports up to the zero length terminator */
+	while (report->len) {
+		report = &read_report;
+		ret = vive_config_read(dev, report, count);
+		if (ret < 0)
+			break;
+		count += report->len;
+		if (count > VIVE_CONFIG_MAX_SIZE)
+			break;
+	}
+
+	g_debug("%s: Read configuration data: %d bytes\n", dev->name, count);
+	g_debug("%s: Inflated configuration data: %u bytes\n", dev->name,
+		json->len);
+
+	if (cache_name) {
+		vive_config_cache_store(cache_name, &first_report,
+					(const char *)json->data, json->len);
+		g_free(cache_name);
+	}
 
-	config_json[strm.total_out] = '\0';
+	g_byte_array_append(json, (const guint8 *)"", 1);
 
-	return g_realloc(config_json, strm.total_out + 1);
+	return (char *)g_byte_array_free(json, FALSE);
 }
@@ -6,8 +6,10 @@
 #ifndef __VIVE_CONFIG_H__
 #define __VIVE_CONFIG_H__
 
+#include <stdint.h>
+
 #include "device.h"
 
-char *ouvrt_vive_get_config(OuvrtDevice *dev);
+char *ouvrt_vive_get_config(OuvrtDevice *dev, uint32_t firmware_version);
 
-#endif /* __VIVE_LIGHTHOUSE_CONFIG_H__ */
+#endif /* __VIVE_CONFIG_H__ */
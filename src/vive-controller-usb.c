@@ -41,7 +41,8 @@ G_DEFINE_TYPE(OuvrtViveControllerUSB, ouvrt_vive_controller_usb, \
 /*
  * Downloads the configuration data stored in the controller
  */
-static int vive_controller_usb_get_config(OuvrtViveControllerUSB *self)
+static int vive_controller_usb_get_config(OuvrtViveControllerUSB *self,
+					  uint32_t firmware_version)
 {
 	char *config_json;
 	JsonObject *object;
@@ -50,7 +51,7 @@ static int vive_controller_usb_get_config(OuvrtViveControllerUSB *self)
 	gint64 device_pid, device_vid;
 	const char *serial;
 
-	config_json = ouvrt_vive_get_config(&self->dev);
+	config_json = ouvrt_vive_get_config(&self->dev, firmware_version);
 	if (!config_json)
 		return -1;
 
@@ -176,6 +177,7 @@ void vive_controller_decode_button_message(OuvrtViveControllerUSB *self,
 static int vive_controller_usb_start(OuvrtDevice *dev)
 {
 	OuvrtViveControllerUSB *self = OUVRT_VIVE_CONTROLLER_USB(dev);
+	uint32_t firmware_version = 0;
 	int ret;
 
 	g_free(dev->name);
@@ -183,12 +185,12 @@ static int vive_controller_usb_start(OuvrtDevice *dev)
 
 	self->watchman.name = dev->name;
 
-	ret = vive_get_firmware_version(dev);
+	ret = vive_get_firmware_version(dev, &firmware_version);
 	if (ret < 0 && errno == EPIPE) {
 		g_print("%s: Failed to get firmware version\n", dev->name);
 		return ret;
 	}
-	ret = vive_controller_usb_get_config(self);
+	ret = vive_controller_usb_get_config(self, firmware_version);
 
 	return 0;
 }
@@ -244,7 +246,7 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 		}
 
 		if (fds[0].revents & POLLIN) {
-			ret = read(dev->fds[0], buf, sizeof(buf));
+			ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
@@ -258,7 +260,7 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 			}
 		}
 		if (fds[1].revents & POLLIN) {
-			ret = read(dev->fds[1], buf, sizeof(buf));
+			ret = ouvrt_device_read(dev, 1, buf, sizeof(buf));
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
@@ -272,7 +274,7 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 			}
 		}
 		if (fds[2].revents & POLLIN) {
-			ret = read(dev->fds[2], buf, sizeof(buf));
+			ret = ouvrt_device_read(dev, 2, buf, sizeof(buf));
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
@@ -315,6 +317,7 @@ static void ouvrt_vive_controller_usb_class_init(OuvrtViveControllerUSBClass *kl
 static void ouvrt_vive_controller_usb_init(OuvrtViveControllerUSB *self)
 {
 	self->dev.type = DEVICE_TYPE_CONTROLLER;
+	self->dev.has_pose = TRUE;
 	self->config = NULL;
 	self->imu.sequence = 0;
 	self->imu.time = 0;
@@ -47,7 +47,8 @@ G_DEFINE_TYPE(OuvrtViveController, ouvrt_vive_controller, OUVRT_TYPE_DEVICE)
 /*
  * Downloads the configuration data stored in the controller
  */
-static int vive_controller_get_config(OuvrtViveController *self)
+static int vive_controller_get_config(OuvrtViveController *self,
+				      uint32_t firmware_version)
 {
 	char *config_json;
 	JsonObject *object;
@@ -55,10 +56,12 @@ static int vive_controller_get_config(OuvrtViveController *self)
 	const char *device_class;
 	gint64 device_pid, device_vid;
 
-	config_json = ouvrt_vive_get_config(&self->dev);
+	config_json = ouvrt_vive_get_config(&self->dev, firmware_version);
 	if (!config_json)
 		return -1;
 
+	if (self->config)
+		json_node_unref(self->config);
 	self->config = json_from_string(config_json, NULL);
 	g_free(config_json);
 	if (!self->config) {
@@ -387,16 +390,17 @@ static int vive_controller_start(OuvrtDevice *dev)
 static void vive_controller_thread(OuvrtDevice *dev)
 {
 	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
+	uint32_t firmware_version;
 	unsigned char buf[64];
 	struct pollfd fds;
 	int ret;
 
-	ret = vive_get_firmware_version(dev);
+	ret = vive_get_firmware_version(dev, &firmware_version);
 	if (ret < 0 && errno == EPIPE) {
 		g_print("%s: No connected controller found\n", dev->name);
 	}
 	if (!ret) {
-		ret = vive_controller_get_config(self);
+		ret = vive_controller_get_config(self, firmware_version);
 		if (!ret) {
 			g_print("%s: Controller %s connected\n", dev->name,
 				self->serial);
@@ -435,11 +439,12 @@ static void vive_controller_thread(OuvrtDevice *dev)
 		}
 
 		if (!self->connected) {
-			ret = vive_get_firmware_version(dev);
+			ret = vive_get_firmware_version(dev, &firmware_version);
 			if (ret < 0)
 				continue;
 
-			ret = vive_controller_get_config(self);
+			ret = vive_controller_get_config(self,
+							 firmware_version);
 			if (ret < 0)
 				continue;
 
@@ -463,7 +468,7 @@ static void vive_controller_thread(OuvrtDevice *dev)
 			}
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
+		ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
 		if (ret == -1) {
 			g_print("%s: Read error: %d\n", dev->name, errno);
 			continue;
@@ -11,9 +11,10 @@
 #include "hidraw.h"
 
 /*
- * Retrieves the device firmware version and hardware revision
+ * Retrieves the device firmware version and hardware revision, and optionally
+ * returns the firmware version.
  */
-int vive_get_firmware_version(OuvrtDevice *dev)
+int vive_get_firmware_version(OuvrtDevice *dev, uint32_t *version)
 {
 	struct vive_firmware_version_report report = {
 		.id = VIVE_FIRMWARE_VERSION_REPORT_ID,
@@ -39,5 +40,8 @@ int vive_get_firmware_version(OuvrtDevice *dev)
 		report.hardware_revision, report.hardware_version_major,
 		report.hardware_version_minor, report.hardware_version_micro);
 
+	if (version)
+		*version = firmware_version;
+
 	return 0;
 }
@@ -179,7 +179,7 @@ static void vive_headset_mainboard_thread(OuvrtDevice *dev)
 			continue;
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
+		ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
 		if (ret == -1) {
 			g_print("%s: Read error: %d\n", dev->name, errno);
 			continue;
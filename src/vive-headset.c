@@ -37,7 +37,8 @@ G_DEFINE_TYPE(OuvrtViveHeadset, ouvrt_vive_headset, OUVRT_TYPE_DEVICE)
 /*
  * Downloads the configuration data stored in the headset
  */
-static int vive_headset_get_config(OuvrtViveHeadset *self)
+static int vive_headset_get_config(OuvrtViveHeadset *self,
+				   uint32_t firmware_version)
 {
 	char *config_json;
 	JsonObject *object;
@@ -46,7 +47,7 @@ static int vive_headset_get_config(OuvrtViveHeadset *self)
 	gint64 device_pid, device_vid;
 	const char *serial;
 
-	config_json = ouvrt_vive_get_config(&self->dev);
+	config_json = ouvrt_vive_get_config(&self->dev, firmware_version);
 	if (!config_json)
 		return -1;
 
@@ -170,15 +171,16 @@ static void vive_headset_decode_pulse_report(OuvrtViveHeadset *self,
 static int vive_headset_start(OuvrtDevice *dev)
 {
 	OuvrtViveHeadset *self = OUVRT_VIVE_HEADSET(dev);
+	uint32_t firmware_version;
 	int ret;
 
-	ret = vive_get_firmware_version(dev);
+	ret = vive_get_firmware_version(dev, &firmware_version);
 	if (ret < 0) {
 		g_print("%s: Failed to get firmware version\n", dev->name);
 		return ret;
 	}
 
-	ret = vive_headset_get_config(self);
+	ret = vive_headset_get_config(self, firmware_version);
 	if (ret < 0) {
 		g_print("%s: Failed to read configuration\n", dev->name);
 		return ret;
@@ -242,7 +244,7 @@ static void vive_headset_thread(OuvrtDevice *dev)
 		}
 
 		if (fds[0].revents & POLLIN) {
-			ret = read(dev->fds[0], buf, sizeof(buf));
+			ret = ouvrt_device_read(dev, 0, buf, sizeof(buf));
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name,
 					errno);
@@ -257,7 +259,7 @@ static void vive_headset_thread(OuvrtDevice *dev)
 			vive_imu_decode_message(dev, &self->imu, buf, 52);
 		}
 		if (fds[1].revents & POLLIN) {
-			ret = read(dev->fds[1], buf, sizeof(buf));
+			ret = ouvrt_device_read(dev, 1, buf, sizeof(buf));
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name,
 					errno);
@@ -301,6 +303,7 @@ static void ouvrt_vive_headset_class_init(OuvrtViveHeadsetClass *klass)
 static void ouvrt_vive_headset_init(OuvrtViveHeadset *self)
 {
 	self->dev.type = DEVICE_TYPE_HMD;
+	self->dev.has_pose = TRUE;
 	self->imu.sequence = 0;
 	self->imu.time = 0;
 	self->imu.state.pose.rotation.w = 1.0;
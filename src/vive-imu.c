@@ -13,6 +13,7 @@
 #include "hidraw.h"
 #include "imu.h"
 #include "telemetry.h"
+#include "trace.h"
 
 static inline int oldest_sequence_index(uint8_t a, uint8_t b, uint8_t c)
 {
@@ -105,6 +106,14 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 		    seq == (uint8_t)(last_seq - 2))
 			continue;
 
+		trace_sequence(seq);
+
+		/* Count samples that were missed since the last message */
+		if (imu->time && seq != (uint8_t)(imu->sequence + 1)) {
+			stats_count(&dev->stats, STATS_IMU_SAMPLES_LOST,
+				    (uint8_t)(seq - imu->sequence - 1));
+		}
+
 		raw.acc[0] = (int16_t)__le16_to_cpu(sample->acc[0]);
 		raw.acc[1] = (int16_t)__le16_to_cpu(sample->acc[1]);
 		raw.acc[2] = (int16_t)__le16_to_cpu(sample->acc[2]);
@@ -143,6 +152,8 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 			pose_update(dt / 48e6, &imu->state.pose, &s);
 
 			telemetry_send_pose(dev->id, &imu->state.pose);
+			ouvrt_device_publish_pose(dev, 0, &imu->state.pose,
+						  &s.angular_velocity, NULL);
 		}
 
 		imu->sequence = seq;